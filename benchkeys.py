@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+#
+# Time typing into the middle of files from 1 KB to 1 GB: each key is sent to
+# ec in a pseudo-terminal and timed until the screen shows it. The first key
+# opens the gap at the edit point, so it's shown apart from the rest, which
+# should take about the same time whatever the file size.
+#
+#   ./benchkeys.py [-n keys] [-e ./ec] [size ...]     e.g. size 4K, 10M, 1G
+
+import os, pty, select, shutil, sys, tempfile, time, fcntl, termios, struct
+
+def parseSize(s):
+    mult = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}
+    return int(s[:-1]) * mult[s[-1].upper()] if s[-1].upper() in mult else int(s)
+
+def makeFile(path, size):
+    line = b'%010d the quick brown fox jumps over the lazy dog\n'
+    n = 0
+    with open(path, 'wb') as f:
+        chunk = b''.join(line % i for i in range(16384))
+        while n + len(chunk) <= size:
+            f.write(chunk)
+            n += len(chunk)
+        i = n // len(line % 0)
+        while n < size:
+            s = (line % i)[:size - n]
+            f.write(s)
+            n += len(s)
+            i += 1
+    return max(n // len(line % 0), 1)
+
+class Editor:
+    def __init__(self, ec, dir, fname):
+        self.pid, self.fd = pty.fork()
+        if self.pid == 0:
+            fcntl.ioctl(0, termios.TIOCSWINSZ, struct.pack('HHHH', 24, 80, 0, 0))
+            os.chdir(dir)
+            os.environ.update(TERM='xterm', HOME=dir, LINES='24', COLUMNS='80')
+            os.execv(ec, [ec, fname])
+
+    # read what the editor writes until it's been quiet for idle seconds
+    def settle(self, idle, limit=600):
+        end = time.time() + limit
+        while time.time() < end:
+            r, _, _ = select.select([self.fd], [], [], idle)
+            if not r:
+                return
+            os.read(self.fd, 1 << 16)
+
+    # send a key and return the seconds until the screen shows mark
+    def key(self, k, mark):
+        out = b''
+        t0 = time.perf_counter()
+        os.write(self.fd, k)
+        while mark not in out:
+            r, _, _ = select.select([self.fd], [], [], 60)
+            if not r:
+                raise RuntimeError('no echo of %r' % k)
+            out += os.read(self.fd, 1 << 16)
+        return time.perf_counter() - t0
+
+    # the typing is thrown away
+    def quit(self):
+        os.kill(self.pid, 9)
+        os.waitpid(self.pid, 0)
+        os.close(self.fd)
+
+def main():
+    args = sys.argv[1:]
+    keys = 200
+    ec = os.path.abspath('./ec')
+    while args and args[0].startswith('-'):
+        opt = args.pop(0)
+        if opt == '-n':
+            keys = int(args.pop(0))
+        elif opt == '-e':
+            ec = os.path.abspath(args.pop(0))
+        else:
+            sys.exit('usage: benchkeys.py [-n keys] [-e ec] [size ...]')
+    sizes = args or ['1K', '1M', '10M', '100M', '1G']
+
+    dir = tempfile.mkdtemp(prefix='benchkeys')
+    open(os.path.join(dir, '.exrc'), 'w').write('set journal=n\n')
+    print('%8s  %10s  %10s  %10s  %10s' % ('size', 'first ms', 'median ms', '90% ms',
+                                            'max ms'))
+    try:
+        for s in sizes:
+            lines = makeFile(os.path.join(dir, 'f.txt'), parseSize(s))
+            ed = Editor(ec, dir, 'f.txt')
+            ed.settle(1.0)
+            for k in (b'\x11G', b'%d\r' % (lines // 2)):
+                os.write(ed.fd, k)
+                ed.settle(0.3)
+            first = ed.key(b'#', b'#')
+            times = sorted(ed.key(b'#', b'#') for i in range(keys))
+            ed.quit()
+            ms = lambda t: '%10.3f' % (t * 1000)
+            print('%8s  %s  %s  %s  %s' % (s, ms(first), ms(times[len(times) // 2]),
+                                           ms(times[len(times) * 9 // 10]), ms(times[-1])))
+            sys.stdout.flush()
+    finally:
+        shutil.rmtree(dir)
+
+main()
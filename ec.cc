@@ -22,11 +22,12 @@
 #include <sys/wait.h>
 #include <signal.h>
 #include <stdarg.h>
+#include <time.h>
 
 #include "termp.h"
 #include "ec.h"
 
-#define NO_UPDATE_DURING_INPUT
+#define FRAME_WAIT  50      // most ms a burst of keys holds off an update
 
 static const char* Intro =
     "Macro Editor  6.10  " __DATE__ "  Type ctrl-K then H for help\n";
@@ -39,31 +40,29 @@ const signed char CH_BELL =     0x07;   // ASCII bell char
 const signed char CH_ESC =      0x1b;   // ASCII escape char
 const signed char CH_RUB =      0x7f;   // ASCII rubout char
 
-class Cancel
-{
-};
-
-void updateWindows ();
 void centerCursor (void);
 void sayWait(void);
 char* currOptions(void);
+long replaceMatches (const SearchPattern* pat, const char* replStr,
+                     int replStrLen);
+void findReplace (const SearchPattern* pat, const char* findStr,
+                  int findStrLen, const char* replStr, int replStrLen);
 void findReplace (const char* findStr, int findStrLen,
                   const char* replStr, int replStrLen);
 void doQcommand (int ch);
 void doKcommand (int ch);
-void doCommand (int ch);
-const char* execString (const char* pcStart, const char *pcEnd, int rep);
 void execBuffer (int exb);
 void adjustTopRow (void);
 void initCmdBuf (void);
 void getCommand (const char* msg, bool isFile = false);
+void readSettings (void);
 
 
 // ----------------------------------------------------------------------------
 // global variables
 
 termOptStr  termSave;                   // saved terminal characteristics
-BuffRec buffer[12];                     // 12 edit buffers
+BuffRec buffer[MAX_BUFFERS];            // 12 edit buffers
 short   screenImage[SCRMAXHT][SCRMAXWD]; // internal image of screen
 char    statusLine[SCRMAXWD];           // status line string
 char    divideLine[SCRMAXWD];           // split window dividing line string
@@ -83,7 +82,6 @@ int     topRow, botRow;                 // screen row #s
 int     topA, botA;                     // window A row #s
 int     topB, botB;                     // window B row #s
 int     buffA, buffB;                   // window buffer #s
-char*   lastTopPos;                     // previous top char position
 int     ansiColors;                     // TRUE to force ANSI black on white
 
 char    command, cmdChar2;
@@ -94,6 +92,8 @@ int     cursRow, cursCol;               // cursor loc on screen
 int     curRowSv, curColSv;             // cursor loc saved during long cmd
 bool    screenReady, insertMode, quitting, doMake;
 bool    splitMode, topWindow, longCommand, makeBak;
+bool    syncSave;                       // TRUE to fsync files when saved
+bool    showOutStats;                   // TRUE to show output bytes/frame
 const char* insMsg;                     // INSERT, REPLACE string ptr
 char*   clipBoard;                      // clipboard data pointer
 long    clipSize;                       // clipboard char size
@@ -108,6 +108,8 @@ char    lastFind[MAX_LINE];             // last QF, QA command
 int     macroLevel;                     // macro recursion level
 int     prevBuff;                       // buffer before getCommand()
 int     givenTabSize;                   // given tab spacing (if any)
+char    message[SCRMAXWD];              // message to show after next update
+struct timespec lastFrame;              // when the screen was last updated
 
 static const char* help[] = {
 "------ Editor Help ------  control key summary:\n",
@@ -141,13 +143,13 @@ o EOL |clipbd |       |clipbd |clipbd|\n",
 "  ^QS begin of line, ^QD end of line,    ^QG\"n\" goto line n\n",
 "\n",
 "\n",
-"\n",
 "Insert / Delete:\n",
 "  ^H  delete character backward         ^T  delete word\n",
 "  ^G  delete character forward          ^Y  delete line\n",
 "  ^J  tag current position              ^V  toggle insert/replace mode\n",
 "  ^O  cut   -or-  ^QO  copy   tag-to-cursor text to clipboard\n",
 "  ^P or ^U  paste clipboard at cursor\n",
+"  ^QU undo,  ^QY redo\n",
 "Find / Replace:\n",
 "  ^QF<options>\"string\"   find string  ('\"' can be any delimiter)\n",
 "    (Control chars in string are entered with a '^'. ex: '^M' for return)\n",
@@ -166,6 +168,9 @@ o EOL |clipbd |       |clipbd |clipbd|\n",
 " ^KD,  ^KX  save buffer 0 and exit editor,   ^QQ  exit the editor\n",
 " ^KE  save buf 0, exit, and make\n",
 " ^KA  toggle black-on-white\n",
+" ^KI  show buffer storage statistics\n",
+" ^KF  toggle terminal output bytes/frame on the status line\n",
+" ^KP  toggle macro profiling,  ^KM  show the last macro profile\n",
 "\n",
 "Macros may be any sequence of the above commands, entered as letters\n",
 " (upper or lower case) into any buffer. Executed with ^Qi (i=buffer).\n",
@@ -195,7 +200,7 @@ Error::Error(const char* fmt, ...)
 
 Error::~Error()
 {
-    delete message;
+    delete[] message;
 }
 
 // ----------------------------------------------------------------------------
@@ -203,7 +208,12 @@ Error::~Error()
 
 void Error::report()
 {
-    putchar(CH_BELL);
+    if (noTerminal)
+    {
+        fprintf(stderr, "ec: %s\n", message);
+        return;
+    }
+    putChar(CH_BELL);
     char errLine[200];
     snprintf(errLine, 199, "\nERROR: %s\n", message);
     attrib = AT_REVERSE + AT_BOLD;
@@ -211,6 +221,19 @@ void Error::report()
     attrib = 0;
 }
 
+// ----------------------------------------------------------------------------
+// Set a printf-like message to be shown on the bottom line after the next
+// screen update.
+
+void showMessage(const char* fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(message, SCRMAXWD-1, fmt, ap);
+    va_end(ap);
+    strcat(message, "\n");
+}
+
 // ----------------------------------------------------------------------------
 // adjust bTopRowPos if the cursor is moved off screen.
 
@@ -233,26 +256,59 @@ void adjustTopRow()
             backLine(&btopRowPos, botRow-topRow);
         }
     }
-    if (!splitMode)
-    {
-        char* p = btopRowPos;
-        backLine(&p, 1);
-        if (p == lastTopPos && lastTopPos != bstart)
-        {
-            gotoxy(0, screenHt-1);
-            putchar(CH_LF);
-            clearLineC();
-            movec((char*)&screenImage[1][0], (char* )&screenImage[0][0],
-                (long )(SCRMAXWD*(screenHt-1)) * sizeof(short));
-            for (int i = 0; i < screenWd-1; i++)
-                screenImage[screenHt-1][i] = ' ';
-        }
-    }
-    lastTopPos = btopRowPos;
 }
 
 // ----------------------------------------------------------------------------
-// Update screen display of current buffer(s).
+// Return TRUE if the screen hasn't been updated for FRAME_WAIT ms.
+
+bool frameOverdue()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec - lastFrame.tv_sec) * 1000 +
+           (t.tv_nsec - lastFrame.tv_nsec) / 1000000 >= FRAME_WAIT;
+}
+
+// ----------------------------------------------------------------------------
+// Return the status line's 4-character note on buffer sb's file.
+
+static int statusBuff;          // buffer the status line was drawn for
+
+static const char* fileStat(int sb)
+{
+    const char* progress = saveProgress(sb);
+    if (progress)
+        return progress;
+    if (buffer[sb].open && buffer[sb].newFile)
+        return " new";
+    if (buffer[sb].open && buffer[sb].readOnly)
+        return "[RO]";
+    return "file";
+}
+
+// ----------------------------------------------------------------------------
+// Redraw the status line's note on buffer sb's file, if the line is for it,
+// as a background save goes on. Called from a timer, so the cursor is put
+// back where it was.
+
+void redrawFileStat(int sb)
+{
+    if (noTerminal || sb != statusBuff || !statusLine[0])
+        return;
+    memcpy(statusLine + 8, fileStat(sb), 4);
+    int col, row;
+    cursorAt(&col, &row);
+    int prevAttrib = attrib;
+    attrib = AT_REVERSE + AT_BOLD;
+    update(statusLine, 0, 0, 0, 0);
+    attrib = prevAttrib;
+    gotoxy(col, row);
+}
+
+// ----------------------------------------------------------------------------
+// Update screen display of current buffer(s). The cursor's row and the
+// status line are drawn first; the rest gives way to any key typed
+// meanwhile, and is finished by a later update.
 
 void updateWindows()
 {
@@ -264,38 +320,9 @@ void updateWindows()
         notUpdated = FALSE;
         adjustTopRow();
         bToBuffer();
-        if (splitMode)
-        {
-            attrib = AT_REVERSE + AT_BOLD;
-            char* p;
-            for (p = divideLine; p < divideLine + screenWd - 1; p++)
-                *p = '-';
-            *p = 0;
-            char s[MAX_LINE];
-            snprintf(s, MAX_LINE, " buffer=%d ", buffB);
-            memcpy(divideLine + screenWd/2 - 5, s, strlen(s));
-            update(divideLine, 0, 0, screenHt/2, screenHt/2);
-            attrib = 0;
-            if (topWindow)
-            {
-                update(buffer[buffB].topRowPos, buffer[buffB].hScroll,
-                 buffer[buffB].tabSize, topB, botB);
-                update(buffer[buffA].topRowPos, buffer[buffA].hScroll,
-                 buffer[buffA].tabSize, topA, botA);
-            }
-            else
-            {
-                update(buffer[buffA].topRowPos, buffer[buffA].hScroll,
-                 buffer[buffA].tabSize, topA, botA);
-                update(buffer[buffB].topRowPos, buffer[buffB].hScroll,
-                 buffer[buffB].tabSize, topB, botB);
-            }
-        }
-        else
-        {
-            attrib = 0;
-            update(btopRowPos, bhScroll, btabSize, topRow, botRow);
-        }
+        attrib = 0;
+        scrollToTop(btopRowPos, bhScroll, topRow, botRow);
+        update(btopRowPos, bhScroll, btabSize, topRow, botRow, CURSROW);
         if (cursCol < 0)
         {
             bhScroll = max(bhScroll - screenWd/2, 0);
@@ -307,18 +334,13 @@ void updateWindows()
             notUpdated = TRUE;
         }
     } while (notUpdated);
+    bToBuffer();
+    int row = cursRow, col = cursCol;
 
-    gotoxy(cursCol, cursRow);
-    const char* fileStat = "file";
     const char* curFileName = "-none-";
     if (buffer[b].open)
-    {
-        if (buffer[b].newFile)
-            fileStat = " new";
-        else if (buffer[b].readOnly)
-            fileStat = "[RO]";
         curFileName = buffer[b].fpath;
-    }
+    statusBuff = b;
 
     char lEndMsg = ' ';
     switch (buffer[b].lineEnding)
@@ -328,21 +350,28 @@ void updateWindows()
     }
 
     snprintf(statusLine, SCRMAXWD, "----- %c %4s: %-33s",
-        command, fileStat, curFileName);
+        command, fileStat(b), curFileName);
     char* p = statusLine + strlen(statusLine);
     while (p < statusLine + screenWd - 30)
         *p++ = ' ';
     snprintf(p, SCRMAXWD, "buffer=%d [    ,   ] %s %c -----", buffA, insMsg,
              lEndMsg);
+    if (showOutStats)
+    {
+        // last frame's output, where it fits left of the buffer number
+        char s[MAX_LINE];
+        snprintf(s, MAX_LINE, " %ldB/%ldw ", outStats.frameBytes,
+                 outStats.frameWrites);
+        char* sp = p - strlen(s) - 1;
+        char* q = sp - 1;
+        while (q > statusLine && q < p && *q == ' ')
+            q++;
+        if (q == p)
+            memcpy(sp, s, strlen(s));
+    }
 
     if (bcursPos != lastCursPos)
-    {
-        attrib = AT_REVERSE + AT_BOLD;
-        update(statusLine, 0, 0, 0, 0);
-        attrib = 0;
-        gotoxy(cursCol, cursRow);
         cursToLineChar();
-    }
     lastCursPos = bcursPos;
     char s[MAX_LINE];
     snprintf(s, MAX_LINE, "%-4d,%-3d", lineNum, charNum);
@@ -350,12 +379,45 @@ void updateWindows()
     attrib = AT_REVERSE + AT_BOLD;
     update(statusLine, 0, 0, 0, 0);
     attrib = 0;
+
+    bool complete = TRUE;
+    if (splitMode)
+    {
+        attrib = AT_REVERSE + AT_BOLD;
+        for (p = divideLine; p < divideLine + screenWd - 1; p++)
+            *p = '-';
+        *p = 0;
+        snprintf(s, MAX_LINE, " buffer=%d ", buffB);
+        memcpy(divideLine + screenWd/2 - 5, s, strlen(s));
+        update(divideLine, 0, 0, screenHt/2, screenHt/2);
+        attrib = 0;
+
+        // the other window
+        int ob = topWindow ? buffB : buffA;
+        int otop = topWindow ? topB : topA;
+        int obot = topWindow ? botB : botA;
+        scrollToTop(buffer[ob].topRowPos, buffer[ob].hScroll, otop, obot);
+        complete = update(buffer[ob].topRowPos, buffer[ob].hScroll,
+                          buffer[ob].tabSize, otop, obot, CHECKKEY);
+    }
+    if (complete)
+        update(btopRowPos, bhScroll, btabSize, topRow, botRow, CHECKKEY);
+    cursRow = row;
+    cursCol = col;
+    clock_gettime(CLOCK_MONOTONIC, &lastFrame);
+
+    if (message[0])
+    {
+        update(message, 0, 8, screenHt-1, screenHt-1);
+        message[0] = 0;
+    }
+    gotoxy(cursCol, cursRow);
 }
 
 // ----------------------------------------------------------------------------
 // Screen was just resized-- redraw it.
 
-void screenRedraw(int sigRaised)
+void screenRedraw()
 {
     // get new screen size
     getScreenSize();
@@ -387,6 +449,7 @@ void screenRedraw(int sigRaised)
     // refresh screen
     clearScreenC();
     updateWindows();
+    outFrame();
 }
 
 // ----------------------------------------------------------------------------
@@ -453,6 +516,7 @@ void saveIfOpen()
 
 void saveAllBuffers()
 {
+    finishSave();                       // so that a failed one is asked about
     bToBuffer();
     for (int i = 0; i < 10; i++)
     {
@@ -478,6 +542,8 @@ void centerCursor()
 
 void sayWait()
 {
+    if (macroLevel)             // nothing is drawn while a macro runs
+        return;
     update("WAIT\n", 0, 8, screenHt-1, screenHt-1);
 }
 
@@ -508,36 +574,98 @@ char* currOptions()
 }
 
 // ----------------------------------------------------------------------------
-// Find and Replace with options.
+// Replace every match from the cursor on (or back, if backwards) without
+// asking, in a single pass over the buffer. Returns the number replaced.
 
-void findReplace(const char* findStr, int findStrLen, const char* replStr, int replStrLen)
+long replaceMatches(const SearchPattern* pat, const char* replStr,
+                    int replStrLen)
 {
-    if (findGlobal)
+    long len = pat->length();
+    long count = 0, maxCount = 1024;
+    long* offs = (long*)malloc(maxCount * sizeof(long));
+    if (!offs)
+        throw new Error("out of memory");
+
+    bufFlat(b);
+    const char* p = bcursPos;
+    while ((p = findForward ? pat->findFwd(p, beot)
+                            : pat->findBack(bstart, p)) != 0)
     {
+        if (count == maxCount)
+        {
+            maxCount *= 2;
+            long* newOffs = (long*)realloc(offs, maxCount * sizeof(long));
+            if (!newOffs)
+            {
+                free(offs);
+                throw new Error("out of memory");
+            }
+            offs = newOffs;
+        }
+        offs[count++] = p - bstart;
         if (findForward)
-            bcursPos = bstart;
-        else
-            bcursPos = beot - findStrLen;
+            p += len;
     }
-    else
+    if (count == 0)
+    {
+        free(offs);
+        return 0;
+    }
+
+    if (!findForward)               // found bottom up: put in text order
+        for (long i = 0, j = count - 1; i < j; i++, j--)
+        {
+            long t = offs[i];
+            offs[i] = offs[j];
+            offs[j] = t;
+        }
+    try
     {
-        if (bcursPos == beot || findBeeped)
-            bcursPos = bstart;
+        replaceAll(offs, count, len, replStr, replStrLen);
     }
+    catch (Error* err)
+    {
+        free(offs);
+        throw err;
+    }
+
+    // leave the cursor as the one-at-a-time loop would
+    if (findForward)
+        bcursPos = bstart + offs[count-1] + (count-1)*(replStrLen - len)
+                   + replStrLen;
+    else
+        bcursPos = bstart + offs[0];
+    free(offs);
+    return count;
+}
+
+// ----------------------------------------------------------------------------
+// Find and Replace with options, using pat compiled from findStr.
+
+void findReplace(const SearchPattern* pat, const char* findStr, int findStrLen,
+                 const char* replStr, int replStrLen)
+{
+    // start over at the top (or bottom, if backwards) if global or if
+    // the last find ran off the end
+    if (findGlobal || findBeeped || bcursPos == (findForward ? beot : bstart))
+        bcursPos = findForward ? bstart : beot;
     findBeeped = FALSE;
 
     if (!(findSingle || findAsk))
         sayWait();
 
     bool found = FALSE;
-    do
+    if (replStr && !(findSingle || findAsk))
+        found = replaceMatches(pat, replStr, replStrLen) > 0;
+    else do
     {
-        if (!findForward)
-            bcursPos = bcursPos - findStrLen;
-        const char* findPos = find(findStr, findStrLen);
+        // the cursor is left after a match, or before it if backwards
+        const char* findPos = find(pat);
         if (findPos)
             {
-                bcursPos = (char*)(findPos + findStrLen);
+                bcursPos = (char*)findPos;
+                if (findForward)
+                    bcursPos += findStrLen;
                 found = TRUE;
                 if (replStr)
                 {
@@ -560,10 +688,12 @@ void findReplace(const char* findStr, int findStrLen, const char* replStr, int r
                     }
                     if (replace)
                     {
-                        bcursPos -= findStrLen;
+                        if (findForward)
+                            bcursPos -= findStrLen;
                         del(bcursPos, (long )findStrLen);
                         insert(bcursPos, replStr, (long )replStrLen);
-                        bcursPos += replStrLen;
+                        if (findForward)
+                            bcursPos += replStrLen;
                     }
                 }
             }
@@ -574,7 +704,7 @@ void findReplace(const char* findStr, int findStrLen, const char* replStr, int r
     if (found)
     {
         if (findAsk && replStr)     // multiple replacing: beep when done
-            putchar(CH_BELL);
+            putChar(CH_BELL);
         centerCursor();
     }
     else
@@ -584,6 +714,96 @@ void findReplace(const char* findStr, int findStrLen, const char* replStr, int r
     }
 }
 
+// ----------------------------------------------------------------------------
+// Find and Replace with options.
+
+void findReplace(const char* findStr, int findStrLen, const char* replStr,
+                 int replStrLen)
+{
+    SearchPattern pat(findStr, findStrLen);
+    findReplace(&pat, findStr, findStrLen, replStr, replStrLen);
+}
+
+// ----------------------------------------------------------------------------
+// Set find/replace option ch, if it is one.
+
+void findOption(int ch)
+{
+    switch (toupper(ch))
+    {
+        case 'G':
+            findGlobal = TRUE;
+            break;
+
+        case 'L':
+            findGlobal = FALSE;
+            break;
+
+        case 'F':
+            findForward = TRUE;
+            break;
+
+        case 'B':
+            findForward = FALSE;
+            break;
+
+        case 'A':
+            findAsk = TRUE;
+            break;
+
+        case 'D':
+            findAsk = FALSE;
+            break;
+
+        case 'S':
+            findSingle = TRUE;
+            break;
+
+        case 'M':
+            findSingle = FALSE;
+            break;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Do ^Q string command cmd (F, A, I, G or T) once its strings are in. For
+// F and A, pat may be str1 already compiled.
+
+void doQstring(int cmd, const char* str1, int len1, const char* str2,
+               int len2, const SearchPattern* pat)
+{
+    switch (cmd)
+    {
+        case 'F':           // find the string
+            if (pat)
+                findReplace(pat, str1, len1, NULL, 0);
+            else
+                findReplace(str1, len1, NULL, 0);
+            break;
+
+        case 'A':           // find and replace the string
+            if (pat)
+                findReplace(pat, str1, len1, str2, len2);
+            else
+                findReplace(str1, len1, str2, len2);
+            break;
+
+        case 'I':           // insert the string
+            insert(bcursPos, str1, (long )len1);
+            bcursPos += len1;
+            break;
+
+        case 'G':           // goto line
+            bcursPos = lineStartPos(atoi(str1)-1);
+            centerCursor();
+            break;
+
+        case 'T':           // set tab size
+            btabSize = max(atoi(str1), 1);
+            break;
+    }
+}
+
 // ----------------------------------------------------------------------------
 // Do a ^Q command.
 
@@ -636,6 +856,7 @@ void doQcommand(int ch)
                     case 'O':       // copy tag-to-cursor into clipboard
                     {
                         char* p;
+                        bufGapPast(btagPos > bcursPos ? btagPos : bcursPos);
                         if (btagPos > bcursPos)
                         {
                             p = bcursPos;
@@ -655,6 +876,16 @@ void doQcommand(int ch)
                         cmdState = 0;
                         break;
                     }
+                    case 'U':           // undo
+                        cmdState = 0;
+                        undoEdit();
+                        break;
+
+                    case 'Y':           // redo
+                        cmdState = 0;
+                        redoEdit();
+                        break;
+
                     case 'W':           // split windows toggle
                         if (splitMode)
                         {
@@ -685,56 +916,13 @@ void doQcommand(int ch)
 
         case 2:             // get options or string delimiter char
                             // alpha characters are find/replace options
-            switch (ch)
+            if (isalpha(ch))
+                findOption(ch);
+            else            // otherwise, it is the delimiter
             {
-                case 'G':
-                case 'g':
-                    findGlobal = TRUE;
-                    break;
-
-                case 'L':
-                case 'l':
-                    findGlobal = FALSE;
-                    break;
-
-                case 'F':
-                case 'f':
-                    findForward = TRUE;
-                    break;
-
-                case 'B':
-                case 'b':
-                    findForward = FALSE;
-                    break;
-
-                case 'A':
-                case 'a':
-                    findAsk = TRUE;
-                    break;
-
-                case 'D':
-                case 'd':
-                    findAsk = FALSE;
-                    break;
-
-                case 'S':
-                case 's':
-                    findSingle = TRUE;
-                    break;
-
-                case 'M':
-                case 'm':
-                    findSingle = FALSE;
-                    break;
-
-                default:    // otherwise, it may be a delimiter
-                    if (!isalpha(ch))
-                    {
-                        delimChar = ch;
-                        theStrLen = 0;
-                        cmdState = 3;
-                    }
-                    break;
+                delimChar = ch;
+                theStrLen = 0;
+                cmdState = 3;
             }
             break;
 
@@ -753,46 +941,21 @@ void doQcommand(int ch)
             else
             {
                 theString[theStrLen] = 0;
-                switch (cmdChar2)
+                if (cmdChar2 == 'A' && cmdState == 3)
+                {                       // first of two strings
+                    strcpy(fstString, theString);
+                    fstStrLen = theStrLen;
+                    theStrLen = 0;
+                    cmdState = 4;
+                }
+                else
                 {
-                    case 'F':           // find the string
-                        findReplace(theString, theStrLen, NULL, 0);
-                        cmdState = 0;
-                        break;
-
-                    case 'A':           // find and replace the string
-                        if (cmdState == 3)
-                        {
-                            strcpy(fstString, theString);
-                            fstStrLen = theStrLen;
-                            theStrLen = 0;
-                            cmdState = 4;
-                        }
-                        else
-                        {
-                            findReplace(fstString, fstStrLen, theString,
-                                 theStrLen);
-                            cmdState = 0;
-                        }
-                        break;
-
-                    case 'I':           // insert the string
-                        insert(bcursPos, theString, (long )theStrLen);
-                        bcursPos += theStrLen;
-                        cmdState = 0;
-                        break;
-
-                    case 'G':           // goto line
-                        bcursPos = bstart;
-                        downLine(&bcursPos, atoi(theString)-1);
-                        centerCursor();
-                        cmdState = 0;
-                        break;
-
-                    case 'T':           // set tab size
-                        btabSize = max(atoi(theString), 1);
-                        cmdState = 0;
-                        break;
+                    cmdState = 0;
+                    if (cmdChar2 == 'A')
+                        doQstring('A', fstString, fstStrLen, theString,
+                                  theStrLen, 0);
+                    else
+                        doQstring(cmdChar2, theString, theStrLen, 0, 0, 0);
                 }
             }
             break;
@@ -831,6 +994,37 @@ doexit:
                     saveAllBuffers();
                     break;
 
+                case 'I':           // show storage statistics
+                    showMessage("storage: %ld resizes (%ld remaps), "
+                        "%ld copied, %ld shifted, %ld trims, buf %ld/%ld, %s scan",
+                        storeStats.reallocs, storeStats.remaps,
+                        storeStats.bytesCopied, storeStats.bytesShifted,
+                        storeStats.trims, textSpan(bstart, beot),
+                        buffer[b].blockSize, scanKernelName());
+                    cmdState = 0;
+                    break;
+
+                case 'F':           // toggle output bytes/frame display
+                    showOutStats = !showOutStats;
+                    cmdState = 0;
+                    break;
+
+                case 'P':           // toggle macro profiling
+                    profileMacros = !profileMacros;
+                    showMessage("macro profiling %s",
+                                profileMacros ? "on" : "off");
+                    cmdState = 0;
+                    break;
+
+                case 'M':           // show the macro profile buffer
+                    selectBuffer(profBuff);
+                    if (splitMode && !topWindow)
+                        buffB = b;
+                    else
+                        buffA = b;
+                    cmdState = 0;
+                    break;
+
                 case 'H':           // display help screens
                 {
                     cmdState = 0;
@@ -868,8 +1062,10 @@ doexit:
                     break;
 
                 case 'S':           // save file
-                    sayWait();
-                    saveBuffer();
+                    if (macroLevel)
+                        saveBuffer();
+                    else
+                        saveInBackground();
                     cmdState = 0;
                     break;
 
@@ -909,9 +1105,8 @@ doexit:
                             strcpy(buffer[b].fpath, theString);
                             makeFName(b);
                             buffer[b].open = TRUE;
-                            buffer[b].changed = FALSE;
                         }
-                        setTabSizeFromType();
+                        setFileType();
                         break;
 
                     case 'R':       // read file and insert at cursor
@@ -943,6 +1138,7 @@ void doCommand(int ch)
                 if (ch >= '0' && ch <= '9')
                 {
                     selectBuffer(ch - '0');
+                    settleFile();
                     if (splitMode && !topWindow)
                         buffB = b;
                     else
@@ -1026,6 +1222,7 @@ void doCommand(int ch)
                         for (p++; isalpha(*p); p++)
                             if (*p == 'G' || *p == 'g')
                                 *p = 'L'; // change GLOBAL to LOCAL option
+                        textVersion++;
                     }
                     execBuffer(longCmdBuff);
                 }
@@ -1038,6 +1235,7 @@ void doCommand(int ch)
                     {
                         topWindow = FALSE;
                         selectBuffer(buffB);
+                        settleFile();
                         topRow = topB;
                         botRow = botB;
                     }
@@ -1045,6 +1243,7 @@ void doCommand(int ch)
                     {
                         topWindow = TRUE;
                         selectBuffer(buffA);
+                        settleFile();
                         topRow = topA;
                         botRow = botA;
                     }
@@ -1054,6 +1253,7 @@ void doCommand(int ch)
             case 'O':           // cut tag-to-cursor into clipboard
             {
                 char* p;
+                bufGapPast(btagPos > bcursPos ? btagPos : bcursPos);
                 if (btagPos > bcursPos)
                 {
                     p = bcursPos;
@@ -1070,8 +1270,9 @@ void doCommand(int ch)
                 if (!clipBoard)
                     throw new Error("no space for clipboard");
                 movec(p, clipBoard, clipSize);
+                long offs = p - bstart;     // the text may move
                 del(p, clipSize);
-                bcursPos = p;
+                bcursPos = (char*)textAt(bstart, offs);
                 break;
             }
             case 'U':
@@ -1092,6 +1293,7 @@ void doCommand(int ch)
             {
                 char* p = bcursPos;
                 fwdWord(&p, 1);
+                p = bufGapPast(p);
                 del(bcursPos, p-bcursPos);
                 break;
             }
@@ -1125,6 +1327,7 @@ void doCommand(int ch)
             {
                 char* p = bcursPos;
                 fwdLine(&p, 1);
+                p = bufGapPast(p);
                 if (bcursPos != bstart && *(bcursPos-1) != '\n')
                     p--;
                 clipSize = p - bcursPos;
@@ -1149,67 +1352,14 @@ void doCommand(int ch)
         command = ' ';
 }
 
-// ----------------------------------------------------------------------------
-// Execute macro string.
-
-const char* execString(const char* pcStart, const char* pcEnd, int rep)
-{
-    if (macroLevel++ > 9)
-        throw new Error("macro recursion more than 9 deep");
-
-    const char* pc = pcStart;
-    int i;
-    for (i = rep; i > 0; )
-    {
-        if (cmdState == 0)
-        {
-            checkKey(&key);
-            if (key == CH_ESC)
-                    throw new Cancel;
-            if (*pc == ']' || pc >= pcEnd)
-            {
-                pc++;
-                if (i-- <= 0)       // if last loop, leave pc after ']'
-                    break;
-                pc = pcStart;
-                continue;
-            }
-            int num = 0;
-            while (*pc >='0' && *pc <= '9')
-            {
-                num *= 10;
-                num += (*pc++) - '0';
-            }
-            if (*pc == '[')
-            {
-                pc++;
-                if (num == 0)
-                    num = 32000;
-                pc = execString(pc, pcEnd, num);
-            }
-            else if (num > 0)
-            {
-                execString(pc, pc+1, num);
-                pc++;
-            }
-            else
-                doCommand(*pc++);
-        }
-        else
-            doCommand(*pc++);
-    }
-    macroLevel--;
-    return pc;
-}
-
 // ----------------------------------------------------------------------------
 // Execute buffer as a macro, with limited recursion.
 
 void execBuffer(int exb)
 {
-    BuffRec* p = &buffer[exb];
-    if (p->start)
-        execString(p->start, p->eot, 1);
+    bufFlat(exb);
+    if (buffer[exb].start)
+        runMacro(exb);
 }
 
 // ----------------------------------------------------------------------------
@@ -1257,12 +1407,13 @@ void getCommand(const char* msg, bool isFile)
             {
                 // tab-- try to complete a filename
                 *bcursPos = 0;
+                textVersion++;
                 char lsCmd[MAX_LINE];
                 snprintf(lsCmd, MAX_LINE, "ls -dF %s* 2>&1", bstart);
-                fflush(stdout);
+                outFlush();
                 FILE* ls = popen(lsCmd, "r");
                 if (!ls)
-                    putchar(CH_BELL);
+                    putChar(CH_BELL);
                 else
                 {
                     char* buf = new char[32000];
@@ -1307,7 +1458,7 @@ void getCommand(const char* msg, bool isFile)
                             }
                         }
                         if (line != 1)
-                            putchar(CH_BELL);
+                            putChar(CH_BELL);
                         if (line > 0)
                         {
                             int addLen = addE1 - addB1;
@@ -1332,6 +1483,125 @@ void getCommand(const char* msg, bool isFile)
     key = NO_KEY;
 }
 
+// ----------------------------------------------------------------------------
+// Parse the "set <name>=<value>" lines of a .exrc file read into buffer b.
+
+void readSettings()
+{
+    insert(beot, "\0", 1);
+    for (char* p = bstart; *p; p++)
+    {
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == 's' && *(p+1) == 'e' && *(p+2) == 't')
+        {
+            p += 3;
+            while (*p == ' ' || *p == '\t')
+                p++;
+            const char* name = p;
+            while (*p >= 'a' && *p <= 'z')
+                p++;
+            while (*p == ' ' || *p == '\t')
+                p++;
+            if (*p == '=')
+            {
+                p++;
+                while (*p == ' ' || *p == '\t')
+                    p++;
+                if (name[0] == 't' && name[1] == 'a' && name[2] == 'b')
+                {
+                    givenTabSize = atoi(p);
+                    if (givenTabSize <= 1)
+                        givenTabSize = 0;
+                }
+                else if (name[0] == 'b' && name[1] == 'a')
+                {
+                    if (*p == 'y')
+                        makeBak = TRUE;
+                    else if (*p == 'n')
+                        makeBak = FALSE;
+                }
+                else if (strncmp(name, "fsync", 5) == 0)
+                {
+                    if (*p == 'y')
+                        syncSave = TRUE;
+                    else if (*p == 'n')
+                        syncSave = FALSE;
+                }
+                else if (strncmp(name, "macrorefresh", 12) == 0)
+                    macroRefresh = atoi(p);
+                else if (strncmp(name, "macrotrace", 10) == 0)
+                {
+                    int n = 0;
+                    while (p[n] && p[n] != '\n' && p[n] != ' ' &&
+                           p[n] != '\t' && n < MAX_LINE-1)
+                        n++;
+                    memcpy(macroTrace, p, n);
+                    macroTrace[n] = 0;
+                }
+                else if (strncmp(name, "shrink", 6) == 0)
+                {
+                    if (*p == 'y')
+                        shrinkIdle = TRUE;
+                    else if (*p == 'n')
+                        shrinkIdle = FALSE;
+                }
+                else if (strncmp(name, "journal", 7) == 0)
+                {
+                    if (*p == 'y')
+                        journalEdits = TRUE;
+                    else if (*p == 'n')
+                        journalEdits = FALSE;
+                }
+                else if (strncmp(name, "autosave", 8) == 0)
+                    autosaveSecs = atoi(p);
+                else if (strncmp(name, "undomem", 7) == 0)
+                {
+                    char* unit;
+                    undoMem = strtol(p, &unit, 10);
+                    if (*unit == 'k' || *unit == 'K')
+                        undoMem *= 1024;
+                    else if (*unit == 'm' || *unit == 'M')
+                        undoMem *= 1024*1024;
+                }
+            }
+        }
+        while (*p && *p != '\n')
+            p++;
+        if (!*p)
+            break;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Return the kind of undo step a key typed at the top level starts.
+
+static int undoKind(int key)
+{
+    if (key == PASTE_KEY)
+        return UK_OTHER;
+    if (key == 'H'-64 || key == 'G'-64 || key == CH_RUB)
+        return UK_DELETE;
+    if (key >= ' ' || key == CH_CR || key == '\t')
+        return UK_TYPING;
+    return UK_OTHER;
+}
+
+// ----------------------------------------------------------------------------
+// Return TRUE if a key typed at the top level only moves the cursor, so a
+// mapped file needn't be copied in for it.
+
+static bool motionKey(int key)
+{
+    switch (key)
+    {
+        case 'E'-64: case 'S'-64: case 'D'-64: case 'X'-64:
+        case 'R'-64: case 'A'-64: case 'F'-64: case 'C'-64: case 'Z'-64:
+            return TRUE;
+    }
+    return FALSE;
+}
+
 // ----------------------------------------------------------------------------
 // main program
 
@@ -1340,22 +1610,20 @@ int main(int argc, const char** argv)
     screenReady = FALSE;
     char clipName[MAX_LINE];
 
+    const char* batchMacro = 0;         // "-x <macro file>": batch mode
+    for (int i = 1; i < argc - 1; i++)
+        if (strcmp(argv[i], "-x") == 0)
+            batchMacro = argv[i+1];
+
     try
     {
-        // set up window-resize signal
-        sigset_t sigset;
-        sigemptyset(&sigset);
-        sigaddset(&sigset, SIGWINCH);
-        struct sigaction resizeSA;
-        resizeSA.sa_handler = screenRedraw;
-        resizeSA.sa_mask = sigset;
-        resizeSA.sa_flags = 0;
-        struct sigaction oldSA;
-        sigaction(SIGWINCH, &resizeSA, &oldSA);
-        sigset_t osigset;
-        sigprocmask(SIG_UNBLOCK, &sigset, &osigset);
-    
-        iTermCaps(&termSave);
+        if (batchMacro)
+            iNullTerm();
+        else
+        {
+            iTermCaps(&termSave);
+            watchResize(screenRedraw);  // redraw when window is resized
+        }
         if (screenHt > SCRMAXHT)
             screenHt = SCRMAXHT;
         if (screenWd > SCRMAXWD)
@@ -1399,7 +1667,7 @@ int main(int argc, const char** argv)
     
         // scroll existing terminal lines up to save any error messages, etc.
         for (i = screenHt-1; i > 0; i--)
-            putchar('\n');
+            putChar('\n');
     
         clearScreenC();
     
@@ -1407,54 +1675,11 @@ int main(int argc, const char** argv)
         if (insertFile(".exrc", READEXRC))  // read in settings file, if any
         {
             buffer[0].readOnly = FALSE;
-            insert(beot, "\0", 1);
-            for (char* p = bstart; *p; p++)
-            {
-                while (*p == ' ' || *p == '\t')
-                    p++;
-                if (*p == 's' && *(p+1) == 'e' && *(p+2) == 't')
-                {
-                    p += 3;
-                    while (*p == ' ' || *p == '\t')
-                        p++;
-                    if (*p == 't' && *(p+1) == 'a' && *(p+2) == 'b')
-                    {
-                        while (*p >= 'a' && *p <= 'z')
-                            p++;
-                        while (*p == ' ' || *p == '\t')
-                            p++;
-                        if (*p == '=')
-                        {
-                            p++;
-                            while (*p == ' ' || *p == '\t')
-                                p++;
-                            givenTabSize = atoi(p);
-                            if (givenTabSize <= 1)
-                                givenTabSize = 0;
-                        }
-                    }
-                    else if (*p == 'b' && *(p+1) == 'a')
-                    {
-                        while (*p >= 'a' && *p <= 'z')
-                            p++;
-                        while (*p == ' ' || *p == '\t')
-                            p++;
-                        if (*p == '=')
-                        {
-                            p++;
-                            while (*p == ' ' || *p == '\t')
-                                p++;
-                            if (*p == 'y')
-                                makeBak = TRUE;
-                            else if (*p == 'n')
-                                makeBak = FALSE;
-                        }
-                    }
-                }
-                while (p < bend && *p != '\n')
-                    p++;
-            }
+            readSettings();
+            loadSyntax(bstart);             // and language definitions
         }
+        else
+            loadSyntax(0);
         clearBuffer();
     
         char* home = getenv("HOME");
@@ -1473,6 +1698,9 @@ int main(int argc, const char** argv)
                 movec(bstart, clipBoard, clipSize);
         }
         clearBuffer();
+
+        if (batchMacro)
+            exit(runBatch(batchMacro, argc, argv));
     
         int fbuf = 0;
         int startLine = 0;
@@ -1499,10 +1727,9 @@ int main(int argc, const char** argv)
                     strncpy(buffer[b].fpath, arg, MAX_LINE);    // open file in next buffer
                     makeFName(b);
                     buffer[b].open = TRUE;
-                    buffer[b].changed = FALSE;
                     fbuf++;
                 }
-                setTabSizeFromType();
+                setFileType();
             
             } catch (Error* error)
             {
@@ -1524,9 +1751,14 @@ int main(int argc, const char** argv)
     {
         // errors caught during intialization are fatal
         error->report();
+        outFlush();
         exit(-1);
     }
+    char startMessage[SCRMAXWD];        // as of a recovery: in place of Intro
+    strcpy(startMessage, message);
     updateWindows();
+    if (autosaveSecs > 0)
+        addTimer(autosaveSecs * 1000, autosave);
 
     // loop once per character typed
     bool startup = TRUE;
@@ -1550,14 +1782,33 @@ int main(int argc, const char** argv)
                 *p = 0;
                 update(sTmp, 0, 8, screenHt-2, screenHt-1);
                 attrib = 0;
-                update(Intro, 0, 8, screenHt-1, screenHt-1);
+                update(startMessage[0] ? startMessage : Intro, 0, 8,
+                       screenHt-1, screenHt-1);
                 startup = FALSE;
             }
 
             gotoxy(cursCol, cursRow);
-            waitKey(&key);      // wait for key if we don't have one
+            waitKey(&key, cmdState == 0); // wait for key if we don't have one
+            if (!cmdState)          // each command is an undo step, but a
+                undoStep(undoKind(key)); // run of typing is just one
+            if (!cmdState && !motionKey(key))
+                settleFile();       // a mapped file is in before it's changed
 
-            if (cmdState)
+            if (key == PASTE_KEY)   // paste: enter all of it at once
+            {
+                if (insertMode)
+                {
+                    insert(bcursPos, pasteText, pasteLen);
+                    bcursPos += pasteLen;
+                }
+                else
+                    for (long i = 0; i < pasteLen; i++)
+                    {
+                        replace(bcursPos, pasteText[i]);
+                        bcursPos++;
+                    }
+            }
+            else if (cmdState)
             {
                 char cmd1 = command;
                 char cmd2 = ((key >= 'A' || key < ' ') ? (key & 0x1f) + 0x40 : key);
@@ -1681,10 +1932,11 @@ int main(int argc, const char** argv)
                         while ((*p == ' ' || *p == '\t') && (p < bcursPos))
                             p++;
                         int whiteSpLen = p - lineStart;
+                        long col = bcursPos - lineStart;
                         insert(bcursPos, "\n", 1);
                         if (whiteSpLen)
-                        {
-                            insert(bcursPos+1, lineStart, whiteSpLen);
+                        {           // the line may have moved
+                            insert(bcursPos+1, bcursPos - col, whiteSpLen);
                             bcursPos += whiteSpLen;
                         }
                     }
@@ -1696,54 +1948,38 @@ int main(int argc, const char** argv)
                 }
                 else
                     replace(bcursPos, key);
-    
-                if (cursCol < screenWd-1 && key >= ' ')
-                {                   // do quick update of screen first
-                    putchar(key);
-                    screenImage[cursRow][cursCol] = key;
-                    cursCol++;
-                }
                 bcursPos++;
             }
-#ifdef NO_UPDATE_DURING_INPUT   // FIX: this breaks Find command
-            if (quitting)
-                key = NO_KEY;
-            else
+            if (!quitting)
             {
-                // Don't update screen while we still have text to insert.
-                // This cures paste-into-window problem.
-                key = NO_KEY;
-                checkKey(&key);
-                if (key == NO_KEY)
+                // keys that are already waiting, as in a paste, are all
+                // handled before one update, unless that takes too long
+                bool idle = !keyReady();
+                if (idle || frameOverdue())
+                {
+                    checkMappedFile();
                     updateWindows();
+                }
+                if (idle && shrinkIdle)
+                    bufTrim();
             }
-#else
-            if (!quitting)
-                updateWindows();
-#endif
         } catch (Cancel* c)
         {
             delete c;
             cmdState = 0;
             selectBuffer(prevBuff);
             updateWindows();
-#ifdef NO_UPDATE_DURING_INPUT
-            key = NO_KEY;
-#endif
 
         } catch (Error* error)
         {
             error->report();
             delete error;
             cmdState = 0;
-#ifdef NO_UPDATE_DURING_INPUT
-            key = NO_KEY;
-#endif
         }
-#ifndef NO_UPDATE_DURING_INPUT
         key = NO_KEY;
-#endif
     } while (!quitting);        // end of character main loop
+    finishSave();
+    flushJournals();            // of any buffers that couldn't be saved
 
     if (clipBoard)
     {
@@ -1771,7 +2007,8 @@ int main(int argc, const char** argv)
 
     gotoxy(0, screenHt-1);
     clearLineC();
-    putchar(CH_LF);
+    putChar(CH_LF);
+    outFlush();
 
     restoreTerm(&termSave);
     if (doMake)     // ^KE: chain to 'make' program
@@ -67,6 +67,295 @@ public:
     void    report();
 };
 
+// Thrown to cancel a command
+
+class Cancel
+{
+};
+
+// Line index of a buffer: line lengths in chunks, with Fenwick trees of
+// the chunk totals (eclines.cc)
+
+const int CHUNK_MAX = 512;      // most lines in one chunk
+const int CHUNK_FILL = 384;     // lines per chunk when building
+
+typedef struct
+{
+    int     n;                  // number of lines in chunk
+    long    bytes;              // total of line lengths
+    long    len[CHUNK_MAX];     // line lengths, including the '\n'
+} LineChunk;
+
+class LineIndex
+{
+    LineChunk** chunk;          // chunks in text order
+    int     nChunks, maxChunks;
+    long*   fwBytes;            // Fenwick tree of chunk byte counts
+    long*   fwLines;            // Fenwick tree of chunk line counts
+    long    totalBytes, totalLines;
+    bool    partial;            // last entry is text not yet scanned
+
+    void    reserve(int n);
+    LineChunk* newChunk(const long* len, int n);
+    void    rebuildTree();
+    void    treeAdd(int c, long nBytes, long nLines);
+    int     findChunk(long offs, bool byLine, long* bytesBefore,
+                      long* linesBefore);
+    void    locate(long offs, int* c, int* i, long* line, long* start);
+    void    replaceLines(int c, int i, int count, const long* len, long m);
+    long    pendingStart();
+    void    addLine(long len);
+    void    scanLines(const char* p, const char* end, long upTo,
+                      long upToLine);
+    void    extend(const char* text, long upTo, long upToLine);
+
+public:
+    bool    valid;              // index matches the text
+
+            LineIndex();
+            ~LineIndex();
+    void    clear();
+    void    build(const char* start, const char* end);
+    long    lineOf(const char* text, long offs, long* lineStart);
+    long    startOf(const char* text, long line);
+    long    pendingLine(long offs);
+    void    truncate(long offs);
+    void    inserted(long offs, const char* text, long n);
+    void    deleted(long offs, const char* text, long n);
+};
+
+// Candidate test for a search: bytes gap apart that, ORed with their masks,
+// equal first and last (ecscan.cc)
+
+typedef struct
+{
+    int     gap;
+    unsigned char first, firstMask;
+    unsigned char last, lastMask;
+} ScanPair;
+
+// Find pattern, compiled for repeated searches (ecsearch.cc)
+
+class SearchPattern
+{
+    unsigned char* pat;         // pattern, folded if case-insensitive
+    int     len;
+    bool    caseSens;           // TRUE if pattern has an uppercase letter
+    int     method;             // search method (M_...)
+    unsigned char fold[256];    // case-folding table
+    int     shift[256];         // Horspool shifts, forward
+    int     shiftBack[256];     // Horspool shifts, backward
+    ScanPair pair;              // prefilter bytes
+
+    bool    matchAt(const char* s) const;
+
+public:
+            SearchPattern(const char* str, int len);
+            ~SearchPattern();
+    int     length() const { return len; }
+    const char* findFwd(const char* from, const char* end) const;
+    const char* findBack(const char* start, const char* to) const;
+    bool    hasNewline() const { return memchr(pat, '\n', len) != 0; }
+};
+
+// Macro compiled to int codes, with its strings and find patterns
+// (ecmacro.cc)
+
+struct MacroSite;
+
+class MacroCode
+{
+    char*   src;                // macro text compiled
+    long    srcLen;
+    int*    code;               // codes and their arguments
+    int     codeLen, codeMax;
+    char*   strs;               // string arguments, NUL-terminated
+    long    strsLen, strsMax;
+    SearchPattern** pats;       // find patterns
+    int     nPats, maxPats;
+    MacroSite* sites;           // source text and profile of each command
+    int     nSites, maxSites;
+    int*    siteOf;             // site of each code, -1 if none
+
+    void    freeAll();
+    void    emit(int w);
+    int     addSite(const char* from, const char* to, int depth);
+    void    endSites();
+    int     intern(const char* s, int n);
+    int     addPattern(const char* s, int n);
+    const char* compileCommand(const char* pc, const char* end);
+    void    compile(const char* pc, const char* end);
+
+public:
+    int     busy;               // number of runs in progress
+
+            MacroCode(const char* text, long len);
+            ~MacroCode();
+    bool    sameSource(const char* text, long len) const;
+    void    run();
+    void    clearProfile();
+    void    writeProfile(int exb);
+};
+
+// A language's lexer, compiled from its definition into a DFA. Each state
+// has 256 entries in trans, one for each next character: the state to go
+// on to, or'd with LEX_ACCEPT if a token may end there, or 0 if the token
+// can't take it. A token ending in state s has the kind accept[s] >> 8,
+// and leaves the lexer in state accept[s] & 0xff, whose tokens start from
+// DFA state start[] of it. (ecsyntax.cc)
+
+enum { TK_TEXT=0, TK_KEYWORD, TK_COMMENT, TK_STRING, TK_KINDS };  // token kinds
+
+#define LEX_START   0           // lexer state at the start of a text
+#define LEX_ACCEPT  0x8000      // flags a DFA state that a token may end in
+
+typedef struct
+{
+    const char* name;           // language name
+    const char* exts;           // its file extensions or names, each between
+                                //   spaces, or "" if it's the default
+    int     tabSize;            // its tab spacing, or 0 to leave it alone
+    const unsigned short* trans;
+    const unsigned short* accept;
+    const unsigned short* start;
+} Syntax;
+
+// Lexer state cached at the start of each line of a buffer, so that its
+// highlighting can start at any line. An edit leaves the states before it
+// alone; those after it are checked as they're needed, until one comes
+// out the same as before, past the edit (ecsyntax.cc)
+
+class LexCache
+{
+    unsigned char* state;       // lexer state at the start of each line
+    long    n, max;             // lines with a state, and room for them
+    long    dirty;              // states from this line on may be wrong,
+    long    dirtyEnd;           //   until one at or past here agrees
+
+    void    room(long m);
+
+public:
+            LexCache();
+            ~LexCache();
+    void    clear();
+    void    truncate(long line);
+    void    edited(long line, long removed, long added);
+    int     stateOf(const Syntax* syn, LineIndex* li, const char* text,
+                    long line);
+    long    known()             { return n; }
+};
+
+// Undo journal of a buffer: each undo step is a run of edits composed into
+// the spans of text they changed, sorted, with the text each had before
+// kept in an arena. The text after is only kept once the step is undone.
+// (ecundo.cc)
+
+enum UndoKind { UK_OTHER=0, UK_TYPING, UK_DELETE }; // runs of these coalesce
+
+typedef struct
+{
+    long    start;              // offset in the text after the step
+    long    newLen;             // length after
+    long    oldLen;             // length before
+    long    oldAt;              // text before, in the arena
+    long    newAt;              // text after, in the arena once undone, or -1
+} UndoSpan;
+
+typedef struct
+{
+    long    first;              // index of its first span
+    long    nSpans;
+    bool    join;               // undone along with the segment before it
+} UndoSeg;
+
+class UndoLog
+{
+    UndoSpan* spans;            // spans of each segment, in segment order
+    long    nSpans, maxSpans;
+    UndoSeg* segs;              // segments, oldest first; the first nDone
+    int     nSegs, maxSegs;     //   are done, the rest undone
+    int     nDone;
+    char*   arena;              // text of the spans
+    long    arenaLen, arenaMax, arenaLive;
+    bool    open;               // last segment takes more edits
+    bool    lost;               // open step was evicted: ignore its edits
+    int     kind;               // kind of the open step (UK_...)
+
+    void    reserve(long n);
+    void    dropRedo();
+    void    addSeg(bool join);
+    void    dropSpanText(const UndoSpan* s);
+    void    evict();
+    void    compact();
+    void    splice(int g, bool back);
+
+public:
+            UndoLog();
+            ~UndoLog();
+    void    clear();
+    void    step(int kind);
+    void    edit(long offs, const char* removed, long remLen, long insLen);
+    bool    undo();
+    bool    redo();
+};
+
+// One change made by bufSplice(): the len characters at offs are replaced
+// with the textLen characters at text
+
+typedef struct
+{
+    long    offs;
+    long    len;
+    const char* text;
+    long    textLen;
+} Splice;
+
+// A file mapped as a buffer's text, whose pages are being copied into the
+// buffer's own in the background (ecstore.cc)
+
+typedef struct
+{
+    int     fd;             // the file, read to copy it in
+    long    size;           // its size and modify time (ns) when mapped,
+    long    time;           //   to tell if it has changed since
+    long    done;           // bytes of the mapping copied in so far
+} MappedFile;
+
+// Crash journal of a buffer's file: its edits since the file was opened
+// or saved, appended to a file beside it in batches (ecjournal.cc)
+
+class EditJournal
+{
+    int     fd;                 // journal file, -1 until the first edit
+    char    path[MAX_LINE];
+    long    baseSize, baseTime; // the file the edits apply to
+    char*   pend;               // records not yet written
+    long    pendLen, pendMax;
+    long    written;            // bytes in the file
+    long    since;              // where the records since mark() start
+    bool    failed;             // can't be written: ignore edits
+
+    void    put(const void* p, long n);
+    void    putNum(unsigned long n);
+    bool    create(const char* name);
+    void    record(long wasPending);
+
+public:
+            EditJournal(const char* path, long baseSize, long baseTime);
+            ~EditJournal();
+    void    resume(int fd, long size);
+    void    edit(long offs, long remLen, const char* ins, long insLen);
+    void    replaceAll(const long* offs, long count, long len,
+                       const char* repl, long replLen);
+    void    splice(const Splice* sp, long count);
+    void    checkpoint(const char* text, long len);
+    void    mark();
+    void    rebase(long baseSize, long baseTime);
+    void    flush();
+    void    remove();
+    long    size()              { return written + pendLen; }
+};
+
 typedef struct
 {
     char*   start;          // start of buffer
@@ -84,17 +373,43 @@ typedef struct
     char    fpath[MAX_LINE]; // file full pathname string, if open
     char*   fname;          // file name string, if open
     char    lineEnding;     // file line-ending type
+    long    blockSize;      // allocated size of text block
+    char    blockKind;      // how the text block was allocated (BK_...)
+    MappedFile* mapped;     // file still being copied in under its mapping
+    LineIndex* lineIdx;     // line index, built when first needed
+    LexCache* lexCache;     // highlighting state of each line, as drawn
+    const Syntax* syntax;   // lexer for its file type, or 0 for the default
+    UndoLog* undo;          // undo journal, made at the first edit
+    EditJournal* journal;   // crash journal, made at the first edit
+    long    baseSize;       // size and modify time (ns) of the file as it
+    long    baseTime;       //   was opened or last saved
 } BuffRec;
 
+typedef struct
+{
+    long    reallocs;       // text blocks resized
+    long    remaps;         // ... of those, by remapping pages
+    long    bytesCopied;    // text copied when a block moved
+    long    bytesShifted;   // text moved to open or close a hole
+    long    trims;          // blocks trimmed when idle
+} StoreStats;
+
 #define longCmdBuff 10
+#define profBuff    11
+#define MAX_BUFFERS 12
 
 enum InsertMode { READ=0, READEXRC, OPEN }; // for insertFile 'mode' argument
 
-enum CheckMode { NOCHECKKEY=0, CHECKKEY };  // for update 'check' argument
+// for update 'check' argument: draw all rows, stop if a key is waiting, or
+// draw just the cursor's row
+enum CheckMode { NOCHECKKEY=0, CHECKKEY, CURSROW };
 
 // file line ending types
 enum LEnd {lEnd_Unix, lEnd_Mac, lEnd_PC};
 
+// text block kinds: malloc'd, anonymous pages, or pages a file was mapped over
+enum BlockKind { BK_HEAP=0, BK_ANON, BK_FILE };
+
 // character attribute codes in screenImage[]
 
 #define AT_BOLD         0x0100
@@ -122,7 +437,6 @@ extern int  topRow, botRow;                 // screen row #s
 extern int  topA, botA;                     // window A row #s
 extern int  topB, botB;                     // window B row #s
 extern int  buffA, buffB;                   // window buffer #s
-extern char* lastTopPos;                    // previous top char position
 extern int  ansiColors;                     // TRUE to force ANSI black on white
 
 extern char command, cmdChar2;
@@ -132,6 +446,7 @@ extern int  lineNum, charNum;               // cursor loc in line, char
 extern int  cursRow, cursCol;               // cursor loc on screen
 extern bool insertMode, quitting, doMake, doPMake;
 extern bool splitMode, topWindow, longCommand, makeBak;
+extern bool syncSave;                       // TRUE to fsync files when saved
 extern const char* insMsg;                  // INSERT, REPLACE string ptr
 extern char* clipBoard;                     // clipboard data pointer
 extern long clipSize;                       // clipboard char size
@@ -141,24 +456,45 @@ extern bool findGlobal, findForward, findSingle, findAsk;   // find/replace opti
 extern char delimChar;                      // char used for QF, QA delimiter
 extern int  macroLevel;                     // macro recursion level
 extern int  givenTabSize;                   // default tab spacing
+extern StoreStats storeStats;               // storage engine counters
+extern bool shrinkIdle;                     // TRUE to trim blocks when idle
+extern long textVersion;                    // bumped by every text change
+extern long bytesSearched;                  // text scanned by find()
+extern long undoMem;                        // most memory an undo journal may use
+extern bool journalEdits;                   // TRUE to keep crash journals
+extern int  autosaveSecs;                   // seconds between autosaves, or 0
 
-void update (const char* atopPos, int hScroll, int tabSize, int atopRow,
-                    int abotRow);
-void movec (const char* src, char* dest, int size);
+bool update (const char* atopPos, int hScroll, int tabSize, int atopRow,
+                    int abotRow, CheckMode check = NOCHECKKEY);
+void movec (const char* src, char* dest, long size);
 void clearBuffer (void);
 void bToBuffer (void);
 void selectBuffer (int newb);
 void makeFName (int b);
 void cursToLineChar ();
-const char* find (const char* str, int len);
-void insert (char* p, const char* str, int n);
-void del (char* p, int n);
+long lineOfPos (const char* p);
+char* lineStartPos (long line);
+const char* find (const SearchPattern* pat);
+void insert (char* p, const char* str, long n);
+void del (char* p, long n);
+void replaceAll (const long* offs, long count, long len, const char* repl,
+                 long replLen);
 void replace (char* p, int c);
+void spliceText (const Splice* sp, long count);
+void undoStep (int kind);
+void undoEdit (void);
+void redoEdit (void);
 void saveIfOpen (void);
-void setTabSizeFromType (void);
+void setFileType (void);
 bool insertFile (const char* fileName, InsertMode mode);
+void settleFile (void);
+void checkMappedFile (void);
 void writeToFile (const char* fName, const char* fPath, char* start, char* end);
 void saveBuffer (void);
+void saveInBackground (void);
+void finishSave (void);
+const char* saveProgress (int sb);
+void autosave (void);
 void writeTaggedToFile (const char* fName);
 void beginLine (char** p);
 void backChar (char** p, int n);
@@ -169,7 +505,90 @@ void backLine (char** p, int n);
 void fwdLine (char** p, int n);
 void upLine (char** p, int n);
 void downLine (char** p, int n);
+void showMessage (const char* fmt, ...);
 void clearScreenC (void);
 void clearLineC (void);
+void invalidateRows (int first, int last);
+void scrollRowKeys (int top, int bot, int n);
+void scrollToTop (const char* topPos, int hScroll, int top, int bot);
+
+// commands run by macros (ec.cc, ecmacro.cc)
+
+void doCommand (int ch);
+void findOption (int ch);
+void doQstring (int cmd, const char* str1, int len1, const char* str2,
+                int len2, const SearchPattern* pat);
+void runMacro (int exb);
+void compileMacro (int exb);
+void updateWindows (void);
+void redrawFileStat (int sb);
+extern int  macroRefresh;                   // ms between updates in a macro
+extern bool profileMacros;                  // TRUE to profile macro runs
+extern char macroTrace[];                   // file to trace macro runs to
+
+// crash journals (ecjournal.cc)
+
+void journalPath (char* path, const char* filePath);
+bool recoverJournal (const char* fileName);
+void dropJournal (void);
+void flushJournals (void);
+
+// syntax highlighting (ecsyntax.cc)
+
+extern int  tokenAttr[];                    // attributes of each token kind
+void loadSyntax (const char* defs);
+const Syntax* syntaxFor (const char* fileName);
+int  lexToken (const Syntax* syn, unsigned char* state, const char* p,
+               const char** end);
+int  lexSpan (const Syntax* syn, const char* p, const char* end, int state);
+
+// batch mode (ecbatch.cc)
+
+#define batchBuff   9       // buffer holding the macro in batch mode
+
+int runBatch (const char* macroFile, int argc, const char** argv);
+
+// buffer storage engine (ecstore.cc)
+
+extern char* bgap;                          // gap in a buffer's text, or 0
+extern long bgapLen;                        //   and its length
+
+void bufNew (void);
+void bufClear (void);
+char* bufOpen (char* p, long n);
+void bufClose (char* p, long n);
+char* bufEditAt (char* p, long n);
+char* bufGapPast (char* p);
+void bufFlat (int i);
+void bufTrim (void);
+bool bufMapFile (int fd, long size);
+long bufCopyIn (int i, long most);
+void bufUnmapFile (void);
+void bufReplace (const long* offs, long count, long len, const char* repl,
+                 long replLen);
+void bufSplice (const Splice* sp, long count);
+
+// Positions in a buffer's text, stepping over the gap if it's in that text:
+// the one offs characters into text, the characters from p to end, and the
+// start of the line after the '\n' at eol.
+
+extern inline const char* textAt(const char* text, long offs)
+    { const char* p = text + offs;
+      return text < bgap && p >= bgap ? p + bgapLen : p; }
+extern inline long textSpan(const char* p, const char* end)
+    { return end - p - (p < bgap && end > bgap ? bgapLen : 0); }
+extern inline const char* lineAfter(const char* eol)
+    { return eol + 1 == bgap ? bgap + bgapLen : eol + 1; }
+
+// newline scanning kernels (ecscan.cc)
+
+const char* scanKernelName (void);
+long countNewlines (const char* p, const char* end);
+const char* findNthNewline (const char* p, const char* end, long n);
+const char* findNthNewlineBack (const char* start, const char* end, long n);
+const char* findPrevNewline (const char* start, const char* p);
+const char* findLineEnd (const char* p);
+const char* findPairFwd (const char* p, const char* last, const ScanPair* k);
+const char* findPairBack (const char* p, const char* last, const ScanPair* k);
 
 #endif // ec_h_
@@ -0,0 +1,244 @@
+// ****************************************************************************
+// ecbatch.cc  Macro Screen Editor batch mode
+//
+// Copyright (C) 2023 Scott Forbes
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// ****************************************************************************
+//
+// "ec -x <macro> file..." runs a macro over files with no screen. With
+// -j<n>, n worker processes share the files: each takes the next one from
+// a counter in shared memory, so a worker that draws small files goes on
+// to take more of them. Each worker has its own copy of the editor state,
+// and the macro is compiled once, before they are forked. The result of
+// each file goes into a table in the shared memory, and is printed when
+// all of the workers are done.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#include "termp.h"
+#include "ec.h"
+
+enum { FR_FAILED=0, FR_UNCHANGED, FR_SAVED };    // file results
+
+typedef struct
+{
+    char    result;             // FR_..., FR_FAILED until it's done
+    bool    stopped;            // macro was stopped by an error
+    double  secs;               // time taken, with opening and saving
+} FileResult;
+
+typedef struct                  // shared by the workers
+{
+    int     next;               // index of the next file to take
+    FileResult file[1];         // result of each file
+} BatchTable;
+
+static const char* resultName[] = { "FAILED", "unchanged", "saved" };
+
+static const char** files;      // files to run the macro over
+static int      nFiles;
+static BatchTable* table;
+
+// ----------------------------------------------------------------------------
+// Return the time in seconds.
+
+static double now()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// ----------------------------------------------------------------------------
+// Open file i into buffer 0, run the macro on it, and save it if it
+// changed. A macro stopped by an error, as a "[ ]" loop normally is, keeps
+// its changes.
+
+static void doFile(int i)
+{
+    const char* name = files[i];
+    FileResult* r = &table->file[i];
+    double t0 = now();
+    selectBuffer(0);
+    try
+    {
+        clearBuffer();
+        buffer[b].open = FALSE;
+        buffer[b].readOnly = FALSE;
+        if (!insertFile(name, OPEN) || buffer[b].newFile)
+            throw new Error("can't find file '%s'", name);
+        strncpy(buffer[b].fpath, name, MAX_LINE);
+        makeFName(b);
+        buffer[b].open = TRUE;
+        buffer[b].changed = FALSE;
+        setFileType();
+        settleFile();
+    } catch (Error* error)
+    {
+        error->report();
+        delete error;
+        r->secs = now() - t0;
+        return;
+    }
+
+    // each file starts with the default find options, but with no one to
+    // answer a replace prompt
+    findGlobal = FALSE;
+    findForward = TRUE;
+    findSingle = FALSE;
+    findAsk = FALSE;
+    cmdState = 0;
+    macroLevel = 0;
+    try
+    {
+        runMacro(batchBuff);
+    } catch (Error* error)
+    {
+        fprintf(stderr, "ec: %s: %s\n", name, error->message);
+        delete error;
+        r->stopped = TRUE;
+    } catch (Cancel* c)
+    {
+        delete c;
+        r->stopped = TRUE;
+    }
+
+    try
+    {
+        selectBuffer(0);
+        r->result = FR_UNCHANGED;
+        if (buffer[b].changed)
+        {
+            saveBuffer();
+            r->result = FR_SAVED;
+        }
+    } catch (Error* error)
+    {
+        fprintf(stderr, "ec: %s: %s\n", name, error->message);
+        delete error;
+        r->result = FR_FAILED;
+    }
+    r->secs = now() - t0;
+}
+
+// ----------------------------------------------------------------------------
+// Take files from the table until there are none left.
+
+static void work()
+{
+    for (;;)
+    {
+        int i = __sync_fetch_and_add(&table->next, 1);
+        if (i >= nFiles)
+            break;
+        doFile(i);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Run the macro in file macroFile over each file named in argv, with no
+// screen, in -j<n> processes if given (-j alone: one per CPU). Prints each
+// file's result and the totals. Returns the exit status: 1 if any file
+// couldn't be opened or saved, else 0.
+
+int runBatch(const char* macroFile, int argc, const char** argv)
+{
+    int jobs = 1;
+    journalEdits = FALSE;               // each file is saved when it's done
+    files = (const char**)malloc(argc * sizeof(char*));
+    if (!files)
+        throw new Error("out of memory");
+    nFiles = 0;
+    for (int i = 1; i < argc; i++)
+    {
+        const char* arg = argv[i];
+        if (strcmp(arg, "-x") == 0)
+            i++;
+        else if (arg[0] == '-' && arg[1] == 'j')
+            jobs = arg[2] ? atoi(arg+2) : (int)sysconf(_SC_NPROCESSORS_ONLN);
+        else if (*arg == '-')
+        {
+            int size = atoi(arg+1);
+            if (size > 0 && size < 25)          // -<n> is tab size
+                givenTabSize = size;
+        }
+        else if (*arg != '+')
+            files[nFiles++] = arg;
+    }
+
+    macroRefresh = 0;
+    selectBuffer(batchBuff);
+    clearBuffer();
+    buffer[b].readOnly = FALSE;
+    insertFile(macroFile, READ);
+    buffer[b].changed = FALSE;
+    compileMacro(batchBuff);
+
+    size_t tableSize = sizeof(BatchTable) + nFiles * sizeof(FileResult);
+    table = (BatchTable*)mmap(0, tableSize, PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (table == MAP_FAILED)
+        throw new Error("can't map the batch table");
+    table->next = 0;
+    memset(table->file, 0, nFiles * sizeof(FileResult));
+
+    double t0 = now();
+    if (jobs > nFiles)
+        jobs = nFiles;
+    int started = 0;
+    if (jobs > 1)
+    {
+        fflush(stdout);
+        fflush(stderr);
+        for ( ; started < jobs; started++)
+        {
+            pid_t pid = fork();
+            if (pid < 0)
+                break;
+            if (pid == 0)
+            {
+                work();
+                _exit(0);
+            }
+        }
+        while (wait(0) > 0)
+            ;
+    }
+    if (started == 0)                   // one job, or no fork: do it here
+    {
+        started = 1;
+        work();
+    }
+    double wall = now() - t0;
+
+    int count[3] = { 0, 0, 0 };
+    double fileSecs = 0;
+    for (int i = 0; i < nFiles; i++)
+    {
+        FileResult* r = &table->file[i];
+        printf("%-9s %8.3f s  %s%s\n", resultName[(int)r->result], r->secs,
+               files[i], r->stopped ? "  (macro stopped)" : "");
+        count[(int)r->result]++;
+        fileSecs += r->secs;
+    }
+    printf("%d files: %d saved, %d unchanged, %d failed, in %.3f s "
+           "(%.3f s of file time, %d jobs)\n", nFiles, count[FR_SAVED],
+           count[FR_UNCHANGED], count[FR_FAILED], wall, fileSecs, started);
+    fflush(stdout);
+    return count[FR_FAILED] ? 1 : 0;
+}
@@ -17,10 +17,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <limits.h>
 #include <unistd.h>
 #include <string.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <libgen.h>
+#include <time.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
 
 #include "termp.h"
 #include "ec.h"
@@ -29,10 +37,41 @@
                     // (use "xterm +cm" or "xterm*colorMode: true")
 #undef TERM_COLORS
 
+#define MAP_FILE_MIN (4*1024*1024)  // files this big are opened by mapping
+#define CR_CHECK    65536           // ... if no CR in this much at the start
+#define COPY_CHUNK  (8*1024*1024)   // mapped file copied in per idle moment
+#define COPY_POLL   1               // ms between pieces, to look for keys
+#define WRITE_CHUNK (256*1024)      // file write size, and scratch size
+#define SAVE_REPORT (4*1024*1024)   // report save speed for files this big
+#define SAVE_FORK   (1024*1024)     // save files this big in the background
+#define SAVE_POLL   200             // ms between looks at a background save
+
 int  row, col;      // current screen row and column position
 short* ip;          // pointer to current char in screenBuf
 bool  cursorGood;   // TRUE if ip matches real screen cursor position
+bool  dryRow;       // TRUE if walking a row only for its cursor and state
 int curDispAttr;    // current char attributes
+long bytesSearched; // text scanned by find()
+
+// What was last drawn on each screen row, so that update() can skip a row
+// that would come out the same. A row is known by a hash of its text and
+// the drawing state at its start; buffer text that is at the same place
+// and hasn't changed since (same textVersion) isn't even hashed again.
+
+typedef struct
+{
+    const char* src;        // start of the row's text
+    const char* srcEnd;     // its '\n' or terminating 0
+    long    version;        // textVersion when drawn
+    unsigned long hash;     // hash of the text, 0 if the row is unknown
+    short   hScroll;        // drawing state at the start of the row
+    short   tabSize;
+    int     attribIn;
+    unsigned char lexIn;
+    unsigned char lexOut;   // ... and the lexer state at its end
+} RowKey;
+
+RowKey  rowKey[SCRMAXHT];
 
 // ----------------------------------------------------------------------------
 // Clear screen using proper colors.
@@ -42,13 +81,186 @@ void clearScreenC()
     normalMode();
 #ifdef COLORS
     if (ansiColors)
-        printf("\e[30;47m");    // set colors to black on white
+        outStr("\e[30;47m");    // set colors to black on white
 #endif
     clearScreen();
-    for (int i = 0; i < SCRMAXHT*SCRMAXWD; )
-        screenImage[0][i++] = ' ';
+    short* sp = &screenImage[0][0];
+    for (int i = 0; i < SCRMAXHT*SCRMAXWD; i++)
+        *sp++ = ' ';
+    invalidateRows(0, SCRMAXHT-1);
+}
+
+// ----------------------------------------------------------------------------
+// Forget what was drawn on screen rows first to last, so they are redrawn.
+
+void invalidateRows(int first, int last)
+{
+    for (int r = first; r <= last; r++)
+        rowKey[r].hash = 0;
+}
+
+// ----------------------------------------------------------------------------
+// Move the row keys of rows top to bot up n rows (down if n < 0), as the
+// screen rows were. The rows left uncovered are forgotten.
+
+void scrollRowKeys(int top, int bot, int n)
+{
+    if (n > 0)
+    {
+        memmove(&rowKey[top], &rowKey[top+n], (bot-top+1-n) * sizeof(RowKey));
+        invalidateRows(bot-n+1, bot);
+    }
+    else if (n < 0)
+    {
+        memmove(&rowKey[top-n], &rowKey[top], (bot-top+1+n) * sizeof(RowKey));
+        invalidateRows(top, top-n-1);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Return the buffer whose text block p is in, or -1 if none.
+
+static int textBuffer(const char* p)
+{
+    for (int i = 0; i < MAX_BUFFERS; i++)
+    {
+        const char* start = i == b ? bstart : buffer[i].start;
+        const char* end = i == b ? bend : buffer[i].end;
+        if (start && p >= start && p <= end)
+            return i;
+    }
+    return -1;
+}
+
+// ----------------------------------------------------------------------------
+// Return the end of the gap, if it's in the current buffer's text, or 0.
+
+static char* gapEnd()
+{
+    return bgap > bstart && bgap < beot ? bgap + bgapLen : 0;
+}
+
+// ----------------------------------------------------------------------------
+// Return the lexer for the text of buffer bi, or 0 if it has none.
+
+static const Syntax* bufferSyntax(int bi)
+{
+    return buffer[bi].syntax ? buffer[bi].syntax : syntaxFor(0);
+}
+
+// ----------------------------------------------------------------------------
+// Return the lexer state at line start p in the text of buffer bi, starting
+// from the state cached for its line. A command buffer's text is short, and
+// is just lexed from its start.
+
+static int lexStateAt(int bi, const char* p)
+{
+    BuffRec* buf = &buffer[bi];
+    const Syntax* syn = bufferSyntax(bi);
+    const char* start = bi == b ? bstart : buf->start;
+    const char* eot = bi == b ? beot : buf->eot;
+    if (bi >= longCmdBuff)
+        return lexSpan(syn, start, p, LEX_START);
+
+    if (!buf->lexCache)
+        buf->lexCache = new LexCache;
+    if (!buf->lineIdx)
+        buf->lineIdx = new LineIndex;
+    if (!buf->lineIdx->valid)
+        buf->lineIdx->build(start, eot);
+    long lineStart;
+    long line = buf->lineIdx->lineOf(start, textSpan(start, p), &lineStart);
+    int state = buf->lexCache->stateOf(syn, buf->lineIdx, start, line);
+    return lexSpan(syn, textAt(start, lineStart), p, state);
+}
+
+// ----------------------------------------------------------------------------
+// Scroll screen rows top to bot up n rows (down if n < 0), on the terminal
+// and in screenImage. Returns FALSE if the terminal can't.
+
+static bool scrollScreen(int top, int bot, int n)
+{
+    normalMode();               // new rows get the background color
+#ifdef COLORS
+    if (ansiColors)
+        outStr("\e[30;47m");    // set colors to black on white
+#endif
+    if (!scrollRows(top, bot, n))
+        return FALSE;
+    int count = n > 0 ? n : -n;
+    long rowBytes = SCRMAXWD * sizeof(short);
+    if (n > 0)
+        memmove(&screenImage[top][0], &screenImage[top+n][0],
+                (bot-top+1-n) * rowBytes);
+    else
+        memmove(&screenImage[top-n][0], &screenImage[top][0],
+                (bot-top+1+n) * rowBytes);
+    int first = n > 0 ? bot - count + 1 : top;
+    for (int r = first; r < first + count; r++)
+        for (int c = 0; c < SCRMAXWD; c++)
+            screenImage[r][c] = ' ';
+    scrollRowKeys(top, bot, n);
+    return TRUE;
+}
+
+// ----------------------------------------------------------------------------
+// Before a window on rows top to bot is updated to start at topPos: if its
+// text is still on screen but shifted up or down, scroll it into place so
+// that only the newly exposed rows have to be drawn.
+
+void scrollToTop(const char* topPos, int hScroll, int top, int bot)
+{
+    // the new top line is further down in the window
+    for (int r = top + 1; r <= bot; r++)
+    {
+        RowKey* rk = &rowKey[r];
+        if (rk->hash && rk->src == topPos && rk->version == textVersion &&
+            rk->hScroll == hScroll)
+        {
+            scrollScreen(top, bot, r - top);
+            return;
+        }
+    }
+
+    // or the old top line is a few lines below the new one
+    RowKey* rk = &rowKey[top];
+    if (!(rk->hash && rk->version == textVersion && rk->hScroll == hScroll &&
+          textBuffer(topPos) >= 0) || rk->src <= topPos)
+        return;
+    const char* p = topPos;
+    for (int n = 1; n <= bot - top; n++)
+    {
+        p = findLineEnd(p);
+        if (!*p)
+            return;
+        p = lineAfter(p);
+        if (p == rk->src)
+        {
+            scrollScreen(top, bot, -n);
+            return;
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Hash the n characters at p, for a row of len characters.
+
+static unsigned long rowHash(const char* p, long n, long len)
+{
+    unsigned long h = 0x9e3779b97f4a7c15UL ^ (unsigned long)len;
+    for ( ; n >= 8; p += 8, n -= 8)
+    {
+        unsigned long w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0x100000001b3UL;
+        h ^= h >> 29;
+    }
+    for ( ; n > 0; p++, n--)
+        h = (h ^ (unsigned char)*p) * 0x100000001b3UL;
+    return h | 1;
 }
 
+
 // ----------------------------------------------------------------------------
 // Clear a line on screen using proper colors.
 
@@ -57,7 +269,7 @@ void clearLineC()
     normalMode();
 #ifdef COLORS
     if (ansiColors)
-        printf("\e[30;47m");    // set colors to black on white
+        outStr("\e[30;47m");    // set colors to black on white
 #endif
     clearLine();
 }
@@ -72,7 +284,9 @@ void putAttrChar(char c, int cAttr)
     if (cAttr == 0)
         cAttr = c;
 
-    if (cAttr != *ip)
+    if (dryRow)
+        ;
+    else if (cAttr != *ip)
     {
         int needAttrOn = attrib;
         int needAttrOff = curDispAttr & ~attrib;
@@ -91,7 +305,7 @@ void putAttrChar(char c, int cAttr)
 #endif
 #ifdef COLORS
             if (ansiColors)
-                printf("\e[30;47m");    // set colors to black on white
+                outStr("\e[30;47m");    // set colors to black on white
 #endif
         }
         else
@@ -104,7 +318,7 @@ void putAttrChar(char c, int cAttr)
             setForeColor(RED);
 #endif
 #ifdef COLORS
-            printf("\e[31m"); // set foreground color to red
+            outStr("\e[31m"); // set foreground color to red
 #endif
             boldMode();
         }
@@ -125,11 +339,14 @@ void putAttrChar(char c, int cAttr)
 }
 
 // ----------------------------------------------------------------------------
-// Update the screen as necessary, given the text and screen window pos
-// aborts update if a key is pressed.
-
-void update(const char* atopPos, int hScroll, int tabSize, int atopRow,
-            int abotRow)
+// Update the screen as necessary, given the text and screen window pos.
+// With CHECKKEY, stops between rows if a key is waiting, and returns FALSE.
+// With CURSROW, draws just the row holding the cursor, walking the rows
+// above it only to find its lexer state. Buffer text is highlighted a token
+// at a time, from the lexer state cached for its first line.
+
+bool update(const char* atopPos, int hScroll, int tabSize, int atopRow,
+            int abotRow, CheckMode check)
 {
 #ifdef TERM_COLORS
     setForeColor(BLACK);
@@ -137,33 +354,119 @@ void update(const char* atopPos, int hScroll, int tabSize, int atopRow,
 #endif
 #ifdef COLORS
     if (ansiColors)
-        printf("\e[30;47m");    // set colors to black on white
+        outStr("\e[30;47m");    // set colors to black on white
 #endif
     curDispAttr = 0;
     row = atopRow;
     col = -hScroll;
     cursorGood = FALSE;
     bool atEOT = FALSE;
-    int comment1Line = FALSE;
     ip = &screenImage[row][0];
+    int textBuff = textBuffer(atopPos);
+    const Syntax* syn = textBuff >= 0 ? bufferSyntax(textBuff) : 0;
+    bool isText = syn != 0;
+    int baseAttrib = attrib;            // highlighting is added to this
+    unsigned char lex = isText ? lexStateAt(textBuff, atopPos) : LEX_START;
+    const char* tokEnd = atopPos;       // end of the token being drawn
+    int tokAttrib = 0;                  // ... and its highlighting
+    bool rowStart = TRUE;
+    bool complete = TRUE;
+    RowKey drawn;
 
     const char* p;
     for (p = atopPos; row <= abotRow; )
     {
+        if (rowStart)
+        {
+            if (p == bgap)              // a row may start past the gap
+                p += bgapLen;
+            if (check == CHECKKEY && keyReady())
+            {
+                complete = FALSE;
+                break;
+            }
+
+            // skip the row if it's the same as what's on screen
+            rowStart = FALSE;
+            RowKey* rk = &rowKey[row];
+            drawn.src = p;
+            drawn.version = textVersion;
+            drawn.hScroll = hScroll;
+            drawn.tabSize = tabSize;
+            drawn.attribIn = baseAttrib;
+            drawn.lexIn = lex;
+            bool sameText = isText && rk->hash && rk->src == p &&
+                            rk->version == textVersion;
+            if (sameText)
+            {
+                drawn.srcEnd = rk->srcEnd;
+                drawn.hash = rk->hash;
+            }
+            else
+            {
+                // past the right edge, all that matters is whether there
+                // is a printing character
+                drawn.srcEnd = *p ? findLineEnd(p) : p;
+                long len = drawn.srcEnd - p;
+                long n = hScroll + screenWd;
+                bool more = FALSE;
+                for (const char* q = p + n; q < drawn.srcEnd && !more; q++)
+                    more = *q >= ' ';
+                drawn.hash = rowHash(p, len < n ? len : n, 2*len + more);
+            }
+            bool hasCurs = !atEOT && bcursPos >= p && bcursPos <= drawn.srcEnd;
+            if (!hasCurs && rk->hash == drawn.hash && rk->hScroll == hScroll &&
+                rk->tabSize == tabSize && rk->attribIn == baseAttrib &&
+                rk->lexIn == lex)
+            {
+                // the text may have changed past the right edge
+                if (isText && !sameText)
+                    rk->lexOut = lexSpan(syn, p, drawn.srcEnd + 1, lex);
+                rk->src = p;
+                rk->srcEnd = drawn.srcEnd;      // the text may have moved
+                rk->version = textVersion;
+                lex = rk->lexOut;
+                p = drawn.srcEnd;
+                if (*p)
+                    p++;
+                else
+                    atEOT = TRUE;
+                row++;
+                ip = &screenImage[row][0];
+                cursorGood = FALSE;
+                rowStart = TRUE;
+                continue;
+            }
+            dryRow = check == CURSROW && !hasCurs;
+        }
         if (p == bcursPos)
             if (!atEOT)
             {
                 cursRow = row;
                 cursCol = col;
             }
+        if (isText && p >= tokEnd && *p)
+            tokAttrib = tokenAttr[lexToken(syn, &lex, p, &tokEnd)];
+        attrib = baseAttrib | tokAttrib;
         if ( *p < ' ')
         {
             if ((*p == '\n') || *p == 0)        // '\n' or EOF
             {
                 short* nextRow = &screenImage[row+1][0];
                 bool dirty = FALSE;
-                if (!(attrib & AT_REVERSE) && comment1Line)
-                    attrib &= ~AT_BOLD;
+                if (dryRow)
+                {
+                    dryRow = FALSE;
+                    ip = nextRow;
+                    row++;
+                    col = -hScroll;
+                    rowStart = TRUE;
+                    if (*p != 0)
+                        p++;
+                    else
+                        atEOT = TRUE;
+                    continue;
+                }
 
                 while (ip < nextRow)
                 {
@@ -189,8 +492,13 @@ void update(const char* atopPos, int hScroll, int tabSize, int atopRow,
                 }
                 else
                     cursorGood = FALSE;
+                drawn.lexOut = lex;
+                rowKey[row] = drawn;
                 row++;
                 col = -hScroll;
+                rowStart = TRUE;
+                if (check == CURSROW)
+                    break;
             }
             else if (*p == '\t')                // TAB
             {
@@ -224,30 +532,32 @@ void update(const char* atopPos, int hScroll, int tabSize, int atopRow,
         {
             if (col >= 0 && col < screenWd-1)       // other text
             {
-                int cAttr = attrib + *p;
-
-                // turn on bold attribute if a comment
-                if (*p == '/' && *(p+1) == '/')
+                putAttrChar(*p, attrib + *p);
+            }
+            else if (col >= screenWd-1)         // rest of line is off screen
+            {
+                const char* eol = findLineEnd(p);
+                cursorGood = FALSE;
+                if (isText)
                 {
-                    attrib |= AT_BOLD;
-                    comment1Line = TRUE;
+                    const char* end = *eol ? eol + 1 : eol;
+                    lex = lexSpan(syn, tokEnd, end, lex);
+                    tokEnd = end;
                 }
-                else if (*p == '/' && *(p+1) == '*')
+                // the cursor column only needs to be far enough right to
+                // make updateWindows() scroll over
+                if (bcursPos > p && bcursPos < eol)
                 {
-                    attrib |= AT_BOLD;
-                    comment1Line = FALSE;
+                    cursRow = row;
+                    cursCol = col + (int)(bcursPos - p);
                 }
-
-                putAttrChar(*p, cAttr);
-
-                if (p > atopPos && *(p-1) == '*' && *p == '/')
-                    attrib &= ~AT_BOLD;
-
+                col += (int)(eol - p);
+                p = eol;
+                continue;
             }
             else
             {
                 cursorGood = FALSE;
-                attrib &= ~AT_BOLD;
                 col++;
             }
         }
@@ -257,23 +567,43 @@ void update(const char* atopPos, int hScroll, int tabSize, int atopRow,
             atEOT = TRUE;
     }
 
+    attrib = baseAttrib;
     normalMode();
 #ifdef TERM_COLORS
     setForeColor(BLACK);
 #endif
 #ifdef COLORS
     if (ansiColors)
-        printf("\e[0m"); // reset colors
+        outStr("\e[0m"); // reset colors
 #endif
+    dryRow = FALSE;
+    return complete;
 }
 
 // ----------------------------------------------------------------------------
 // Move memory: size bytes of src to dest.
 
-void movec(const char* src, char* dest, int size)
+void movec(const char* src, char* dest, long size)
+{
+    if (size > 0)
+        memmove(dest, src, (size_t)size);
+}
+
+// ----------------------------------------------------------------------------
+// Copy the n characters of the current buffer's text at p to dest, stepping
+// over the gap.
+
+static void copyText(const char* p, long n, char* dest)
 {
-    for ( ; size > 0; size--)
-        *dest++ = *src++;
+    if (p < bgap && p + n > bgap)
+    {
+        long k = bgap - p;
+        memcpy(dest, p, (size_t)k);
+        dest += k;
+        n -= k;
+        p = bgap + bgapLen;
+    }
+    memcpy(dest, p, (size_t)n);
 }
 
 // ----------------------------------------------------------------------------
@@ -281,18 +611,24 @@ void movec(const char* src, char* dest, int size)
 
 void clearBuffer()
 {
-    bcursPos = bstart;
-    beot = bstart;
-    bcursPos = bstart;
-    btagPos = bstart;
-    btopRowPos = bstart;
+    if (saveProgress(b))                // being saved: finish with the old text
+        finishSave();
+    bufUnmapFile();
+    bufClear();
     bhScroll = 0;
-    *beot = 0;
     btabSize = givenTabSize;
     if (!btabSize)
         btabSize = 8;
     buffer[b].changed = FALSE;
     buffer[b].lineEnding = lEnd_Unix;
+    if (buffer[b].lineIdx)
+        buffer[b].lineIdx->clear();
+    buffer[b].syntax = 0;
+    if (buffer[b].lexCache)
+        buffer[b].lexCache->clear();
+    if (buffer[b].undo)
+        buffer[b].undo->clear();
+    dropJournal();
 }
 
 // ----------------------------------------------------------------------------
@@ -332,16 +668,9 @@ void selectBuffer(int newb)
     }
     else
     {
-        bstart = (char*)malloc((size_t)(ELBOW+2));
-        if (!bstart)
-        {
-            bend = bstart;
-            throw new Error("out of memory");
-        }
-        bend = bstart + ELBOW;
+        bufNew();
         clearBuffer();
     }
-    lastTopPos = 0;
 }
 
 // ----------------------------------------------------------------------------
@@ -360,190 +689,355 @@ void makeFName(int b)
     buf->fname = p;
 }
 
+// ----------------------------------------------------------------------------
+// Return the current buffer's line index, building it if needed.
+
+static LineIndex* lineIndex()
+{
+    BuffRec* buf = &buffer[b];
+    if (!buf->lineIdx)
+        buf->lineIdx = new LineIndex;
+    if (!buf->lineIdx->valid)
+        buf->lineIdx->build(bstart, beot);
+    return buf->lineIdx;
+}
+
+// ----------------------------------------------------------------------------
+// Return the line of position p in the current buffer, if its lexer state
+// cache has states past it for an edit there to change, or else -1. The
+// cache is cleared if the line index isn't up to date to tell, and cut
+// back to the scanned lines if p is past them, as it is for each edit
+// while a macro runs, rather than scanning on to p.
+
+static long lexLine(const char* p)
+{
+    LexCache* lc = buffer[b].lexCache;
+    LineIndex* li = buffer[b].lineIdx;
+    if (!lc)
+        return -1;
+    if (!li || !li->valid)
+    {
+        lc->clear();
+        return -1;
+    }
+    long offs = textSpan(bstart, p);
+    long pending = li->pendingLine(offs);
+    if (pending >= 0)
+    {
+        lc->truncate(pending);
+        return -1;
+    }
+    long line = li->lineOf(bstart, offs, 0);
+    return line + 1 < lc->known() ? line : -1;
+}
+
+// ----------------------------------------------------------------------------
+// Return the current buffer's crash journal, making it if needed, or 0 if
+// its edits aren't journaled: it has no file open, or an edit is being
+// made in pieces that will be journaled as one.
+
+static int journalHold;                 // > 0 while an edit is in pieces
+
+static EditJournal* editJournal()
+{
+    BuffRec* buf = &buffer[b];
+    if (journalHold || !journalEdits || b >= longCmdBuff)
+        return 0;
+    if (!buf->journal)
+    {
+        if (!buf->open)
+            return 0;
+        char path[MAX_LINE];
+        journalPath(path, buf->fpath);
+        buf->journal = new EditJournal(path, buf->baseSize, buf->baseTime);
+    }
+    buf->journal->checkpoint(bstart, textSpan(bstart, beot));
+    return buf->journal;
+}
+
+// ----------------------------------------------------------------------------
+// Return the current buffer's undo journal, making it if needed, or 0 if
+// its edits aren't kept (the command buffers, or undomem=0).
+
+static UndoLog* undoLog()
+{
+    BuffRec* buf = &buffer[b];
+    if (b >= longCmdBuff || undoMem <= 0)
+        return 0;
+    if (!buf->undo)
+        buf->undo = new UndoLog;
+    return buf->undo;
+}
+
+// ----------------------------------------------------------------------------
+// Start a new undo step in the current buffer, for a command of the given
+// kind (UK_...). Typing and deleting keys continue a run of their own kind.
+
+void undoStep(int kind)
+{
+    if (buffer[b].undo)
+        buffer[b].undo->step(kind);
+}
+
+// ----------------------------------------------------------------------------
+// Undo the last step in the current buffer (if redo is FALSE), or redo the
+// last step undone.
+
+static void undoOrRedo(bool redo)
+{
+    if (buffer[b].readOnly)
+        throw new Error("read-only file");
+    UndoLog* u = undoLog();
+    bufFlat(b);
+    if (!u || !(redo ? u->redo() : u->undo()))
+        throw new Error(redo ? "nothing to redo" : "nothing to undo");
+    if (buffer[b].lineIdx)
+        buffer[b].lineIdx->valid = FALSE;
+    buffer[b].changed = TRUE;
+}
+
+void undoEdit()
+{
+    undoOrRedo(FALSE);
+}
+
+void redoEdit()
+{
+    undoOrRedo(TRUE);
+}
+
+// ----------------------------------------------------------------------------
+// Return the line number (from 0) of position p in the current buffer.
+
+long lineOfPos(const char* p)
+{
+    return lineIndex()->lineOf(bstart, textSpan(bstart, p), 0);
+}
+
+// ----------------------------------------------------------------------------
+// Return the start of line number line (from 0) in the current buffer,
+// or the end of text if there is no such line.
+
+char* lineStartPos(long line)
+{
+    return (char*)textAt(bstart, lineIndex()->startOf(bstart, line));
+}
+
 // ----------------------------------------------------------------------------
 // Cursor position to line#, char# for status line.
-// Exits early if a key is pressed.
 
 void cursToLineChar()
 {
-    int i = 1;
-    char* p = bstart;
-    while (p < bcursPos)
-        if (*p++ == '\n')
-        {
-            i++;
-        }
-    lineNum = i;
-    for (p = bcursPos-1; p > bstart; p--)
-        if (*p == '\n')
-            break;
-    charNum = (int)(bcursPos - p);
+    long lineStart;
+    long offs = textSpan(bstart, bcursPos);
+    lineNum = (int)lineIndex()->lineOf(bstart, offs, &lineStart) + 1;
+    charNum = (int)(offs - lineStart) + 1;
 }
 
 // ----------------------------------------------------------------------------
-// Find string in buffer starting at bcursPos, forwards or backwards search.
+// Find pattern in buffer: forwards, the first match at or after bcursPos;
+// backwards, the last match ending at or before bcursPos. The text before
+// and after the gap is searched in turn, as no match without a '\n' can
+// span it.
 
-const char* find(const char* str, int len)
+const char* find(const SearchPattern* pat)
 {
-    bool caseSens = FALSE;
-    const char* p;
-    for (p = str; *p; p++)
-        if (isupper(*p))
+    if (pat->hasNewline())
+        bufFlat(b);
+    char* ge = gapEnd();
+    const char* found = 0;
+    if (findForward)
+    {
+        const char* from = bcursPos;
+        if (ge && from < bgap)
         {
-            caseSens = TRUE;
-            break;
+            found = pat->findFwd(from, bgap);
+            bytesSearched += (found ? found : bgap) - from;
+            from = ge;
         }
-
-    if (len > 0)
+        if (!found)
+        {
+            found = pat->findFwd(from, beot);
+            bytesSearched += (found ? found : beot) - from;
+        }
+    }
+    else
     {
-        char ch0 = str[0];
-
-        if (findForward)
+        const char* to = bcursPos;
+        if (ge && to >= ge)
         {
-            char* last = beot - len;
-            int i = 0;
-            for (p = bcursPos; p < last; )
-            {
-                char c = *p++;
-                if (!caseSens && isupper(c))
-                    c = tolower(c);
-                if (c == ch0)
-                {
-                    const char* p2 = p;
-                    for (i = 1; i <= len;)
-                    {
-                        c = *p2++;
-                        if (!caseSens && isupper(c))
-                            c = tolower(c);
-                        if (str[i++] != c)
-                            break;
-                    }
-                    if (i > len)
-                        return p-1;
-                }
-            }
+            found = pat->findBack(ge, to);
+            bytesSearched += to - (found ? found : ge);
+            to = bgap;
         }
-        else
+        if (!found)
         {
-            char* last = bstart;
-            int i = 0;
-            for (p = bcursPos; p > last; )
-            {
-                char c = *(p--);
-                if (!caseSens && isupper(c))
-                    c = tolower(c);
-                if (c == ch0)
-                {
-                    const char* p2 = p+1;
-                    for (i = 1; i <= len;)
-                    {
-                        c = *p2++;
-                        if (!caseSens && isupper(c))
-                            c = tolower(c);
-                        if (str[i++] != c)
-                            break;
-                    }
-                    if (i > len)
-                        return p;
-                }
-            }
+            found = pat->findBack(bstart, to);
+            bytesSearched += to - (found ? found : bstart);
         }
     }
-    return 0;
+    return found;
+}
+
+static void rereadFile();
+
+// ----------------------------------------------------------------------------
+// Make sure none of buffer b's text is still in its mapped file before it's
+// changed. Normally settleFile() has copied it in already, at the start of
+// the command.
+
+static void ownText()
+{
+    if (!buffer[b].mapped)
+        return;
+    if (bufCopyIn(b, LONG_MAX) < 0)
+    {
+        rereadFile();
+        throw new Error("%s changed on disk, and was read again",
+                        buffer[b].fname);
+    }
 }
 
 // ----------------------------------------------------------------------------
 // Insert string into buffer b, at p.  If str is zero, it doesn't copy
-//  any text.
+//  any text. str may point into the buffer itself.
 
-void insert(char* p, const char* str, int n)
+void insert(char* p, const char* str, long n)
 {
     if (buffer[b].readOnly)
         throw new Error("%s is a read-only file", buffer[b].fname);
-
-    if (beot+n > bend)      // if no more room in buffer block, expand it
+    if (n <= 0)
+        return;
+    ownText();
+
+    // a source inside the buffer may move along with the text: it's used
+    // where it is if it's all before p, and copied out if not
+    char* copy = 0;
+    long strOffs = -1;
+    if (str && str >= bstart && str <= beot)
+        strOffs = textSpan(bstart, str);
+    p = bufEditAt(p, 0);
+    if (strOffs >= 0 && strOffs + n > p - bstart)
     {
-        int newSize = beot - bstart + n + ELBOW + 1;
-        char* newp = (char*)malloc((size_t)newSize);
-        if (newp)
-        {
-            char* op = newp;
-            // first copy buffer text before insertion point into new buf
-            const char* ip = bstart;
-            while (ip < p)
-                *op++ = *ip++;
-
-            // then add new text string (n bytes at str)
-            if (str)
-            {
-                ip = str;
-                for (int i = n; i > 0; i--)
-                    *op++ = *ip++;
-            }
-            else
-                op += n;
-
-            /* finally, append buffer text after insertion point, and
-               trailing zero. */
-            if (p)
-            {
-                for (ip = p; ip < beot; )
-                    *op++ = *ip++;
-            }
-            *op = 0;
-
-            free(bstart);
-            // ptrdiff_t insures 64-bit pointer offsets are handled
-            ptrdiff_t offset = newp - bstart;
-            bstart = newp;
-            bend = bstart + newSize - 1;
-            beot = bend - ELBOW;
-            bcursPos += offset;
-            btopRowPos += offset;
-        }
-        else
+        copy = (char*)malloc((size_t)n);
+        if (!copy)
             throw new Error("out of memory");
+        copyText(textAt(bstart, strOffs), n, copy);
+        str = copy;
+        strOffs = -1;
     }
-    else        // enough room in buffer, insert string
+    UndoLog* u = undoLog();
+    if (u)
+        u->edit(p - bstart, 0, 0, n);
+    EditJournal* j = editJournal();
+
+    p = bufOpen(p, n);
+    if (strOffs >= 0)
+        str = bstart + strOffs;
+    if (str)
+        memcpy(p, str, (size_t)n);
+    if (copy)
+        free(copy);
+    if (j && str)
+        j->edit(p - bstart, 0, p, n);
+
+    LineIndex* li = buffer[b].lineIdx;
+    if (li && li->valid)
     {
-        // first, move text after insertion point up by n
-        const char* ip = beot;
-        char* op = beot + n;
-        int i;
-        for (i = beot-p; i >= 0; i--)
-            *op-- = *ip--;
-
-        // then copy in new string, if any
+        if (macroLevel)         // leave the rest to be rescanned when needed
+            li->truncate(p - bstart);
         if (str)
-        {
-            ip = str;
-            op = (char*)p;
-            for (i = n; i > 0; i--)
-                *op++ = *ip++;
-        }
-        beot += n;
+            li->inserted(p - bstart, p, n);
+        else
+            li->valid = FALSE;  // text not known yet: rebuild later
     }
+    long ll = lexLine(p);
+    if (ll >= 0)
+        buffer[b].lexCache->edited(ll, 0, countNewlines(p, p + n));
     buffer[b].changed = TRUE;
 }
 
 // ----------------------------------------------------------------------------
 // Delete n characters in buffer b at p.
 
-void del(char* p, int n)
+void del(char* p, long n)
 {
     if (buffer[b].readOnly)
         throw new Error("read-only file");
-
-    if (beot >= p+n)
+    if (n <= 0)
+        return;
+    ownText();
+    p = bufEditAt(p, n);                // the n characters are then together
+    UndoLog* u = undoLog();
+    if (u)
+        u->edit(p - bstart, p, (p + n <= beot ? n : beot - p), 0);
+    EditJournal* j = editJournal();
+    if (j)
+        j->edit(p - bstart, (p + n <= beot ? n : beot - p), 0, 0);
+    long ll = lexLine(p);
+    if (ll >= 0)
+        buffer[b].lexCache->edited(ll, countNewlines(p, (p + n <= beot ?
+                                                         p + n : beot)), 0);
+
+    LineIndex* li = buffer[b].lineIdx;
+    if (li && li->valid)
     {
-        movec(p+n, p, beot+1-p-n);
-        beot -= n;
+        if (macroLevel)
+            li->truncate(p - bstart);
+        li->deleted(p - bstart, p, n);
     }
-    else
-        beot = p;
+    bufClose(p, n);
+    buffer[b].changed = TRUE;
+}
+
+// ----------------------------------------------------------------------------
+// Replace the count len-character spans at offsets offs[] in buffer b with
+// string repl, in one pass over the text.
+
+void replaceAll(const long* offs, long count, long len, const char* repl,
+                long replLen)
+{
+    if (buffer[b].readOnly)
+        throw new Error("read-only file");
+    if (count <= 0)
+        return;
+    ownText();
+    bufFlat(b);
+    UndoLog* u = undoLog();
+    if (u)                      // each match, where it is after those before
+        for (long k = 0; k < count; k++)
+            u->edit(offs[k] + k*(replLen - len), bstart + offs[k], len,
+                    replLen);
+    EditJournal* j = editJournal();
+    if (j)
+        j->replaceAll(offs, count, len, repl, replLen);
+    long ll = lexLine(bstart + offs[0]);
+    if (ll >= 0)
+        buffer[b].lexCache->truncate(ll);
+
+    bufReplace(offs, count, len, repl, replLen);
+    LineIndex* li = buffer[b].lineIdx;
+    if (li)
+        li->valid = FALSE;
     buffer[b].changed = TRUE;
 }
 
+// ----------------------------------------------------------------------------
+// Make the count changes sp[] to buffer b, as bufSplice() does.
+
+void spliceText(const Splice* sp, long count)
+{
+    ownText();
+    bufFlat(b);
+    EditJournal* j = editJournal();
+    if (j)
+        j->splice(sp, count);
+    long ll = count > 0 ? lexLine(bstart + sp[0].offs) : -1;
+    if (ll >= 0)
+        buffer[b].lexCache->truncate(ll);
+    bufSplice(sp, count);
+}
+
 // ----------------------------------------------------------------------------
 // Replace one character in buffer b at p with char c.
 
@@ -553,10 +1047,35 @@ void replace(char* p, int c)
 
     if (buffer[b].readOnly)
         throw new Error("read-only file");
+    bufFlat(b);
 
     if (bcursPos < beot)
     {
-        *bcursPos = c;
+        ownText();
+        UndoLog* u = undoLog();
+        if (u)
+            u->edit(bcursPos - bstart, bcursPos, 1, 1);
+        EditJournal* j = editJournal();
+        if (j)
+        {
+            char ch = c;
+            j->edit(bcursPos - bstart, 1, &ch, 1);
+        }
+        textVersion++;
+        long ll = lexLine(bcursPos);
+        if (ll >= 0)
+            buffer[b].lexCache->edited(ll, *bcursPos == '\n', c == '\n');
+        LineIndex* li = buffer[b].lineIdx;
+        if (li && li->valid && (*bcursPos == '\n' || c == '\n'))
+        {
+            if (macroLevel)
+                li->truncate(bcursPos - bstart);
+            li->deleted(bcursPos - bstart, bcursPos, 1);
+            *bcursPos = c;
+            li->inserted(bcursPos - bstart, bcursPos, 1);
+        }
+        else
+            *bcursPos = c;
         buffer[b].changed = TRUE;
     }
     else
@@ -567,30 +1086,121 @@ void replace(char* p, int c)
 }
 
 // ----------------------------------------------------------------------------
-// Check the current buffer's filename, and set tab size to 4 if a c file.
-// A .exrc file tabsize overrides this.
+// Check the current buffer's filename, and set its lexer and tab size from
+// its language. A .exrc file tabsize overrides this.
 
-void setTabSizeFromType()
+void setFileType()
 {
-    if (givenTabSize)
+    const char* name = buffer[b].fname;
+    const Syntax* syn = name ? syntaxFor(name) : 0;
+    if (name && syn != buffer[b].syntax)
     {
+        buffer[b].syntax = syn;
+        if (buffer[b].lexCache)
+            buffer[b].lexCache->clear();
+    }
+    if (givenTabSize)
         btabSize = givenTabSize;
-        return;
+    else if (syn && syn->tabSize)
+        btabSize = syn->tabSize;
+}
+
+// ----------------------------------------------------------------------------
+// Note the size and modify time of file fileName as that of buffer b's
+// file as opened or saved, which its journal's edits apply to.
+
+static void noteBase(const char* fileName)
+{
+    struct stat st;
+    buffer[b].baseSize = 0;
+    buffer[b].baseTime = 0;
+    if (stat(fileName, &st) == 0)
+    {
+        buffer[b].baseSize = st.st_size;
+        buffer[b].baseTime = st.st_mtim.tv_sec * 1000000000L +
+                             st.st_mtim.tv_nsec;
     }
-    char* p = buffer[b].fname;
-    if (!p)
-        return;
-    p = p + strlen(p) - 2;
-    while (*p != '.' && p > buffer[b].fname)
-        p--;
-    if (p[0] == '.' && (p[1] == 'c' || p[1] == 'h' || p[1] == 'v'))
-        btabSize = 4;
 }
 
 // ----------------------------------------------------------------------------
-// Read a file and insert it into buffer b at cursor.
+// Finish opening file fileName into buffer b: note which version of the
+// file it is, and recover any edits journaled to it.
+
+static void openedFile(const char* fileName)
+{
+    noteBase(fileName);
+    bool recovered = recoverJournal(fileName);
+    if (buffer[b].undo)                 // a file opened isn't an edit
+        buffer[b].undo->clear();
+    buffer[b].changed = recovered;
+}
+
+// ----------------------------------------------------------------------------
+// Read a file and insert it into buffer b at cursor. The text is read in
+// pieces, and journaled as one insert once it's all in.
+
+static bool readFile(const char* fileName, InsertMode mode);
+static void copyInFiles();
 
 bool insertFile(const char* fileName, InsertMode mode)
+{
+    long offs = textSpan(bstart, bcursPos);
+    long used = textSpan(bstart, beot);
+    bool found;
+    journalHold++;
+    try
+    {
+        found = readFile(fileName, mode);
+    } catch (Error* error)
+    {
+        journalHold--;
+        throw error;
+    }
+    journalHold--;
+    EditJournal* j = (mode == OPEN ? 0 : editJournal());
+    if (j)
+        j->edit(offs, 0, textAt(bstart, offs), textSpan(bstart, beot) - used);
+    return found;
+}
+
+// ----------------------------------------------------------------------------
+// Convert the line endings of text p..end to Unix style in place, setting
+// lineEnding to the style found. The count pointers track[] into the text
+// are moved along with it. Returns the new end.
+
+static char* convertEndings(char* p, char* end, char* lineEnding,
+                            char** track = 0, int count = 0)
+{
+    char* p2 = p;
+    *lineEnding = lEnd_Unix;
+    while (p < end)
+    {
+        char* cr = (char*)memchr(p, '\r', (size_t)(end - p));
+        char* segEnd = cr ? cr : end;
+        for (int i = 0; i < count; i++)
+            if (track[i] >= p && track[i] < segEnd)
+                track[i] = p2 + (track[i] - p);
+        movec(p, p2, segEnd - p);
+        p2 += segEnd - p;
+        p = segEnd;
+        if (cr)
+        {
+            bool pc = (p + 1 < end && p[1] == '\n');
+            *lineEnding = pc ? lEnd_PC : lEnd_Mac;
+            for (int i = 0; i < count; i++)
+                if (track[i] == p || (pc && track[i] == p + 1))
+                    track[i] = p2;
+            p += pc ? 2 : 1;
+            *p2++ = '\n';
+        }
+    }
+    for (int i = 0; i < count; i++)
+        if (track[i] >= end)
+            track[i] = p2 + (track[i] - end);
+    return p2;
+}
+
+static bool readFile(const char* fileName, InsertMode mode)
 {
     if (buffer[b].readOnly)
         throw new Error("read-only file");
@@ -601,20 +1211,48 @@ bool insertFile(const char* fileName, InsertMode mode)
         throw new Error("can't find file '%s'", fileName);
     buffer[b].readOnly = FALSE;
     if (fp == NULL)
+    {
         buffer[b].newFile = TRUE;
+        if (mode == OPEN)
+            openedFile(fileName);
+    }
     else
     {
         buffer[b].newFile = FALSE;
-        int size = 0;
+        long size = 0;
         if (!(fseek(fp, (long)0, 2) == 0 && (size = ftell(fp)) != EOF
             && fseek(fp, (long)0, 0) == 0))
             throw new Error("can't position file '%s'", fileName);
 
+        // a big Unix-style file opened into an empty buffer is mapped in
+        // rather than read, and its line index built as it's looked at
+        if (mode == OPEN && wasEmpty && size >= MAP_FILE_MIN)
+        {
+            char head[CR_CHECK];
+            long headSize = (long)fread(head, 1, CR_CHECK, fp);
+            if (!memchr(head, '\r', (size_t)headSize) &&
+                bufMapFile(fileno(fp), size))
+            {
+                fclose(fp);
+                if (buffer[b].lineIdx)
+                    buffer[b].lineIdx->valid = FALSE;
+                if (buffer[b].lexCache)
+                    buffer[b].lexCache->clear();
+                buffer[b].lineEnding = lEnd_Unix;
+                buffer[b].readOnly = access(fileName, W_OK);
+                setFileType();
+                addTimer(COPY_POLL, copyInFiles);
+                openedFile(fileName);
+                return TRUE;
+            }
+            fseek(fp, (long)0, 0);
+        }
+
         insert(bcursPos, 0, size);          // add space for text
         char* p = bcursPos;
         while (size > 0)                    // read text into space
         {
-            int freadSize = size;
+            long freadSize = size;
             if (size > 32000)
                 freadSize = 32000;
             fread(p, 1, freadSize, fp);
@@ -625,123 +1263,327 @@ bool insertFile(const char* fileName, InsertMode mode)
         fclose(fp);
 
         // convert line endings to Unix style
-        char lineEnding = lEnd_Unix;
-        char* p2 = bcursPos;
-        for (p = bcursPos; p < pEnd; p++)
-            if (*p == '\r')
-            {
-                if (p[1] == '\n')
-                {
-                    lineEnding = lEnd_PC;
-                    p++;
-                }
-                else
-                    lineEnding = lEnd_Mac;
-                *p2++ = '\n';
-            }
-            else
-                *p2++ = *p;
-        del(p2, p - p2);
+        char lineEnding;
+        char* p2 = convertEndings(bcursPos, pEnd, &lineEnding);
+        del(p2, pEnd - p2);
         buffer[b].lineEnding = lineEnding;
 
         if (mode == OPEN)
+        {
             buffer[b].readOnly = access(fileName, W_OK);
+            openedFile(fileName);
+        }
     }
 
     if (wasEmpty)
     {                   // if buffer was empty, set its TAB spacing
-        setTabSizeFromType();
+        setFileType();
     }
     return TRUE;
 }
 
 // ----------------------------------------------------------------------------
-// Write text in current buffer to a file, with backup and line ending fix.
+// Read buffer b's file again, as its mapping no longer matches it. The
+// buffer hasn't been changed, as that would have copied the file in.
 
-void writeToFile(const char* fName, const char* fPath, char* start, char* end)
+static void rereadFile()
 {
-    // if file already exists, back it up first
-    struct stat fileStats;
-    char backupName[MAX_LINE+10];
-    bool haveStats = FALSE;
-    FILE* fp = fopen(fPath, "r");
-    if (fp)
+    long offs = bcursPos - bstart;
+    clearBuffer();
+    buffer[b].readOnly = FALSE;         // until it's opened
+    insertFile(buffer[b].fpath, OPEN);
+    bcursPos = bstart + (offs < beot - bstart ? offs : beot - bstart);
+    beginLine(&bcursPos);
+    btopRowPos = bcursPos;
+    showMessage("%s changed on disk, and was read again", buffer[b].fname);
+}
+
+// ----------------------------------------------------------------------------
+// Convert buffer b's line endings in place, as readFile() would have, when a
+// CR turns up in its file after it was mapped as Unix-style text.
+
+static void convertMapped()
+{
+    char* track[] = { bcursPos, btagPos, btopRowPos };
+    char lineEnding;
+    char* end = convertEndings(bstart, beot, &lineEnding, track, 3);
+    bufClose(end, beot - end);
+    bcursPos = track[0];
+    btagPos = track[1];
+    btopRowPos = track[2];
+    buffer[b].lineEnding = lineEnding;
+    if (buffer[b].lineIdx)
+        buffer[b].lineIdx->valid = FALSE;
+    if (buffer[b].lexCache)
+        buffer[b].lexCache->clear();
+}
+
+// ----------------------------------------------------------------------------
+// Finish copying in buffer b's mapped file, if it has one, converting its
+// line endings if a CR turns up past what readFile() looked at. Called
+// before anything might change the text, and where nothing is holding
+// pointers into it.
+
+void settleFile()
+{
+    while (buffer[b].mapped)
     {
-        fclose(fp);
-        stat(fPath, &fileStats);
-        haveStats = TRUE;
-        strcpy(backupName, ".~");
-        strncat(backupName, fPath, MAX_LINE+9);
-        rename(fPath, backupName);
-    }
-
-    // make sure it's writable
-    fp = fopen(fPath, "w");
-    if (!fp)
-        throw new Error("can't write file '%s'", fName);
-
-    // convert line endings to file's style
-    char lineEnding = buffer[b].lineEnding;
-    if (lineEnding != lEnd_Unix)
-    {
-        // offsets needed because insert() may change bstart
-        ptrdiff_t startOffs = start - bstart;
-        ptrdiff_t endOffs = end - beot;
-        ptrdiff_t i = startOffs;
-        char* p;
-        while ((p = bstart+i) < beot + endOffs)
-        {
-            if (*p == '\n')
-                switch (lineEnding)
-                {
-                    case lEnd_PC:
-                        insert(p, "\r", 1);
-                        i++;
-                        break;
-                    case lEnd_Mac:
-                        *p = '\r';
-                        break;
-                }
-            i++;
+        long from = buffer[b].mapped->done;
+        if (bufCopyIn(b, LONG_MAX) < 0)
+        {
+            rereadFile();
+            continue;
+        }
+        char* p = bstart + from;
+        if (p < beot && memchr(p, '\r', (size_t)(beot - p)))
+            convertMapped();
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Read buffer b's file again if it has changed on disk while still mapped,
+// before the text is drawn from it.
+
+void checkMappedFile()
+{
+    if (buffer[b].mapped && bufCopyIn(b, 0) < 0)
+        rereadFile();
+}
+
+// ----------------------------------------------------------------------------
+// Timer: copy in the next piece of a mapped file. A file that has changed
+// is read again, and one with a CR in it is finished and converted.
+
+static void copyInFiles()
+{
+    for (int i = 0; i < MAX_BUFFERS; i++)
+    {
+        BuffRec* buf = &buffer[i];
+        if (!buf->mapped)
+            continue;
+        bToBuffer();
+        long from = buf->mapped->done;
+        long left = bufCopyIn(i, COPY_CHUNK);
+        char* p = buf->start + from;
+        char* end = buf->mapped ? buf->start + buf->mapped->done : buf->eot;
+        if (end > buf->eot)
+            end = buf->eot;
+        if (left < 0 || (p < end && memchr(p, '\r', (size_t)(end - p))))
+        {
+            int prevBuff = b;
+            selectBuffer(i);
+            if (left < 0)
+                rereadFile();
+            else
+            {
+                settleFile();           // may convert what's left to copy
+                if (buffer[b].lineEnding == lEnd_Unix)
+                    convertMapped();
+            }
+            selectBuffer(prevBuff);
+            if (b != longCmdBuff)
+                updateWindows();
+        }
+        addTimer(COPY_POLL, copyInFiles);
+        return;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Write all n bytes at p to file descriptor fd.
+
+static void writeAll(int fd, const char* fName, const char* p, size_t n)
+{
+    while (n > 0)
+    {
+        ssize_t done = write(fd, p, n);
+        if (done < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            throw new Error("can't write file '%s': %s", fName,
+                            strerror(errno));
         }
-        start = bstart + startOffs;
-        end = beot + endOffs;
+        p += done;
+        n -= done;
     }
+}
+
+static long* writeProgress;             // if set, gets the text written so far
+
+// ----------------------------------------------------------------------------
+// Write the text start..end to fd, with its '\n's converted to lineEnding.
+// Converted text goes out through a scratch buffer, leaving the text as is.
 
-    // write text
-    int size = end - start;
-    char* p = start;
-    while (size > 0)
+static void writeText(int fd, const char* fName, const char* start,
+                      const char* end, char lineEnding)
+{
+    long done = writeProgress ? *writeProgress : 0;
+    if (lineEnding == lEnd_Unix)
     {
-        int writeSize = size;
-        if (size > 32000)
-            writeSize = 32000;
-        fwrite(p, 1, writeSize, fp);
-        size -= writeSize;
-        p += writeSize;
+        for (const char* p = start; p < end; )
+        {
+            size_t n = end - p < WRITE_CHUNK ? end - p : WRITE_CHUNK;
+            writeAll(fd, fName, p, n);
+            p += n;
+            if (writeProgress)
+                *writeProgress = done + (p - start);
+        }
+        return;
     }
-    fclose(fp);
 
-    // convert line endings back
-    for (p = start; p < end; p++)
-        if (*p == '\r')
+    char* scratch;
+    if (posix_memalign((void**)&scratch, (size_t)getpagesize(), WRITE_CHUNK))
+        throw new Error("out of memory");
+    const char* eol = lineEnding == lEnd_PC ? "\r\n" : "\r";
+    size_t eolLen = strlen(eol);
+    size_t used = 0;
+    const char* p = start;
+    while (p < end)
+    {
+        // copy up to the next newline, or as much as fits, looking no
+        // further than that so a long line is only scanned once
+        size_t room = WRITE_CHUNK - eolLen - used;
+        const char* lim = (size_t)(end - p) > room ? p + room : end;
+        const char* nl = findNthNewline(p, lim, 1);
+        const char* segEnd = nl ? nl : lim;
+        size_t n = segEnd - p;
+        memcpy(scratch + used, p, n);
+        used += n;
+        p = segEnd;
+        if (nl)
+        {
+            memcpy(scratch + used, eol, eolLen);
+            used += eolLen;
+            p++;
+        }
+        if (used + eolLen >= WRITE_CHUNK || p >= end)
         {
-            if (p[1] == '\n')
+            try
+            {
+                writeAll(fd, fName, scratch, used);
+            }
+            catch (Error* err)
             {
-                del(p+1, 1);
-                end--;
+                free(scratch);
+                throw err;
             }
-            *p = '\n';
+            used = 0;
+            if (writeProgress)
+                *writeProgress = done + (p - start);
         }
+    }
+    free(scratch);
+}
+
+// ----------------------------------------------------------------------------
+// Write text in current buffer to a file, with backup and line ending fix.
+// The text goes to a temporary file beside it, which is then renamed over
+// the old file, so that a failed save leaves the old one intact.
 
+void writeToFile(const char* fName, const char* fPath, char* start, char* end)
+{
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    // save through a symbolic link to the file it names
+    char realPath[MAX_LINE];
+    struct stat fileStats;
+    bool haveStats = (lstat(fPath, &fileStats) == 0);
+    if (haveStats && S_ISLNK(fileStats.st_mode))
+    {
+        char* target = realpath(fPath, 0);
+        if (!target)
+            throw new Error("can't follow link '%s'", fName);
+        strncpy(realPath, target, MAX_LINE-1);
+        realPath[MAX_LINE-1] = 0;
+        free(target);
+        fPath = realPath;
+        haveStats = (stat(fPath, &fileStats) == 0);
+    }
+
+    // temporary and backup files go in the same directory
+    char dirPath[MAX_LINE];
+    char baseName[MAX_LINE];
+    strncpy(dirPath, fPath, MAX_LINE-1);
+    dirPath[MAX_LINE-1] = 0;
+    strcpy(baseName, dirPath);
+    const char* dir = dirname(dirPath);
+    const char* base = basename(baseName);
+    char tmpName[2*MAX_LINE+10];
+    char backupName[2*MAX_LINE+10];
+    snprintf(tmpName, sizeof(tmpName), "%s/.%s.XXXXXX", dir, base);
+    snprintf(backupName, sizeof(backupName), "%s/.~%s", dir, base);
+
+    int fd = mkstemp(tmpName);
+    if (fd < 0)
+        throw new Error("can't write file '%s': %s", fName, strerror(errno));
+    mode_t mode;
     if (haveStats)
-        chmod(fPath, fileStats.st_mode);
+        mode = fileStats.st_mode & 07777;
+    else
+    {
+        mode_t mask = umask(0);
+        umask(mask);
+        mode = 0666 & ~mask;
+    }
+    try
+    {
+        // the text before the gap, if it's in there, then the rest
+        char* mid = start < bgap && end > bgap ? bgap : end;
+        writeText(fd, fName, start, mid, buffer[b].lineEnding);
+        if (mid < end)
+            writeText(fd, fName, mid + bgapLen, end, buffer[b].lineEnding);
+        if (fchmod(fd, mode) != 0 || (syncSave && fsync(fd) != 0))
+            throw new Error("can't write file '%s': %s", fName,
+                            strerror(errno));
+    }
+    catch (Error* err)
+    {
+        close(fd);
+        unlink(tmpName);
+        throw err;
+    }
+    if (close(fd) != 0)
+    {
+        unlink(tmpName);
+        throw new Error("can't write file '%s': %s", fName, strerror(errno));
+    }
+
+    // keep the old file as the backup, then put the new one in its place
+    if (haveStats && makeBak)
+    {
+        unlink(backupName);
+        if (link(fPath, backupName) != 0)
+            rename(fPath, backupName);
+    }
+    if (rename(tmpName, fPath) != 0)
+    {
+        int err = errno;
+        unlink(tmpName);
+        throw new Error("can't write file '%s': %s", fName, strerror(err));
+    }
+    if (syncSave)
+    {
+        int dirFd = open(dir, O_RDONLY);
+        if (dirFd >= 0)
+        {
+            fsync(dirFd);
+            close(dirFd);
+        }
+    }
+
     buffer[b].changed = FALSE;
     buffer[b].newFile = FALSE;
 
-    // if backups disabled, delete backup
-    if (!makeBak)
-        unlink(backupName);
+    long size = textSpan(start, end);
+    if (size >= SAVE_REPORT)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec)/1e9;
+        showMessage("saved %s: %.1f MB in %.2f s (%.0f MB/s)", fName,
+                    size/1e6, secs, secs > 0 ? size/1e6/secs : 0.);
+    }
 }
 
 // ----------------------------------------------------------------------------
@@ -754,7 +1596,207 @@ void saveBuffer()
     if (!buffer[b].open)
         throw new Error("no file open");
 
+    finishSave();                       // of this or another buffer
     writeToFile(buffer[b].fname, buffer[b].fpath, bstart, beot);
+    dropJournal();                      // the saved file is the new base
+    noteBase(buffer[b].fpath);
+}
+
+// ----------------------------------------------------------------------------
+// Background saves. A forked process writes the file from its copy of the
+// text, which shares pages with the editor's until either one changes
+// them, so the editor carries on at once and the text saved stays as it
+// was. The process tells how far it has got, and then how it went, in
+// shared memory that a timer looks at. The buffer is marked unchanged as
+// the save starts, so any edit made meanwhile marks it changed again.
+
+typedef struct                  // shared with the saving process
+{
+    long    done, total;        // text written, of all of it
+    bool    ok;                 // the file was saved
+    double  secs;               // time it took
+    char    err[MAX_LINE];      // why it wasn't
+} SaveState;
+
+static SaveState* saveState;
+static pid_t savePid;           // process saving buffer saveBuff
+static int  saveBuff = -1;      // -1 if none
+
+int autosaveSecs = 0;           // seconds between autosaves, 0 for none
+
+// ----------------------------------------------------------------------------
+// A background save of buffer saveBuff has ended: mark the buffer as saved
+// and keep its journal's later edits, or report the error.
+
+static void savedInBackground()
+{
+    int sb = saveBuff;
+    saveBuff = -1;
+    int prevBuff = b;
+    selectBuffer(sb);
+    BuffRec* buf = &buffer[b];
+    if (saveState->ok)
+    {
+        buf->newFile = FALSE;
+        noteBase(buf->fpath);
+        if (!buf->changed)
+            dropJournal();
+        else if (buf->journal)
+            buf->journal->rebase(buf->baseSize, buf->baseTime);
+        long size = saveState->total;
+        double secs = saveState->secs;
+        if (size >= SAVE_REPORT)
+            showMessage("saved %s: %.1f MB in %.2f s (%.0f MB/s)", buf->fname,
+                        size/1e6, secs, secs > 0 ? size/1e6/secs : 0.);
+    }
+    else
+    {
+        buf->changed = TRUE;
+        showMessage("%s", saveState->err[0] ? saveState->err :
+                    "background save failed");
+    }
+    selectBuffer(prevBuff);
+    redrawFileStat(sb);
+}
+
+// ----------------------------------------------------------------------------
+// Timer: see if the background save is done, or show how far it has got.
+
+static void pollSave()
+{
+    if (saveBuff < 0)
+        return;
+    if (waitpid(savePid, 0, WNOHANG) == 0)
+    {
+        redrawFileStat(saveBuff);
+        addTimer(SAVE_POLL, pollSave);
+        return;
+    }
+    savedInBackground();
+}
+
+// ----------------------------------------------------------------------------
+// Wait for any background save to end.
+
+void finishSave()
+{
+    if (saveBuff < 0)
+        return;
+    cancelTimer(pollSave);
+    while (waitpid(savePid, 0, 0) < 0 && errno == EINTR)
+        ;
+    savedInBackground();
+}
+
+// ----------------------------------------------------------------------------
+// Save buffer b's file, in the background if it's big. A small one is just
+// saved, as that's quicker than starting a process.
+
+void saveInBackground()
+{
+    if (buffer[b].readOnly)
+        throw new Error("read-only file");
+    if (!buffer[b].open)
+        throw new Error("no file open");
+    finishSave();
+    if (textSpan(bstart, beot) < SAVE_FORK)
+    {
+        saveBuffer();
+        return;
+    }
+    if (!saveState)
+    {
+        void* p = mmap(0, sizeof(SaveState), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+        {
+            saveBuffer();
+            return;
+        }
+        saveState = (SaveState*)p;
+    }
+    memset(saveState, 0, sizeof(SaveState));
+    saveState->total = textSpan(bstart, beot);
+    if (buffer[b].journal)
+        buffer[b].journal->mark();
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        saveBuffer();
+        return;
+    }
+    if (pid == 0)
+    {
+        signal(SIGWINCH, SIG_IGN);      // the screen is the editor's
+        writeProgress = &saveState->done;
+        struct timespec t0, t1;
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+        try
+        {
+            writeToFile(buffer[b].fname, buffer[b].fpath, bstart, beot);
+            saveState->ok = TRUE;
+        } catch (Error* err)
+        {
+            strncpy(saveState->err, err->message, MAX_LINE-1);
+        }
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        saveState->secs = (t1.tv_sec - t0.tv_sec) +
+                          (t1.tv_nsec - t0.tv_nsec)/1e9;
+        _exit(0);
+    }
+    savePid = pid;
+    saveBuff = b;
+    buffer[b].changed = FALSE;
+    addTimer(SAVE_POLL, pollSave);
+}
+
+// ----------------------------------------------------------------------------
+// Return the progress of a background save of buffer sb, as " 42%", or 0 if
+// it isn't being saved.
+
+const char* saveProgress(int sb)
+{
+    static char s[8];
+    if (sb != saveBuff || sb < 0)
+        return 0;
+    long total = saveState->total;
+    snprintf(s, sizeof(s), "%3ld%%",
+             total > 0 ? saveState->done * 100 / total : 0L);
+    return s;
+}
+
+// ----------------------------------------------------------------------------
+// Timer, every autosaveSecs: start saving the first changed file, unless a
+// save is going on already.
+
+void autosave()
+{
+    if (autosaveSecs <= 0)
+        return;
+    addTimer(autosaveSecs * 1000, autosave);
+    if (saveBuff >= 0 || macroLevel)
+        return;
+    bToBuffer();
+    for (int i = 0; i < longCmdBuff; i++)
+    {
+        BuffRec* buf = &buffer[i];
+        if (buf->start && buf->open && buf->changed && !buf->readOnly)
+        {
+            int prevBuff = b;
+            selectBuffer(i);
+            try
+            {
+                saveInBackground();
+            } catch (Error* err)
+            {
+                showMessage("autosave: %s", err->message);
+                delete err;
+            }
+            selectBuffer(prevBuff);
+            return;
+        }
+    }
 }
 
 // ----------------------------------------------------------------------------
@@ -785,15 +1827,12 @@ void writeTaggedToFile(const char* fName)
 
 void beginLine(char** p)
 {
-    char* rp = *p - 1;
-    if (rp < bstart)
+    char* ge = gapEnd();
+    char* start = ge && *p >= ge ? ge : bstart;     // a line starts there
+    if (*p <= start)
         return;
-    while (rp > bstart && *rp != '\n')
-        rp--;
-    if (*rp != '\n')
-        *p = bstart;
-    else
-        *p = rp + 1;
+    const char* nl = findPrevNewline(start, *p);
+    *p = nl ? (char*)nl + 1 : start;
 }
 
 // ----------------------------------------------------------------------------
@@ -801,6 +1840,17 @@ void beginLine(char** p)
 
 void backChar(char** p, int n)
 {
+    char* ge = gapEnd();
+    if (ge && *p >= ge)
+    {
+        if (*p - n >= ge)
+        {
+            *p -= n;
+            return;
+        }
+        n -= *p - ge;
+        *p = bgap;
+    }
     if (*p - n > bstart)
         *p -= n;
     else
@@ -812,23 +1862,44 @@ void backChar(char** p, int n)
 
 void fwdChar(char** p, int n)
 {
+    char* ge = gapEnd();
+    if (ge && *p < bgap && *p + n >= bgap)
+    {
+        n -= bgap - *p;
+        *p = ge;
+    }
     if (*p + n < beot)
         *p += n;
     else
         *p = beot;
 }
 
+// ----------------------------------------------------------------------------
+// Step pointer p back or forward a character in the current buffer's text,
+// over the gap, whose end is ge, or 0 if it has none.
+
+static inline char* prevChar(char* p, char* ge)
+{
+    return p == ge ? bgap - 1 : p - 1;
+}
+
+static inline char* nextChar(char* p, char* ge)
+{
+    return ge && p + 1 == bgap ? ge : p + 1;
+}
+
 // ----------------------------------------------------------------------------
 // Move pointer p back n words.
 
 void backWord(char** p, int n)
 {
+    char* ge = gapEnd();
     char* rp = *p;
     for ( ; n > 0 && rp > bstart; n--)
     {
         while (rp > bstart)             // first back up over whitespace
         {
-            rp--;
+            rp = prevChar(rp, ge);
             if (*rp > ' ' || *rp == '\n')
                 break;
         }
@@ -840,7 +1911,7 @@ void backWord(char** p, int n)
                 {
                     if (!(isalnum(*rp) || *rp == '_'))
                         break;
-                    rp--;
+                    rp = prevChar(rp, ge);
                 }
             }
             else                            // or symbol: back over it
@@ -849,10 +1920,10 @@ void backWord(char** p, int n)
                 {
                     if ((isalnum(*rp) || *rp == '_') || *rp <= ' ')
                         break;
-                    rp--;
+                    rp = prevChar(rp, ge);
                 }
             }
-            rp++;                       // sit on first char of it
+            rp = nextChar(rp, ge);      // sit on first char of it
         }
     }
     *p = rp;
@@ -867,7 +1938,7 @@ void fwdWord(char** p, int n)
     for ( ; n > 0 && rp < beot; n--)
     {
         if (*rp == '\n')
-            rp++;
+            rp = (char*)lineAfter(rp);
         if (isalnum(*rp) || *rp == '_')
         {
             rp++;
@@ -903,18 +1974,25 @@ void fwdWord(char** p, int n)
 
 void backLine(char** p, int n)
 {
-    if (*p > bstart)
+    if (*p > bstart && n > 0)
     {
-        char* rp = *p - 1;
-        while (rp > bstart && n > 0)
+        // the newline ending the previous line doesn't count; past the
+        // gap, the text after it is searched first
+        const char* end = *p - 1;
+        char* ge = gapEnd();
+        if (ge && *p >= ge)
         {
-            rp--;
-            if (*rp == '\n')
-                n--;
+            const char* nl = findNthNewlineBack(ge, end, n);
+            if (nl)
+            {
+                *p = (char*)nl + 1;
+                return;
+            }
+            n -= countNewlines(ge, end);
+            end = *p > ge ? bgap : bgap - 1;
         }
-        *p = rp;
-        if (rp > bstart || (rp == bstart && n == 0))
-            fwdChar(p, 1);
+        const char* nl = findNthNewlineBack(bstart, end, n);
+        *p = nl ? (char*)lineAfter(nl) : bstart;
     }
 }
 
@@ -923,11 +2001,25 @@ void backLine(char** p, int n)
 
 void fwdLine(char** p, int n)
 {
-    char* rp = *p;
-    while (rp < beot && n > 0)
-        if (*(rp++) == '\n')
-            n--;
-    *p = rp;
+    if (n > 0)
+    {
+        // before the gap, the text up to it is searched first
+        const char* from = *p;
+        char* ge = gapEnd();
+        if (ge && from < bgap)
+        {
+            const char* nl = findNthNewline(from, bgap, n);
+            if (nl)
+            {
+                *p = (char*)lineAfter(nl);
+                return;
+            }
+            n -= countNewlines(from, bgap);
+            from = ge;
+        }
+        const char* nl = findNthNewline(from, beot, n);
+        *p = nl ? (char*)nl + 1 : beot;
+    }
 }
 
 // ----------------------------------------------------------------------------
@@ -0,0 +1,810 @@
+// ****************************************************************************
+// ecjournal.cc  Macro Screen Editor crash journals
+//
+// Copyright (C) 2023 Scott Forbes
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// ****************************************************************************
+//
+// Each edit to a buffer with a file open is appended to a journal beside
+// the file, ".<name>.ecj", as a short binary record. Records collect in
+// memory and are written together, a moment after the typing stops or
+// when enough have piled up, and the write-back is started without
+// waiting for it, so no keystroke waits on the disk. The journal is
+// removed when the file is saved or the buffer is closed, and rewritten
+// as one record of the whole text if it grows much bigger than the text.
+//
+// When a file with a journal is opened, the journal's edits are replayed
+// onto it, if the file is still the one they were made to. The replay
+// works on a copy of the text split into small chunks, so each record
+// costs about its own size rather than a move of the whole text.
+//
+// A journal starts with "ECJ1" and the size and modify time of the file,
+// then has records of these forms, with numbers as base-128 varints:
+//   E offs remLen insLen text          replace remLen chars at offs
+//   R count len replLen repl gaps...   replace count len-char spans, each
+//                                        gap after the end of the last one
+//   S count (gap len textLen text)...  splice count spans, as bufSplice()
+//   C len text                         replace all of the text
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <libgen.h>
+#include <sys/stat.h>
+
+#include "termp.h"
+#include "ec.h"
+
+#define JOURNAL_DELAY   250     // ms after an edit to write the records
+#define JOURNAL_BATCH   65536   // records worth writing right away
+#define JOURNAL_SLACK   (4*1024*1024) // journal growth allowed beyond ...
+#define JOURNAL_RATIO   4       //   this times the text, before a checkpoint
+
+static const char magic[] = "ECJ1";
+
+bool    journalEdits = TRUE;    // TRUE to keep crash journals
+
+// ----------------------------------------------------------------------------
+// Put the name of the journal for file filePath into path.
+
+void journalPath(char* path, const char* filePath)
+{
+    char dirPath[MAX_LINE];
+    char baseName[MAX_LINE];
+    snprintf(dirPath, sizeof(dirPath), "%s", filePath);
+    strcpy(baseName, dirPath);
+    snprintf(path, MAX_LINE, "%s/.%s.ecj", dirname(dirPath),
+             basename(baseName));
+}
+
+// ----------------------------------------------------------------------------
+// Make a journal, at path, for edits to a file of the given size and modify
+// time. The file isn't made until the first edit.
+
+EditJournal::EditJournal(const char* jPath, long size, long time)
+{
+    fd = -1;
+    snprintf(path, sizeof(path), "%s", jPath);
+    baseSize = size;
+    baseTime = time;
+    pend = 0;
+    pendLen = pendMax = 0;
+    written = 0;
+    since = 0;
+    failed = FALSE;
+}
+
+EditJournal::~EditJournal()
+{
+    flush();
+    if (fd >= 0)
+        close(fd);
+    free(pend);
+}
+
+// ----------------------------------------------------------------------------
+// Carry on with journal file fd, which has size bytes of good records.
+
+void EditJournal::resume(int jfd, long size)
+{
+    fd = jfd;
+    written = size;
+}
+
+// ----------------------------------------------------------------------------
+// Add n bytes at p to the pending records.
+
+void EditJournal::put(const void* p, long n)
+{
+    if (pendLen + n > pendMax)
+    {
+        long newMax = pendMax ? 2*pendMax : JOURNAL_BATCH;
+        if (newMax < pendLen + n)
+            newMax = pendLen + n;
+        char* newPend = (char*)realloc(pend, (size_t)newMax);
+        if (!newPend)
+            throw new Error("out of memory for the journal");
+        pend = newPend;
+        pendMax = newMax;
+    }
+    memcpy(pend + pendLen, p, (size_t)n);
+    pendLen += n;
+}
+
+// ----------------------------------------------------------------------------
+// Put number n into bytes, 7 bits to a byte, low bits first. Returns the
+// number of bytes used, at most 10.
+
+static int encodeNum(unsigned char* bytes, unsigned long n)
+{
+    int len = 0;
+    do
+    {
+        bytes[len] = n & 0x7f;
+        n >>= 7;
+        if (n)
+            bytes[len] |= 0x80;
+        len++;
+    } while (n);
+    return len;
+}
+
+// ----------------------------------------------------------------------------
+// Add number n to the pending records.
+
+void EditJournal::putNum(unsigned long n)
+{
+    unsigned char bytes[10];
+    put(bytes, encodeNum(bytes, n));
+}
+
+// ----------------------------------------------------------------------------
+// Make the journal file, name, and write its header. Returns FALSE if it can't
+// be made, after which edits are ignored.
+
+bool EditJournal::create(const char* name)
+{
+    fd = open(name, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    unsigned char header[24];
+    memcpy(header, magic, 4);
+    int len = 4;
+    len += encodeNum(header + len, baseSize);
+    len += encodeNum(header + len, baseTime);
+    if (fd >= 0 && write(fd, header, len) != len)
+    {
+        close(fd);
+        unlink(name);
+        fd = -1;
+    }
+    if (fd < 0)
+    {
+        failed = TRUE;
+        return FALSE;
+    }
+    written = len;
+    return TRUE;
+}
+
+// ----------------------------------------------------------------------------
+// A record has been added after wasPending bytes of them: write them now if
+// there are a lot, or else soon after the first one.
+
+void EditJournal::record(long wasPending)
+{
+    if (pendLen >= JOURNAL_BATCH)
+        flush();
+    else if (wasPending == 0)
+        addTimer(JOURNAL_DELAY, flushJournals);
+}
+
+// ----------------------------------------------------------------------------
+// Note that remLen characters at offs are to be replaced with the insLen
+// characters at ins.
+
+void EditJournal::edit(long offs, long remLen, const char* ins, long insLen)
+{
+    if (failed || (remLen == 0 && insLen == 0))
+        return;
+    long was = pendLen;
+    put("E", 1);
+    putNum(offs);
+    putNum(remLen);
+    putNum(insLen);
+    put(ins, insLen);
+    record(was);
+}
+
+// ----------------------------------------------------------------------------
+// Note a replaceAll() of count len-character spans at offs[] with repl.
+
+void EditJournal::replaceAll(const long* offs, long count, long len,
+                             const char* repl, long replLen)
+{
+    if (failed || count <= 0)
+        return;
+    long was = pendLen;
+    put("R", 1);
+    putNum(count);
+    putNum(len);
+    putNum(replLen);
+    put(repl, replLen);
+    long end = 0;
+    for (long k = 0; k < count; k++)
+    {
+        putNum(offs[k] - end);
+        end = offs[k] + len;
+    }
+    record(was);
+}
+
+// ----------------------------------------------------------------------------
+// Note a bufSplice() of the count changes sp[].
+
+void EditJournal::splice(const Splice* sp, long count)
+{
+    if (failed || count <= 0)
+        return;
+    long was = pendLen;
+    put("S", 1);
+    putNum(count);
+    long end = 0;
+    for (long k = 0; k < count; k++)
+    {
+        putNum(sp[k].offs - end);
+        putNum(sp[k].len);
+        putNum(sp[k].textLen);
+        put(sp[k].text, sp[k].textLen);
+        end = sp[k].offs + sp[k].len;
+    }
+    record(was);
+}
+
+// ----------------------------------------------------------------------------
+// If the journal has grown well past the size of the text, len characters
+// at text, replace it with one record of the whole text, so that it can
+// be replayed about as fast as the file can be read.
+
+void EditJournal::checkpoint(const char* text, long len)
+{
+    if (failed || size() < JOURNAL_RATIO*len + JOURNAL_SLACK)
+        return;
+    char newPath[MAX_LINE+8];
+    snprintf(newPath, sizeof(newPath), "%s.new", path);
+    if (fd >= 0)
+        close(fd);
+    pendLen = 0;
+    since = 0;                          // the record stands on its own
+    if (!create(newPath))
+        return;
+    put("C", 1);
+    putNum(len);
+    long head = text < bgap && bgap - text < len ? bgap - text : len;
+    put(text, head);                    // the text before the gap, if in it
+    put(textAt(text, head), len - head);
+    flush();
+    fdatasync(fd);
+    if (rename(newPath, path) != 0)
+    {
+        unlink(newPath);
+        failed = TRUE;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Note that the text as it is now is being saved: the records from here on
+// are the ones to keep if it is, as rebase() does.
+
+void EditJournal::mark()
+{
+    flush();
+    since = written;
+}
+
+// ----------------------------------------------------------------------------
+// The text as of mark() was saved, making a file of the given size and
+// modify time. Rewrite the journal as the records since then, applied to
+// that file, or remove it if there are none.
+
+void EditJournal::rebase(long size, long time)
+{
+    flush();
+    unsigned char bytes[10];
+    long from = 4 + encodeNum(bytes, baseSize) + encodeNum(bytes, baseTime);
+    if (since > from)
+        from = since;
+    long to = written;
+    baseSize = size;
+    baseTime = time;
+    since = 0;
+    if (failed)
+        return;
+    if (fd < 0 || from >= to)
+    {
+        remove();
+        written = 0;
+        return;
+    }
+
+    int oldFd = fd;
+    char newPath[MAX_LINE+8];
+    snprintf(newPath, sizeof(newPath), "%s.new", path);
+    bool ok = create(newPath);
+    char block[JOURNAL_BATCH];
+    for (long offs = from; ok && offs < to; )
+    {
+        long n = to - offs < JOURNAL_BATCH ? to - offs : JOURNAL_BATCH;
+        ok = (pread(oldFd, block, (size_t)n, offs) == n &&
+              write(fd, block, (size_t)n) == n);
+        offs += n;
+        written += n;
+    }
+    close(oldFd);
+    if (!ok || rename(newPath, path) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        fd = -1;
+        unlink(newPath);
+        unlink(path);                   // its edits are to the old file
+        failed = TRUE;
+        return;
+    }
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Write the pending records, and start writing them back to the disk.
+
+void EditJournal::flush()
+{
+    if (failed || pendLen == 0)
+        return;
+    if (fd < 0 && !create(path))
+        return;
+    const char* p = pend;
+    long n = pendLen;
+    while (n > 0)
+    {
+        ssize_t done = write(fd, p, (size_t)n);
+        if (done < 0 && errno == EINTR)
+            continue;
+        if (done <= 0)
+        {
+            failed = TRUE;
+            showMessage("can't write journal '%s': %s", path, strerror(errno));
+            break;
+        }
+        p += done;
+        n -= done;
+    }
+    written += pendLen - n;
+    pendLen = 0;
+#ifdef SYNC_FILE_RANGE_WRITE
+    sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WRITE);
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Remove the journal file: its edits are saved or given up.
+
+void EditJournal::remove()
+{
+    pendLen = 0;
+    if (fd >= 0)
+    {
+        close(fd);
+        fd = -1;
+        unlink(path);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Write the pending records of all journals. Called from a timer, and at
+// exit.
+
+void flushJournals()
+{
+    for (int i = 0; i < MAX_BUFFERS; i++)
+        if (buffer[i].journal)
+            buffer[i].journal->flush();
+}
+
+// ----------------------------------------------------------------------------
+// Remove the current buffer's journal, as its file was saved or closed.
+
+void dropJournal()
+{
+    if (buffer[b].journal)
+    {
+        buffer[b].journal->remove();
+        delete buffer[b].journal;
+        buffer[b].journal = 0;
+    }
+}
+// ----------------------------------------------------------------------------
+// Text being rebuilt from a journal, split into chunks so that an edit only
+// moves the text of one chunk. Edits near the last one find their chunk
+// from there.
+
+#define CHUNK_SIZE  32768       // text per chunk as it's split up
+#define CHUNK_CAP   (2*CHUNK_SIZE)  // room in a chunk before it's split
+
+typedef struct
+{
+    char*   text;
+    long    len, cap;
+} Chunk;
+
+typedef struct
+{
+    Chunk*  chunks;
+    long    n, max;
+    long    length;             // of all of the text
+    long    at, atStart;        // chunk last edited, and its offset
+} ChunkText;
+
+// ----------------------------------------------------------------------------
+// Free the chunks of t.
+
+static void freeChunks(ChunkText* t)
+{
+    for (long k = 0; k < t->n; k++)
+        free(t->chunks[k].text);
+    t->n = 0;
+    t->length = 0;
+    t->at = t->atStart = 0;
+}
+
+// ----------------------------------------------------------------------------
+// Open up count empty chunks in t before chunk k.
+
+static void addChunks(ChunkText* t, long k, long count)
+{
+    if (t->n + count > t->max)
+    {
+        long newMax = t->max*2 + count + 16;
+        Chunk* chunks = (Chunk*)realloc(t->chunks, newMax * sizeof(Chunk));
+        if (!chunks)
+            throw new Error("out of memory");
+        t->chunks = chunks;
+        t->max = newMax;
+    }
+    memmove(&t->chunks[k + count], &t->chunks[k],
+            (t->n - k) * sizeof(Chunk));
+    for (long i = k; i < k + count; i++)
+    {
+        t->chunks[i].text = 0;
+        t->chunks[i].len = t->chunks[i].cap = 0;
+    }
+    t->n += count;
+}
+
+// ----------------------------------------------------------------------------
+// Put the len characters at text into new chunks of t before chunk k,
+// leaving t->length to the caller.
+
+static void fillChunks(ChunkText* t, long k, const char* text, long len)
+{
+    long count = (len + CHUNK_SIZE - 1) / CHUNK_SIZE;
+    addChunks(t, k, count);
+    for (long i = k; i < k + count; i++)
+    {
+        Chunk* c = &t->chunks[i];
+        c->len = len < CHUNK_SIZE ? len : CHUNK_SIZE;
+        c->cap = CHUNK_CAP;
+        c->text = (char*)malloc(CHUNK_CAP);
+        if (!c->text)
+            throw new Error("out of memory");
+        memcpy(c->text, text, (size_t)c->len);
+        text += c->len;
+        len -= c->len;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Replace all of t with the len characters at text.
+
+static void loadChunks(ChunkText* t, const char* text, long len)
+{
+    freeChunks(t);
+    fillChunks(t, 0, text, len);
+    t->length = len;
+}
+
+// ----------------------------------------------------------------------------
+// Return the text of t in one malloc'd block, with its length in *len.
+
+static char* flattenChunks(const ChunkText* t, long* len)
+{
+    char* text = (char*)malloc((size_t)t->length + 1);
+    if (!text)
+        throw new Error("out of memory");
+    long at = 0;
+    for (long k = 0; k < t->n; k++)
+    {
+        memcpy(text + at, t->chunks[k].text, (size_t)t->chunks[k].len);
+        at += t->chunks[k].len;
+    }
+    *len = at;
+    return text;
+}
+
+// ----------------------------------------------------------------------------
+// Return the chunk of t holding offset offs (or ending at it, if it's the
+// end of the text), walking from the chunk last edited. Its offset is left
+// in t->atStart.
+
+static long findChunk(ChunkText* t, long offs)
+{
+    long k = t->at;
+    long start = t->atStart;
+    while (k > 0 && offs < start)
+        start -= t->chunks[--k].len;
+    while (k < t->n - 1 && offs >= start + t->chunks[k].len)
+        start += t->chunks[k++].len;
+    t->at = k;
+    t->atStart = start;
+    return k;
+}
+
+// ----------------------------------------------------------------------------
+// Replace the remLen characters of t at offs with the insLen at ins.
+
+static void editChunks(ChunkText* t, long offs, long remLen,
+                       const char* ins, long insLen)
+{
+    if (t->n == 0)
+        addChunks(t, 0, 1);
+    long k = findChunk(t, offs);
+    long into = offs - t->atStart;
+    t->length += insLen - remLen;
+
+    // delete from this chunk and those after it
+    for (long i = k; remLen > 0 && i < t->n; i++, into = 0)
+    {
+        Chunk* c = &t->chunks[i];
+        long n = c->len - into < remLen ? c->len - into : remLen;
+        memmove(c->text + into, c->text + into + n,
+                (size_t)(c->len - into - n));
+        c->len -= n;
+        remLen -= n;
+    }
+    if (insLen == 0)
+        return;
+
+    // insert into this chunk, splitting it if it's too full
+    into = offs - t->atStart;
+    Chunk* c = &t->chunks[k];
+    if (c->len + insLen > c->cap)
+    {
+        if (into < c->len)              // move the tail to a chunk of its own
+        {
+            addChunks(t, k + 1, 1);
+            c = &t->chunks[k];
+            Chunk* tail = &t->chunks[k + 1];
+            tail->cap = c->len - into > CHUNK_CAP ? c->len - into : CHUNK_CAP;
+            tail->text = (char*)malloc((size_t)tail->cap);
+            if (!tail->text)
+                throw new Error("out of memory");
+            tail->len = c->len - into;
+            memcpy(tail->text, c->text + into, (size_t)tail->len);
+            c->len = into;
+        }
+        if (c->len + insLen > c->cap)   // still no room: new chunks for it
+        {
+            fillChunks(t, k + 1, ins, insLen);
+            return;
+        }
+    }
+    memmove(c->text + into + insLen, c->text + into,
+            (size_t)(c->len - into));
+    memcpy(c->text + into, ins, (size_t)insLen);
+    c->len += insLen;
+}
+
+// ----------------------------------------------------------------------------
+// Read a number from the journal at *p, before end. Returns FALSE if it
+// runs off the end.
+
+static bool getNum(const unsigned char** p, const unsigned char* end,
+                   long* n)
+{
+    unsigned long v = 0;
+    for (int shift = 0; *p < end && shift < 64; shift += 7)
+    {
+        unsigned char c = *(*p)++;
+        v |= (unsigned long)(c & 0x7f) << shift;
+        if (!(c & 0x80))
+        {
+            *n = (long)v;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+// ----------------------------------------------------------------------------
+// Apply the record at *p, before end, to t, and step past it. Returns FALSE
+// if the record is cut short or doesn't fit the text, as when the editor
+// died while writing it.
+
+static bool replayRecord(ChunkText* t, const unsigned char** p,
+                         const unsigned char* end)
+{
+    const unsigned char* q = *p;
+    char op = *q++;
+    long len = t->length;
+    if (op == 'E')
+    {
+        long offs, remLen, insLen;
+        if (!getNum(&q, end, &offs) || !getNum(&q, end, &remLen) ||
+            !getNum(&q, end, &insLen) || offs < 0 || remLen < 0 ||
+            offs + remLen > len || insLen < 0 || insLen > end - q)
+            return FALSE;
+        editChunks(t, offs, remLen, (const char*)q, insLen);
+        *p = q + insLen;
+        return TRUE;
+    }
+    if (op == 'C')
+    {
+        long textLen;
+        if (!getNum(&q, end, &textLen) || textLen < 0 || textLen > end - q)
+            return FALSE;
+        loadChunks(t, (const char*)q, textLen);
+        *p = q + textLen;
+        return TRUE;
+    }
+    if (op != 'R' && op != 'S')
+        return FALSE;
+
+    // a multi-span record is rebuilt in one pass, as it was made
+    long count, spanLen = 0, replLen = 0;
+    const unsigned char* repl = 0;
+    if (!getNum(&q, end, &count) || count <= 0)
+        return FALSE;
+    if (op == 'R')
+    {
+        if (!getNum(&q, end, &spanLen) || !getNum(&q, end, &replLen) ||
+            spanLen < 0 || replLen < 0 || replLen > end - q)
+            return FALSE;
+        repl = q;
+        q += replLen;
+    }
+    char* old = flattenChunks(t, &len);
+    char* out = 0;
+    long outLen = 0, outMax = 0;
+    long at = 0;                        // in the old text
+    for (long k = 0; k <= count; k++)
+    {
+        long gapLen = len - at, textLen = 0;
+        const unsigned char* text = repl;
+        if (k < count)
+        {
+            textLen = replLen;
+            if (!getNum(&q, end, &gapLen) || gapLen < 0 ||
+                (op == 'S' && (!getNum(&q, end, &spanLen) ||
+                               !getNum(&q, end, &textLen) || spanLen < 0 ||
+                               textLen < 0 || textLen > end - q)) ||
+                at + gapLen + spanLen > len)
+            {
+                free(old);
+                free(out);
+                return FALSE;
+            }
+            if (op == 'S')
+            {
+                text = q;
+                q += textLen;
+            }
+        }
+        if (outLen + gapLen + textLen > outMax)
+        {
+            outMax = outMax + outMax/2 + gapLen + textLen + 4096;
+            char* newOut = (char*)realloc(out, (size_t)outMax);
+            if (!newOut)
+            {
+                free(old);
+                free(out);
+                throw new Error("out of memory");
+            }
+            out = newOut;
+        }
+        memcpy(out + outLen, old + at, (size_t)gapLen);
+        memcpy(out + outLen + gapLen, text, (size_t)textLen);
+        outLen += gapLen + textLen;
+        at += gapLen + spanLen;
+    }
+    free(old);
+    loadChunks(t, out, outLen);
+    free(out);
+    *p = q;
+    return TRUE;
+}
+
+// ----------------------------------------------------------------------------
+// Replay the journal of file fileName, if it has one, onto the current
+// buffer, which has just been opened on the file. A journal made for some
+// other version of the file is left alone, to be replaced at the first
+// edit. Returns TRUE if edits were recovered.
+
+bool recoverJournal(const char* fileName)
+{
+    if (!journalEdits)
+        return FALSE;
+    char path[MAX_LINE];
+    journalPath(path, fileName);
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return FALSE;
+    struct stat st;
+    unsigned char* data = 0;
+    if (fstat(fd, &st) != 0 || st.st_size < 6 ||
+        !(data = (unsigned char*)malloc((size_t)st.st_size)) ||
+        read(fd, data, (size_t)st.st_size) != st.st_size)
+    {
+        free(data);
+        close(fd);
+        return FALSE;
+    }
+
+    const unsigned char* p = data;
+    const unsigned char* end = data + st.st_size;
+    long size, time;
+    if (memcmp(p, magic, 4) != 0 || (p += 4, !getNum(&p, end, &size)) ||
+        !getNum(&p, end, &time) || size != buffer[b].baseSize ||
+        time != buffer[b].baseTime)
+    {
+        free(data);
+        close(fd);
+        return FALSE;
+    }
+    settleFile();                       // the text the edits were made to
+    if (size != buffer[b].baseSize || time != buffer[b].baseTime)
+    {                                   // ... unless it was read again
+        free(data);
+        close(fd);
+        return FALSE;
+    }
+
+    ChunkText t = { 0, 0, 0, 0, 0, 0 };
+    long records = 0;
+    long good = 0;                      // drops a record cut short
+    char* text = 0;
+    long len = 0;
+    try
+    {
+        loadChunks(&t, bstart, beot - bstart);
+        while (p < end && replayRecord(&t, &p, end))
+            records++;
+        good = p - data;
+        if (records)
+            text = flattenChunks(&t, &len);
+    } catch (Error* error)
+    {
+        freeChunks(&t);
+        free(t.chunks);
+        free(data);
+        close(fd);
+        throw error;
+    }
+    freeChunks(&t);
+    free(t.chunks);
+    free(data);
+    if (records == 0)
+    {
+        close(fd);
+        return FALSE;
+    }
+
+    char* cursPos = bcursPos;
+    del(bstart, beot - bstart);
+    insert(bstart, text, len);
+    free(text);
+    bcursPos = cursPos < beot ? cursPos : beot;
+    if (ftruncate(fd, good) != 0 || lseek(fd, good, SEEK_SET) != good)
+    {
+        close(fd);
+        fd = -1;
+    }
+    buffer[b].journal = new EditJournal(path, buffer[b].baseSize,
+                                        buffer[b].baseTime);
+    if (fd >= 0)
+        buffer[b].journal->resume(fd, good);
+    buffer[b].changed = TRUE;
+    showMessage("recovered %ld edits to %s from %s", records, fileName, path);
+    return TRUE;
+}
@@ -0,0 +1,536 @@
+// ****************************************************************************
+// eclines.cc  Macro Screen Editor line index
+//
+// Copyright (C) 2023 Scott Forbes
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// ****************************************************************************
+//
+// A buffer's line index is the list of its line lengths (each including
+// its '\n'), cut into chunks of a few hundred lines. Two Fenwick trees over
+// the chunks hold the running byte and line totals, so finding the line
+// at an offset, or the offset of a line, is a tree descent plus a short
+// scan within one chunk. Edits adjust one line length, or insert or merge
+// a few entries in a chunk, as insert() and del() report them.
+//
+// Only the first part of the text is scanned when the index is built. The
+// rest is held as one pending entry at the end, and scanned as lookups
+// reach into it, so a huge file can be shown before all of it is read.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ec.h"
+
+#define SCAN_MIN    (1024*1024) // least text to scan into lines at a time
+
+// ----------------------------------------------------------------------------
+// Construct an empty, not yet built, index.
+
+LineIndex::LineIndex()
+{
+    chunk = 0;
+    nChunks = 0;
+    maxChunks = 0;
+    fwBytes = 0;
+    fwLines = 0;
+    totalBytes = 0;
+    totalLines = 0;
+    partial = FALSE;
+    valid = FALSE;
+}
+
+// ----------------------------------------------------------------------------
+// Destroy index.
+
+LineIndex::~LineIndex()
+{
+    clear();
+    free(chunk);
+    free(fwBytes);
+    free(fwLines);
+}
+
+// ----------------------------------------------------------------------------
+// Free all chunks, leaving the index empty and invalid.
+
+void LineIndex::clear()
+{
+    for (int c = 0; c < nChunks; c++)
+        free(chunk[c]);
+    nChunks = 0;
+    totalBytes = 0;
+    totalLines = 0;
+    partial = FALSE;
+    valid = FALSE;
+}
+
+// ----------------------------------------------------------------------------
+// Make room for n chunk pointers and their Fenwick tree entries.
+
+void LineIndex::reserve(int n)
+{
+    if (n <= maxChunks)
+        return;
+    int newMax = maxChunks + maxChunks/2;
+    if (newMax < n)
+        newMax = n + 16;
+    LineChunk** newChunk = (LineChunk**)realloc(chunk,
+                                        newMax * sizeof(LineChunk*));
+    if (newChunk)
+        chunk = newChunk;
+    long* newBytes = (long*)realloc(fwBytes, (newMax+1) * sizeof(long));
+    if (newBytes)
+        fwBytes = newBytes;
+    long* newLines = (long*)realloc(fwLines, (newMax+1) * sizeof(long));
+    if (newLines)
+        fwLines = newLines;
+    if (!(newChunk && newBytes && newLines))
+        throw new Error("out of memory");
+    maxChunks = newMax;
+}
+
+// ----------------------------------------------------------------------------
+// Allocate a new chunk holding the n line lengths at len.
+
+LineChunk* LineIndex::newChunk(const long* len, int n)
+{
+    LineChunk* ch = (LineChunk*)malloc(sizeof(LineChunk));
+    if (!ch)
+        throw new Error("out of memory");
+    ch->n = n;
+    ch->bytes = 0;
+    for (int i = 0; i < n; i++)
+    {
+        ch->len[i] = len[i];
+        ch->bytes += len[i];
+    }
+    return ch;
+}
+
+// ----------------------------------------------------------------------------
+// Rebuild both Fenwick trees from the chunks, in linear time.
+
+void LineIndex::rebuildTree()
+{
+    for (int i = 1; i <= nChunks; i++)
+    {
+        fwBytes[i] = chunk[i-1]->bytes;
+        fwLines[i] = chunk[i-1]->n;
+    }
+    for (int i = 1; i <= nChunks; i++)
+    {
+        int j = i + (i & -i);
+        if (j <= nChunks)
+        {
+            fwBytes[j] += fwBytes[i];
+            fwLines[j] += fwLines[i];
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Add to chunk c's byte and line counts in the trees.
+
+void LineIndex::treeAdd(int c, long nBytes, long nLines)
+{
+    for (int i = c + 1; i <= nChunks; i += i & -i)
+    {
+        fwBytes[i] += nBytes;
+        fwLines[i] += nLines;
+    }
+    totalBytes += nBytes;
+    totalLines += nLines;
+}
+
+// ----------------------------------------------------------------------------
+// Find the chunk holding byte offset offs (or, if byLine, holding line
+// number offs). Returns the chunk number, with the bytes and lines in the
+// chunks before it. Offsets past the end give the last chunk.
+
+int LineIndex::findChunk(long offs, bool byLine, long* bytesBefore,
+                         long* linesBefore)
+{
+    int pos = 0;
+    long nBytes = 0;
+    long nLines = 0;
+    int step = 1;
+    while (step*2 <= nChunks)
+        step *= 2;
+    for ( ; step > 0; step /= 2)
+    {
+        int next = pos + step;
+        if (next > nChunks)
+            continue;
+        if ((byLine ? nLines + fwLines[next] : nBytes + fwBytes[next]) <= offs)
+        {
+            pos = next;
+            nBytes += fwBytes[next];
+            nLines += fwLines[next];
+        }
+    }
+    if (pos >= nChunks)             // past the end: last chunk
+    {
+        pos = nChunks - 1;
+        nBytes = totalBytes - chunk[pos]->bytes;
+        nLines = totalLines - chunk[pos]->n;
+    }
+    *bytesBefore = nBytes;
+    *linesBefore = nLines;
+    return pos;
+}
+
+// ----------------------------------------------------------------------------
+// Find the line holding byte offset offs: its chunk c, index i within the
+// chunk, line number, and start offset.
+
+void LineIndex::locate(long offs, int* c, int* i, long* line, long* start)
+{
+    long nBytes, nLines;
+    *c = findChunk(offs, FALSE, &nBytes, &nLines);
+    LineChunk* ch = chunk[*c];
+    int j;
+    for (j = 0; j < ch->n - 1 && nBytes + ch->len[j] <= offs; j++)
+        nBytes += ch->len[j];
+    *i = j;
+    *line = nLines + j;
+    *start = nBytes;
+}
+
+// ----------------------------------------------------------------------------
+// Return the offset where the pending entry starts, or the end of the text
+// if it has all been scanned.
+
+long LineIndex::pendingStart()
+{
+    if (!partial)
+        return totalBytes;
+    LineChunk* last = chunk[nChunks-1];
+    return totalBytes - last->len[last->n - 1];
+}
+
+// ----------------------------------------------------------------------------
+// Add a line of len characters to the end, without updating the trees.
+
+void LineIndex::addLine(long len)
+{
+    if (nChunks == 0 || chunk[nChunks-1]->n >= CHUNK_FILL)
+    {
+        reserve(nChunks + 1);
+        chunk[nChunks++] = newChunk(0, 0);
+    }
+    LineChunk* ch = chunk[nChunks-1];
+    ch->len[ch->n++] = len;
+    ch->bytes += len;
+    totalBytes += len;
+    totalLines++;
+}
+
+// ----------------------------------------------------------------------------
+// Scan text p..end, which follows the indexed lines, into lines: at least
+// SCAN_MIN bytes, and on until offset upTo and line upToLine are indexed.
+// Any text left over becomes the pending entry. A gap in the text comes
+// after a line, and is stepped over.
+
+void LineIndex::scanLines(const char* p, const char* end, long upTo,
+                          long upToLine)
+{
+    const char* minEnd = p + SCAN_MIN;
+    partial = FALSE;
+    for (;;)
+    {
+        if (p >= minEnd && totalBytes > upTo && totalLines > upToLine)
+        {
+            addLine(textSpan(p, end));
+            partial = TRUE;
+            break;
+        }
+        const char* nl = findNthNewline(p, end, 1);
+        const char* next = nl ? nl + 1 : end;
+        addLine(next - p);
+        p = nl ? lineAfter(nl) : end;
+        if (!nl)
+            break;
+    }
+    rebuildTree();
+}
+
+// ----------------------------------------------------------------------------
+// Scan more of the pending entry of text, until offset upTo and line
+// upToLine are indexed.
+
+void LineIndex::extend(const char* text, long upTo, long upToLine)
+{
+    if (!partial || (pendingStart() > upTo && totalLines - 1 > upToLine))
+        return;
+    long start = pendingStart();
+    long end = totalBytes;
+    LineChunk* last = chunk[nChunks-1];
+    last->bytes -= last->len[--last->n];
+    if (last->n == 0)
+    {
+        free(last);
+        nChunks--;
+    }
+    totalBytes = start;
+    totalLines--;
+    scanLines(textAt(text, start), textAt(text, end), upTo, upToLine);
+}
+
+// ----------------------------------------------------------------------------
+// Build the index from the text start..end, scanning just the first part.
+
+void LineIndex::build(const char* start, const char* end)
+{
+    clear();
+    scanLines(start, end, -1, -1);
+    valid = TRUE;
+}
+
+// ----------------------------------------------------------------------------
+// Return the line number (from 0) holding offset offs of text, and its
+// start.
+
+long LineIndex::lineOf(const char* text, long offs, long* lineStart)
+{
+    extend(text, offs, -1);
+    int c, i;
+    long line, start;
+    locate(offs, &c, &i, &line, &start);
+    if (lineStart)
+        *lineStart = start;
+    return line;
+}
+
+// ----------------------------------------------------------------------------
+// Return the start offset of line number line (from 0) of text, or the end
+// of the text if there is no such line.
+
+long LineIndex::startOf(const char* text, long line)
+{
+    if (line <= 0)
+        return 0;
+    extend(text, -1, line);
+    if (line >= totalLines)
+        return totalBytes;
+    long nBytes, nLines;
+    LineChunk* ch = chunk[findChunk(line, TRUE, &nBytes, &nLines)];
+    for (int j = 0; nLines + j < line; j++)
+        nBytes += ch->len[j];
+    return nBytes;
+}
+
+// ----------------------------------------------------------------------------
+// Return the line number of the pending entry if offset offs is in it, or
+// else -1. Offset offs is then on that line or one after it, as far as can
+// be told without scanning.
+
+long LineIndex::pendingLine(long offs)
+{
+    return partial && offs >= pendingStart() ? totalLines - 1 : -1;
+}
+
+// ----------------------------------------------------------------------------
+// Replace count line lengths at index i in chunk c with the m lengths at
+// len, splitting the chunk if they don't fit.
+
+void LineIndex::replaceLines(int c, int i, int count, const long* len, long m)
+{
+    LineChunk* ch = chunk[c];
+    long oldBytes = 0;
+    for (int j = i; j < i + count; j++)
+        oldBytes += ch->len[j];
+    long newBytes = 0;
+    for (long j = 0; j < m; j++)
+        newBytes += len[j];
+
+    if (ch->n - count + m <= CHUNK_MAX)
+    {
+        memmove(&ch->len[i + m], &ch->len[i + count],
+                (ch->n - i - count) * sizeof(long));
+        memcpy(&ch->len[i], len, m * sizeof(long));
+        ch->n += m - count;
+        ch->bytes += newBytes - oldBytes;
+        treeAdd(c, newBytes - oldBytes, m - count);
+        return;
+    }
+
+    // re-cut this chunk's lines, with the replacement, into new chunks
+    long n = ch->n - count + m;
+    long* all = (long*)malloc(n * sizeof(long));
+    if (!all)
+        throw new Error("out of memory");
+    memcpy(all, ch->len, i * sizeof(long));
+    memcpy(all + i, len, m * sizeof(long));
+    memcpy(all + i + m, &ch->len[i + count],
+           (ch->n - i - count) * sizeof(long));
+    int pieces = (int)((n + CHUNK_FILL - 1) / CHUNK_FILL);
+    reserve(nChunks + pieces - 1);
+    memmove(&chunk[c + pieces], &chunk[c + 1],
+            (nChunks - c - 1) * sizeof(LineChunk*));
+    nChunks += pieces - 1;
+    free(ch);
+    for (int k = 0; k < pieces; k++)
+    {
+        long first = (long)k * CHUNK_FILL;
+        long size = n - first < CHUNK_FILL ? n - first : CHUNK_FILL;
+        chunk[c + k] = newChunk(all + first, (int)size);
+    }
+    free(all);
+    totalBytes += newBytes - oldBytes;
+    totalLines += m - count;
+    rebuildTree();
+}
+
+// ----------------------------------------------------------------------------
+// Put the lines from the one holding offset offs on back into the pending
+// entry, to be scanned again as lookups reach them. Edits past that point
+// then just change the pending entry's length.
+
+void LineIndex::truncate(long offs)
+{
+    if (!valid || offs >= pendingStart())
+        return;
+    int c, i;
+    long line, start;
+    locate(offs, &c, &i, &line, &start);
+    long rest = totalBytes - start;
+    for (int k = c + 1; k < nChunks; k++)
+        free(chunk[k]);
+    nChunks = c + 1;
+    LineChunk* ch = chunk[c];
+    for (int j = i; j < ch->n; j++)
+        ch->bytes -= ch->len[j];
+    ch->n = i;
+    if (ch->n == 0)
+    {
+        free(ch);
+        nChunks--;
+    }
+    totalBytes = start;
+    totalLines = line;
+    addLine(rest);
+    partial = TRUE;
+    rebuildTree();
+}
+
+// ----------------------------------------------------------------------------
+// Note that n characters of text were inserted at offset offs.
+
+void LineIndex::inserted(long offs, const char* text, long n)
+{
+    if (!valid)
+        return;
+    int c, i;
+    long line, start;
+    locate(offs, &c, &i, &line, &start);
+    // text going into the pending entry will be scanned with it
+    long nl = offs < pendingStart() ? countNewlines(text, text + n) : 0;
+    if (nl == 0)
+    {
+        chunk[c]->len[i] += n;
+        chunk[c]->bytes += n;
+        treeAdd(c, n, 0);
+        return;
+    }
+
+    // the line splits into nl+1 lines at the inserted newlines
+    long* len = (long*)malloc((nl + 1) * sizeof(long));
+    if (!len)
+        throw new Error("out of memory");
+    long k = offs - start;
+    long tail = chunk[c]->len[i] - k;
+    const char* p = text;
+    const char* end = text + n;
+    for (long j = 0; j < nl; j++)
+    {
+        const char* next = (const char*)memchr(p, '\n', end - p) + 1;
+        len[j] = next - p + k;
+        k = 0;
+        p = next;
+    }
+    len[nl] = end - p + tail;
+    replaceLines(c, i, 1, len, nl + 1);
+    free(len);
+}
+
+// ----------------------------------------------------------------------------
+// Note that the n characters of text at offset offs are about to be deleted.
+
+void LineIndex::deleted(long offs, const char* text, long n)
+{
+    if (!valid)
+        return;
+    if (offs + n > totalBytes)
+        n = totalBytes - offs;
+    if (n <= 0)
+        return;
+    int c, i;
+    long line, start;
+    locate(offs, &c, &i, &line, &start);
+    long pend = pendingStart() - offs;  // newlines past here aren't indexed
+    long nl = pend > 0 ? countNewlines(text, text + (n < pend ? n : pend)) : 0;
+    LineChunk* ch = chunk[c];
+    if (i + nl < ch->n)
+    {
+        // the merged lines all lie in this chunk
+        long merged = -n;
+        for (long j = i; j <= i + nl; j++)
+            merged += ch->len[j];
+        replaceLines(c, i, (int)nl + 1, &merged, 1);
+        return;
+    }
+
+    // merge lines across chunks, dropping any chunks left empty
+    long merged = -n;
+    for (int j = i; j < ch->n; j++)
+        merged += ch->len[j];
+    nl -= ch->n - 1 - i;
+    ch->n = i + 1;
+    int d = c + 1;
+    while (nl > 0 && d < nChunks)
+    {
+        LineChunk* dch = chunk[d];
+        int take = nl < dch->n ? (int)nl : dch->n;
+        for (int j = 0; j < take; j++)
+            merged += dch->len[j];
+        nl -= take;
+        memmove(&dch->len[0], &dch->len[take],
+                (dch->n - take) * sizeof(long));
+        dch->n -= take;
+        d++;
+    }
+    ch->len[i] = merged;
+
+    // recount the chunks touched, and drop empty ones
+    int to = c;
+    for (int k = c; k < nChunks; k++)
+    {
+        LineChunk* kch = chunk[k];
+        if (k < d)
+        {
+            kch->bytes = 0;
+            for (int j = 0; j < kch->n; j++)
+                kch->bytes += kch->len[j];
+        }
+        if (kch->n == 0)
+            free(kch);
+        else
+            chunk[to++] = kch;
+    }
+    nChunks = to;
+    totalBytes -= n;
+    totalLines = 0;
+    for (int k = 0; k < nChunks; k++)
+        totalLines += chunk[k]->n;
+    rebuildTree();
+}
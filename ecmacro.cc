@@ -0,0 +1,793 @@
+// ****************************************************************************
+// ecmacro.cc  Macro Screen Editor macro compiler and interpreter
+//
+// Copyright (C) 2023 Scott Forbes
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// ****************************************************************************
+//
+// A macro is compiled once into a list of int codes: repeat counts are
+// parsed, loops become a count push and a jump back, and the string
+// arguments of ^QF, ^QA, ^QI, ^QG and ^QT are parsed and kept, with the
+// find patterns built, so running a loop touches none of the macro text.
+// The code for each buffer is kept until that buffer's text changes.
+//
+// While a macro runs nothing is drawn, except every macroRefresh ms if it
+// is set, and a repeated delete command is done as one cut.
+//
+// Each command's code is tied to its source text by a site. With ^KP on,
+// a run counts each site's passes, time, text moved and text searched,
+// and the totals are written as a report into buffer profBuff. If a
+// macrotrace file is set, the commands run are also written to it in
+// order, loops unrolled, so that it can be read back in and run again.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "termp.h"
+#include "ec.h"
+
+enum                    // macro codes, followed by their arguments
+{
+    MOP_CMD,            // ch: a one-character command
+    MOP_KEYS,           // str, len: feed characters to doCommand()
+    MOP_QSTR,           // cmd, opts, nOpts, str1, len1, str2, len2, pat:
+                        //   a ^Q string command, pat -1 if none
+    MOP_DEL,            // ch, n: delete command ch done n times
+    MOP_LOOP,           // n: start a loop of n passes
+    MOP_NEXT,           // to: end of a loop pass, jump to 'to' if more
+    MOP_STOP
+};
+
+#define MAX_LOOP_DEPTH  10      // most nested loops
+#define LOOP_FOREVER    32000   // passes of a loop with no count
+#define KEY_CHECK_OPS   32      // codes run between checks for ESC
+
+struct MacroSite                        // a command in the source text
+{
+    int     at;                         // index of its code
+    int     from, to;                   // its text in src
+    int     depth;                      // loops it is inside
+    bool    traced;                     // TRUE if written to the trace
+    long    count;                      // times run
+    long    ns;                         // time taken, with what it ran
+    long    moved;                      // text shifted or copied
+    long    searched;                   // text scanned by finds
+};
+
+typedef struct                          // counters at the start of a site
+{
+    struct timespec t;
+    long    moved;
+    long    searched;
+} ProfMark;
+
+static MacroCode* bufMacro[MAX_BUFFERS]; // compiled code of each buffer
+static long     macroOps;               // codes run by the current macro
+static struct timespec lastRefresh;     // when the screen was last updated
+int     macroRefresh;                   // ms between updates in a macro
+
+bool    profileMacros;                  // TRUE to profile macro runs
+char    macroTrace[MAX_LINE];           // file to trace macro runs to
+static bool     profiling;              // TRUE if this run is profiled
+static FILE*    traceFile;              // open trace file, if any
+static ProfMark profStart;              // counters when the run began
+static int      loopNest, deepestNest;  // loops running, in all levels
+
+// ----------------------------------------------------------------------------
+// Compile the macro of len characters at text.
+
+MacroCode::MacroCode(const char* text, long len)
+{
+    srcLen = len;
+    src = (char*)malloc((size_t)len + 1);
+    code = 0;
+    codeLen = codeMax = 0;
+    strs = 0;
+    strsLen = strsMax = 0;
+    pats = 0;
+    nPats = maxPats = 0;
+    sites = 0;
+    nSites = maxSites = 0;
+    siteOf = 0;
+    busy = 0;
+    if (!src)
+        throw new Error("out of memory");
+    memcpy(src, text, (size_t)len);
+    try
+    {
+        compile(src, src + len);
+    } catch (...)
+    {
+        freeAll();
+        throw;
+    }
+}
+
+MacroCode::~MacroCode()
+{
+    freeAll();
+}
+
+// ----------------------------------------------------------------------------
+// Free all of the compiled code.
+
+void MacroCode::freeAll()
+{
+    for (int i = 0; i < nPats; i++)
+        delete pats[i];
+    free(pats);
+    free(siteOf);
+    free(sites);
+    free(strs);
+    free(code);
+    free(src);
+    siteOf = 0;
+    sites = 0;
+    pats = 0;
+    strs = 0;
+    code = 0;
+    src = 0;
+}
+
+// ----------------------------------------------------------------------------
+// Return TRUE if this is the code for the len characters at text.
+
+bool MacroCode::sameSource(const char* text, long len) const
+{
+    return len == srcLen && memcmp(text, src, (size_t)len) == 0;
+}
+
+// ----------------------------------------------------------------------------
+// Append one code word.
+
+void MacroCode::emit(int w)
+{
+    if (codeLen == codeMax)
+    {
+        int n = codeMax ? 2*codeMax : 64;
+        int* p = (int*)realloc(code, n * sizeof(int));
+        if (!p)
+            throw new Error("out of memory");
+        code = p;
+        codeMax = n;
+    }
+    code[codeLen++] = w;
+}
+
+// ----------------------------------------------------------------------------
+// Keep a copy of the n characters at s, NUL-terminated, and return its
+// offset in strs.
+
+int MacroCode::intern(const char* s, int n)
+{
+    if (strsLen + n + 1 > strsMax)
+    {
+        long size = 2*strsMax > strsLen + n + 1 ? 2*strsMax :
+                    strsLen + n + 1 + 256;
+        char* p = (char*)realloc(strs, (size_t)size);
+        if (!p)
+            throw new Error("out of memory");
+        strs = p;
+        strsMax = size;
+    }
+    int offs = strsLen;
+    memcpy(strs + offs, s, (size_t)n);
+    strs[offs + n] = 0;
+    strsLen += n + 1;
+    return offs;
+}
+
+// ----------------------------------------------------------------------------
+// Build and keep the find pattern for the n characters at s, and return
+// its index in pats.
+
+int MacroCode::addPattern(const char* s, int n)
+{
+    if (nPats == maxPats)
+    {
+        int m = maxPats ? 2*maxPats : 4;
+        SearchPattern** p = (SearchPattern**)realloc(pats,
+                                            m * sizeof(SearchPattern*));
+        if (!p)
+            throw new Error("out of memory");
+        pats = p;
+        maxPats = m;
+    }
+    pats[nPats] = new SearchPattern(s, n);
+    return nPats++;
+}
+
+// ----------------------------------------------------------------------------
+// Add a site for the source text from..to, whose code starts next, and
+// return its index in sites.
+
+int MacroCode::addSite(const char* from, const char* to, int depth)
+{
+    if (nSites == maxSites)
+    {
+        int m = maxSites ? 2*maxSites : 16;
+        MacroSite* p = (MacroSite*)realloc(sites, m * sizeof(MacroSite));
+        if (!p)
+            throw new Error("out of memory");
+        sites = p;
+        maxSites = m;
+    }
+    MacroSite* s = &sites[nSites];
+    memset(s, 0, sizeof(MacroSite));
+    s->at = codeLen;
+    s->from = from - src;
+    s->to = to - src;
+    s->depth = depth;
+    return nSites++;
+}
+
+// ----------------------------------------------------------------------------
+// Map each code to its site, and pick the sites that go in a trace: not
+// loops, and not ^Q<digit>, as the commands that runs are traced.
+
+void MacroCode::endSites()
+{
+    siteOf = (int*)malloc(codeLen * sizeof(int));
+    if (!siteOf)
+        throw new Error("out of memory");
+    for (int i = 0; i < codeLen; i++)
+        siteOf[i] = -1;
+    for (int i = 0; i < nSites; i++)
+    {
+        MacroSite* s = &sites[i];
+        siteOf[s->at] = i;
+        int op = code[s->at];
+        s->traced = (op == MOP_CMD || op == MOP_QSTR || op == MOP_DEL);
+        if (op == MOP_KEYS)
+        {
+            const char* k = strs + code[s->at + 1];
+            s->traced = !(code[s->at + 2] == 2 &&
+                          (k[0] & 0x1f) + 0x40 == 'Q' &&
+                          k[1] >= '0' && k[1] <= '9');
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Parse a string argument ended by delim, as doQcommand() would: a '^'
+// makes the next character a control character. Returns the position after
+// the delimiter, or 0 if the text ends first.
+
+static const char* parseString(const char* p, const char* end, char delim,
+                               char* s, int* len)
+{
+    int n = 0;
+    for ( ; p < end; p++)
+    {
+        char ch = *p;
+        if (ch == delim)
+        {
+            s[n] = 0;
+            *len = n;
+            return p + 1;
+        }
+        if (n > 0 && s[n-1] == '^')
+        {
+            if (ch != '^')
+                s[n-1] = ch & 0x1f;
+        }
+        else if (n < MAX_LINE-10)
+            s[n++] = ch;
+    }
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Compile the command starting at pc, and return the position after it.
+// ^Q string commands are parsed here; other multi-character commands are
+// passed through to doCommand() whole.
+
+const char* MacroCode::compileCommand(const char* pc, const char* end)
+{
+    int cmd = (*pc & 0x1f) + 0x40;
+    if (cmd != 'B' && cmd != 'K' && cmd != 'Q')
+    {
+        emit(MOP_CMD);
+        emit(*pc);
+        return pc + 1;
+    }
+
+    const char* p = pc + 1;
+    if (p < end)
+    {
+        int cmd2 = (*p & 0x1f) + 0x40;
+        bool digit = (*p >= '0' && *p <= '9');
+        p++;
+        if (cmd == 'K' && (cmd2 == 'O' || cmd2 == 'R' || cmd2 == 'W'))
+        {
+            if (p < end)                // file name between delimiters
+            {
+                const char* name = p + 1;
+                while (name < end && *name != *p)
+                    name++;
+                p = name < end ? name + 1 : end;
+            }
+        }
+        else if (cmd == 'Q' && !digit && strchr("AFIGT", cmd2))
+        {
+            const char* opts = p;
+            while (p < end && isalpha(*p))
+                p++;
+            int nOpts = p - opts;
+            char str1[MAX_LINE], str2[MAX_LINE];
+            int len1 = 0, len2 = 0;
+            const char* q = 0;
+            if (p < end)
+            {
+                char delim = *p;
+                q = parseString(p + 1, end, delim, str1, &len1);
+                if (q && cmd2 == 'A')
+                    q = parseString(q, end, delim, str2, &len2);
+            }
+            if (q)
+            {
+                int pat = -1;
+                if (cmd2 == 'F' || cmd2 == 'A')
+                    pat = addPattern(str1, len1);
+                emit(MOP_QSTR);
+                emit(cmd2);
+                emit(intern(opts, nOpts));
+                emit(nOpts);
+                emit(intern(str1, len1));
+                emit(len1);
+                emit(intern(str2, len2));
+                emit(len2);
+                emit(pat);
+                return q;
+            }
+            p = end;                    // unfinished: left for the keyboard
+        }
+    }
+    emit(MOP_KEYS);
+    emit(intern(pc, p - pc));
+    emit(p - pc);
+    return p;
+}
+
+// ----------------------------------------------------------------------------
+// Compile macro text from pc to end. "<n>[" starts a loop of n passes
+// (forever if no n) that ends at the matching ']' or the end of the text,
+// and "<n><command>" repeats one command. A ']' outside any loop ends the
+// macro.
+
+void MacroCode::compile(const char* pc, const char* end)
+{
+    int loopStart[MAX_LOOP_DEPTH];
+    int depth = 0;
+    while (pc < end)
+    {
+        const char* from = pc;
+        if (*pc == ']')
+        {
+            pc++;
+            if (depth == 0)
+                break;
+            addSite(from, pc, depth - 1);
+            emit(MOP_NEXT);
+            emit(loopStart[--depth]);
+            continue;
+        }
+        int num = 0;
+        while (pc < end && *pc >= '0' && *pc <= '9')
+        {
+            num *= 10;
+            num += (*pc++) - '0';
+        }
+        if (pc >= end)
+            break;
+        if (*pc == '[')
+        {
+            pc++;
+            if (depth == MAX_LOOP_DEPTH)
+                throw new Error("macro loops more than %d deep",
+                                MAX_LOOP_DEPTH);
+            addSite(from, pc, depth);
+            emit(MOP_LOOP);
+            emit(num ? num : LOOP_FOREVER);
+            loopStart[depth++] = codeLen;
+        }
+        else if (num > 0 && strchr("GHT_", (*pc & 0x1f) + 0x40))
+        {
+            addSite(from, pc + 1, depth);
+            emit(MOP_DEL);
+            emit(*pc++);
+            emit(num);
+        }
+        else if (num > 0)
+        {
+            emit(MOP_LOOP);
+            emit(num);
+            int start = codeLen;
+            int site = addSite(from, pc, depth);
+            pc = compileCommand(pc, end);
+            sites[site].to = pc - src;
+            emit(MOP_NEXT);
+            emit(start);
+        }
+        else
+        {
+            int site = addSite(from, pc, depth);
+            pc = compileCommand(pc, end);
+            sites[site].to = pc - src;
+        }
+    }
+    while (depth > 0)
+    {
+        emit(MOP_NEXT);
+        emit(loopStart[--depth]);
+    }
+    emit(MOP_STOP);
+    endSites();
+}
+
+// ----------------------------------------------------------------------------
+// Do delete command ch (^G, ^H or ^T) n times, as one cut where the
+// result is the same.
+
+static void deleteRun(int ch, int n)
+{
+    int cmd = (ch & 0x1f) + 0x40;
+    if (cmd == 'T')                     // words
+    {
+        char* p = bcursPos;
+        fwdWord(&p, n);
+        p = bufGapPast(p);
+        del(bcursPos, p - bcursPos);
+    }
+    else if (!insertMode)               // these blank out characters
+        for (int i = 0; i < n; i++)
+            doCommand(ch);
+    else if (cmd == 'G')                // forward
+    {
+        long after = textSpan(bcursPos, beot);
+        del(bcursPos, after < n ? after : n);
+    }
+    else                                // back, then forward at the start
+    {
+        long before = textSpan(bstart, bcursPos);
+        long after = textSpan(bcursPos, beot);
+        long back = before < n ? before : n;
+        long fwd = after < n - back ? after : n - back;
+        backChar(&bcursPos, (int)back);
+        del(bcursPos, back + fwd);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Show how far the macro has got, if it is time to.
+
+static void showProgress()
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    if ((t.tv_sec - lastRefresh.tv_sec) * 1000 +
+        (t.tv_nsec - lastRefresh.tv_nsec) / 1000000 < macroRefresh)
+        return;
+    lastRefresh = t;
+    showMessage("macro: %ld steps  (ESC stops)", macroOps);
+    updateWindows();
+    outFrame();
+}
+
+// ----------------------------------------------------------------------------
+// Read the profile counters.
+
+static void markNow(ProfMark* m)
+{
+    clock_gettime(CLOCK_MONOTONIC, &m->t);
+    m->moved = storeStats.bytesShifted + storeStats.bytesCopied;
+    m->searched = bytesSearched;
+}
+
+// ----------------------------------------------------------------------------
+// Add what was done since mark to site s.
+
+static void account(MacroSite* s, const ProfMark* mark)
+{
+    ProfMark now;
+    markNow(&now);
+    s->ns += (now.t.tv_sec - mark->t.tv_sec) * 1000000000L +
+             (now.t.tv_nsec - mark->t.tv_nsec);
+    s->moved += now.moved - mark->moved;
+    s->searched += now.searched - mark->searched;
+}
+
+// ----------------------------------------------------------------------------
+// Clear the counts of every site.
+
+void MacroCode::clearProfile()
+{
+    for (int i = 0; i < nSites; i++)
+    {
+        sites[i].count = 0;
+        sites[i].ns = 0;
+        sites[i].moved = 0;
+        sites[i].searched = 0;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Start profiling a top-level macro run, and open the trace file if set.
+
+static void startProfile()
+{
+    profiling = TRUE;
+    loopNest = deepestNest = 0;
+    for (int i = 0; i < MAX_BUFFERS; i++)
+        if (bufMacro[i])
+            bufMacro[i]->clearProfile();
+    traceFile = 0;
+    if (macroTrace[0])
+    {
+        traceFile = fopen(macroTrace, "w");
+        if (!traceFile)
+            showMessage("can't write trace %s", macroTrace);
+    }
+    markNow(&profStart);
+}
+
+// ----------------------------------------------------------------------------
+// Write the source of site s to the trace. A repeated command is traced
+// each time it runs, so its count is left off.
+
+static void traceSite(const char* src, const MacroSite* s, int op)
+{
+    const char* p = src + s->from;
+    const char* end = src + s->to;
+    if (op != MOP_DEL)
+        while (p < end && *p >= '0' && *p <= '9')
+            p++;
+    if (end - p == 1 && *p == ' ')
+        return;
+    fwrite(p, 1, end - p, traceFile);
+    fputc(' ', traceFile);
+}
+
+// ----------------------------------------------------------------------------
+// Append the profile of this code, run from buffer exb, to buffer b.
+
+void MacroCode::writeProfile(int exb)
+{
+    char s[MAX_LINE];
+    int n = snprintf(s, MAX_LINE, "\nbuffer %d\n   count        ms     moved  "
+                     "searched  command\n", exb);
+    insert(beot, s, n);
+    for (int i = 0; i < nSites; i++)
+    {
+        const MacroSite* site = &sites[i];
+        if (site->count == 0 || (site->to - site->from == 1 &&
+                                 src[site->from] == ' '))
+            continue;
+        n = snprintf(s, MAX_LINE, "%8ld %9.3f %9ld %9ld  %*s", site->count,
+                     site->ns / 1e6, site->moved, site->searched,
+                     2*site->depth, "");
+        for (int j = site->from; j < site->to && n < MAX_LINE-3; j++)
+        {
+            unsigned char ch = src[j];
+            if (ch < ' ')
+            {
+                s[n++] = '^';
+                ch += 0x40;
+            }
+            s[n++] = ch;
+        }
+        s[n++] = '\n';
+        insert(beot, s, n);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// End a profiled run: close the trace and write the report into buffer
+// profBuff.
+
+static void endProfile()
+{
+    profiling = FALSE;
+    if (traceFile)
+        fclose(traceFile);
+    traceFile = 0;
+
+    ProfMark now;
+    markNow(&now);
+    double secs = (now.t.tv_sec - profStart.t.tv_sec) +
+                  (now.t.tv_nsec - profStart.t.tv_nsec) / 1e9;
+    int prevBuff = b;
+    selectBuffer(profBuff);
+    clearBuffer();
+    char s[MAX_LINE];
+    int n = snprintf(s, MAX_LINE, "macro profile: %.3f s, %ld steps, "
+                     "loops nested %d deep, %ld moved, %ld searched\n", secs,
+                     macroOps, deepestNest, now.moved - profStart.moved,
+                     now.searched - profStart.searched);
+    insert(beot, s, n);
+    for (int i = 0; i < MAX_BUFFERS; i++)
+        if (bufMacro[i])
+            bufMacro[i]->writeProfile(i);
+    bcursPos = bstart;
+    buffer[b].changed = FALSE;
+    selectBuffer(prevBuff);
+    showMessage("macro took %.3f s: profile in ^KM", secs);
+}
+
+// ----------------------------------------------------------------------------
+// Run the compiled macro, until it ends, a command throws an error, or
+// the ESC key is pressed.
+
+void MacroCode::run()
+{
+    if (macroLevel++ > 9)
+        throw new Error("macro recursion more than 9 deep");
+
+    int count[MAX_LOOP_DEPTH + 1];      // passes left in each loop
+    int depth = 0;
+    int sinceCheck = KEY_CHECK_OPS;
+    const int* pc = code;
+    MacroSite* site = 0;                // site being profiled
+    ProfMark mark;                      // counters when it started
+    bool top = (macroLevel == 1);
+    if (top)
+    {
+        macroOps = 0;
+        clock_gettime(CLOCK_MONOTONIC, &lastRefresh);
+        profiling = FALSE;
+        if (profileMacros)
+            startProfile();
+    }
+    busy++;
+    try
+    {
+        for (;;)
+        {
+            if (site)
+            {
+                account(site, &mark);
+                site = 0;
+            }
+            if (++sinceCheck >= KEY_CHECK_OPS)
+            {
+                sinceCheck = 0;
+                if (escapeTyped())
+                    throw new Cancel;
+                if (macroRefresh)
+                    showProgress();
+            }
+            macroOps++;
+            if (profiling && siteOf[pc - code] >= 0)
+            {
+                site = &sites[siteOf[pc - code]];
+                site->count++;
+                if (traceFile && site->traced)
+                    traceSite(src, site, *pc);
+                markNow(&mark);
+            }
+            switch (*pc++)
+            {
+                case MOP_CMD:
+                    doCommand(*pc++);
+                    break;
+
+                case MOP_KEYS:
+                {
+                    const char* s = strs + pc[0];
+                    int n = pc[1];
+                    pc += 2;
+                    for (int i = 0; i < n; i++)
+                        doCommand(s[i]);
+                    break;
+                }
+                case MOP_QSTR:
+                {
+                    const char* opts = strs + pc[1];
+                    for (int i = 0; i < pc[2]; i++)
+                        findOption(opts[i]);
+                    doQstring(pc[0], strs + pc[3], pc[4], strs + pc[5], pc[6],
+                              pc[7] >= 0 ? pats[pc[7]] : 0);
+                    pc += 8;
+                    break;
+                }
+                case MOP_DEL:
+                    deleteRun(pc[0], pc[1]);
+                    pc += 2;
+                    break;
+
+                case MOP_LOOP:
+                    count[depth++] = *pc++;
+                    if (++loopNest > deepestNest)
+                        deepestNest = loopNest;
+                    break;
+
+                case MOP_NEXT:
+                    if (--count[depth-1] > 0)
+                        pc = code + *pc;
+                    else
+                    {
+                        depth--;
+                        loopNest--;
+                        pc++;
+                    }
+                    break;
+
+                case MOP_STOP:
+                    busy--;
+                    if (top && profiling)
+                        endProfile();
+                    macroLevel--;
+                    return;
+            }
+        }
+    } catch (...)
+    {
+        busy--;
+        if (site)
+            account(site, &mark);
+        loopNest -= depth;
+        if (top && profiling)
+        {
+            try
+            {
+                endProfile();
+            } catch (Error* error)      // the first error is the one to show
+            {
+                delete error;
+            }
+        }
+        throw;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Run the text of buffer exb as a macro, compiling it first if it has
+// changed since it was last run.
+
+void runMacro(int exb)
+{
+    BuffRec* p = &buffer[exb];
+    long len = p->eot - p->start;
+    MacroCode* m = bufMacro[exb];
+    if (m && m->sameSource(p->start, len))
+    {
+        m->run();
+        return;
+    }
+    if (m && m->busy)                   // running further up: can't replace
+    {
+        MacroCode tmp(p->start, len);
+        tmp.run();
+        return;
+    }
+    compileMacro(exb);
+    bufMacro[exb]->run();
+}
+
+// ----------------------------------------------------------------------------
+// Compile the text of buffer exb as a macro, unless its code is current or
+// is running.
+
+void compileMacro(int exb)
+{
+    BuffRec* p = &buffer[exb];
+    long len = p->eot - p->start;
+    MacroCode* m = bufMacro[exb];
+    if (m && (m->busy || m->sameSource(p->start, len)))
+        return;
+    delete m;
+    bufMacro[exb] = 0;
+    bufMacro[exb] = new MacroCode(p->start, len);
+}
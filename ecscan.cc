@@ -0,0 +1,480 @@
+// ****************************************************************************
+// ecscan.cc  Macro Screen Editor newline scanning kernels
+//
+// Copyright (C) 2023 Scott Forbes
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// ****************************************************************************
+//
+// Line motion, line counting, and the screen renderer all look for '\n',
+// and find looks for the first and last bytes of its pattern. These
+// kernels do it a vector at a time: SSE2 (16 bytes) or AVX2 (32 bytes),
+// chosen when the program starts from what the CPU supports, with plain C
+// versions for other machines.
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "ec.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SCAN_X86
+#include <immintrin.h>
+#endif
+
+typedef long (*CountFn)(const char* p, const char* end);
+typedef const char* (*FindFn)(const char* p, const char* end, long* n);
+typedef const char* (*EndFn)(const char* p);
+typedef const char* (*PairFn)(const char* p, const char* last,
+                              const ScanPair* k);
+
+struct ScanKernels
+{
+    const char* name;
+    CountFn count;          // count '\n's in p..end
+    FindFn  fwd;            // find nth '\n' in p..end, from the front
+    FindFn  back;           // find nth '\n' in p..end, from the back
+    EndFn   lineEnd;        // find first '\n' or 0 at or after p
+    PairFn  pairFwd;        // find first pair candidate in p..last
+    PairFn  pairBack;       // find last pair candidate in p..last
+};
+
+// ----------------------------------------------------------------------------
+// Return the position of the nth (from 1) set bit of mask, from the bottom.
+
+static inline int nthLowBit(uint32_t mask, long n)
+{
+    while (--n > 0)
+        mask &= mask - 1;
+    return __builtin_ctz(mask);
+}
+
+// ----------------------------------------------------------------------------
+// Return the position of the nth (from 1) set bit of mask, from the top.
+
+static inline int nthHighBit(uint32_t mask, long n)
+{
+    int bit = 31 - __builtin_clz(mask);
+    while (--n > 0)
+    {
+        mask &= ~(1u << bit);
+        bit = 31 - __builtin_clz(mask);
+    }
+    return bit;
+}
+
+// ----------------------------------------------------------------------------
+// Plain C kernels.
+
+static long countScalar(const char* p, const char* end)
+{
+    long count = 0;
+    while ((p = (const char*)memchr(p, '\n', end - p)) != 0)
+    {
+        count++;
+        p++;
+    }
+    return count;
+}
+
+static const char* fwdScalar(const char* p, const char* end, long* n)
+{
+    for ( ; p < end; p++)
+        if (*p == '\n' && --*n == 0)
+            return p;
+    return 0;
+}
+
+static const char* backScalar(const char* p, const char* end, long* n)
+{
+    while (end > p)
+        if (*--end == '\n' && --*n == 0)
+            return end;
+    return 0;
+}
+
+static const char* lineEndScalar(const char* p)
+{
+    while (*p != '\n' && *p != 0)
+        p++;
+    return p;
+}
+
+static inline bool isPair(const char* p, const ScanPair* k)
+{
+    return ((unsigned char)p[0] | k->firstMask) == k->first &&
+           ((unsigned char)p[k->gap] | k->lastMask) == k->last;
+}
+
+static const char* pairFwdScalar(const char* p, const char* last,
+                                 const ScanPair* k)
+{
+    if (k->firstMask == 0)
+    {
+        while (p < last &&
+               (p = (const char*)memchr(p, k->first, last - p)) != 0)
+        {
+            if (isPair(p, k))
+                return p;
+            p++;
+        }
+        return 0;
+    }
+    for ( ; p < last; p++)
+        if (isPair(p, k))
+            return p;
+    return 0;
+}
+
+static const char* pairBackScalar(const char* p, const char* last,
+                                  const ScanPair* k)
+{
+    while (last > p)
+        if (isPair(--last, k))
+            return last;
+    return 0;
+}
+
+static const ScanKernels scalarKernels =
+    { "scalar", countScalar, fwdScalar, backScalar, lineEndScalar,
+      pairFwdScalar, pairBackScalar };
+
+#ifdef SCAN_X86
+
+// ----------------------------------------------------------------------------
+// SSE2 kernels.
+
+__attribute__((target("sse2")))
+static long countSSE2(const char* p, const char* end)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    long count = 0;
+    while (end - p >= 16)
+    {
+        // sum up to 255 vectors' matches in byte lanes, then widen
+        __m128i acc = zero;
+        for (int i = 0; i < 255 && end - p >= 16; i++, p += 16)
+        {
+            __m128i v = _mm_loadu_si128((const __m128i*)p);
+            acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(v, nl));
+        }
+        __m128i sums = _mm_sad_epu8(acc, zero);
+        count += _mm_cvtsi128_si32(sums) +
+                 _mm_cvtsi128_si32(_mm_srli_si128(sums, 8));
+    }
+    return count + countScalar(p, end);
+}
+
+__attribute__((target("sse2")))
+static const char* fwdSSE2(const char* p, const char* end, long* n)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    for ( ; end - p >= 16; p += 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)p);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (mask)
+        {
+            int c = __builtin_popcount(mask);
+            if (c >= *n)
+                return p + nthLowBit(mask, *n);
+            *n -= c;
+        }
+    }
+    return fwdScalar(p, end, n);
+}
+
+__attribute__((target("sse2")))
+static const char* backSSE2(const char* p, const char* end, long* n)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    for ( ; end - p >= 16; end -= 16)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i*)(end - 16));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        if (mask)
+        {
+            int c = __builtin_popcount(mask);
+            if (c >= *n)
+                return end - 16 + nthHighBit(mask, *n);
+            *n -= c;
+        }
+    }
+    return backScalar(p, end, n);
+}
+
+// Aligned loads never cross into the next page, so reading the rest of the
+// vector past the terminating zero is safe, though not to the sanitizer.
+
+__attribute__((target("sse2"), no_sanitize_address))
+static const char* lineEndSSE2(const char* p)
+{
+    const __m128i nl = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    int skip = (int)((uintptr_t)p & 15);
+    const char* a = p - skip;
+    __m128i v = _mm_load_si128((const __m128i*)a);
+    uint32_t mask = (uint32_t)_mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, zero)));
+    mask &= ~0u << skip;
+    while (!mask)
+    {
+        a += 16;
+        v = _mm_load_si128((const __m128i*)a);
+        mask = (uint32_t)_mm_movemask_epi8(
+            _mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, zero)));
+    }
+    return a + __builtin_ctz(mask);
+}
+
+// Candidates are where both the first-byte and last-byte vectors match.
+
+__attribute__((target("sse2")))
+static inline uint32_t pairMaskSSE2(const char* p, const ScanPair* k)
+{
+    __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i*)p),
+                             _mm_set1_epi8((char)k->firstMask));
+    __m128i z = _mm_or_si128(_mm_loadu_si128((const __m128i*)(p + k->gap)),
+                             _mm_set1_epi8((char)k->lastMask));
+    return (uint32_t)_mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpeq_epi8(a, _mm_set1_epi8((char)k->first)),
+        _mm_cmpeq_epi8(z, _mm_set1_epi8((char)k->last))));
+}
+
+__attribute__((target("sse2")))
+static const char* pairFwdSSE2(const char* p, const char* last,
+                               const ScanPair* k)
+{
+    for ( ; last - p >= 16; p += 16)
+    {
+        uint32_t mask = pairMaskSSE2(p, k);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return pairFwdScalar(p, last, k);
+}
+
+__attribute__((target("sse2")))
+static const char* pairBackSSE2(const char* p, const char* last,
+                                const ScanPair* k)
+{
+    for ( ; last - p >= 16; last -= 16)
+    {
+        uint32_t mask = pairMaskSSE2(last - 16, k);
+        if (mask)
+            return last - 16 + 31 - __builtin_clz(mask);
+    }
+    return pairBackScalar(p, last, k);
+}
+
+static const ScanKernels sse2Kernels =
+    { "SSE2", countSSE2, fwdSSE2, backSSE2, lineEndSSE2,
+      pairFwdSSE2, pairBackSSE2 };
+
+// ----------------------------------------------------------------------------
+// AVX2 kernels.
+
+__attribute__((target("avx2,popcnt")))
+static long countAVX2(const char* p, const char* end)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    long count = 0;
+    while (end - p >= 32)
+    {
+        __m256i acc = zero;
+        for (int i = 0; i < 255 && end - p >= 32; i++, p += 32)
+        {
+            __m256i v = _mm256_loadu_si256((const __m256i*)p);
+            acc = _mm256_sub_epi8(acc, _mm256_cmpeq_epi8(v, nl));
+        }
+        __m256i sums = _mm256_sad_epu8(acc, zero);
+        count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1)
+               + _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+    }
+    return count + countScalar(p, end);
+}
+
+__attribute__((target("avx2,popcnt")))
+static const char* fwdAVX2(const char* p, const char* end, long* n)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    for ( ; end - p >= 32; p += 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)p);
+        uint32_t mask =
+            (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (mask)
+        {
+            int c = __builtin_popcount(mask);
+            if (c >= *n)
+                return p + nthLowBit(mask, *n);
+            *n -= c;
+        }
+    }
+    return fwdScalar(p, end, n);
+}
+
+__attribute__((target("avx2,popcnt")))
+static const char* backAVX2(const char* p, const char* end, long* n)
+{
+    const __m256i nl = _mm256_set1_epi8('\n');
+    for ( ; end - p >= 32; end -= 32)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(end - 32));
+        uint32_t mask =
+            (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+        if (mask)
+        {
+            int c = __builtin_popcount(mask);
+            if (c >= *n)
+                return end - 32 + nthHighBit(mask, *n);
+            *n -= c;
+        }
+    }
+    return backScalar(p, end, n);
+}
+
+__attribute__((target("avx2,popcnt")))
+static inline uint32_t pairMaskAVX2(const char* p, const ScanPair* k)
+{
+    __m256i a = _mm256_or_si256(_mm256_loadu_si256((const __m256i*)p),
+                                _mm256_set1_epi8((char)k->firstMask));
+    __m256i z = _mm256_or_si256(
+        _mm256_loadu_si256((const __m256i*)(p + k->gap)),
+        _mm256_set1_epi8((char)k->lastMask));
+    return (uint32_t)_mm256_movemask_epi8(_mm256_and_si256(
+        _mm256_cmpeq_epi8(a, _mm256_set1_epi8((char)k->first)),
+        _mm256_cmpeq_epi8(z, _mm256_set1_epi8((char)k->last))));
+}
+
+__attribute__((target("avx2,popcnt")))
+static const char* pairFwdAVX2(const char* p, const char* last,
+                               const ScanPair* k)
+{
+    for ( ; last - p >= 32; p += 32)
+    {
+        uint32_t mask = pairMaskAVX2(p, k);
+        if (mask)
+            return p + __builtin_ctz(mask);
+    }
+    return pairFwdSSE2(p, last, k);
+}
+
+__attribute__((target("avx2,popcnt")))
+static const char* pairBackAVX2(const char* p, const char* last,
+                                const ScanPair* k)
+{
+    for ( ; last - p >= 32; last -= 32)
+    {
+        uint32_t mask = pairMaskAVX2(last - 32, k);
+        if (mask)
+            return last - 32 + 31 - __builtin_clz(mask);
+    }
+    return pairBackSSE2(p, last, k);
+}
+
+static const ScanKernels avx2Kernels =
+    { "AVX2", countAVX2, fwdAVX2, backAVX2, lineEndSSE2,
+      pairFwdAVX2, pairBackAVX2 };
+
+#endif // SCAN_X86
+
+// ----------------------------------------------------------------------------
+// Pick the fastest kernels this CPU can run.
+
+static const ScanKernels* pickKernels()
+{
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+        return &avx2Kernels;
+    if (__builtin_cpu_supports("sse2"))
+        return &sse2Kernels;
+#endif
+    return &scalarKernels;
+}
+
+static const ScanKernels* scan = pickKernels();
+
+// ----------------------------------------------------------------------------
+// Return the name of the kernel set in use.
+
+const char* scanKernelName()
+{
+    return scan->name;
+}
+
+// ----------------------------------------------------------------------------
+// Count the '\n' characters in p..end.
+
+long countNewlines(const char* p, const char* end)
+{
+    return p < end ? scan->count(p, end) : 0;
+}
+
+// ----------------------------------------------------------------------------
+// Find the nth '\n' in p..end, counting forward from p. Returns 0 if
+// there are fewer than n.
+
+const char* findNthNewline(const char* p, const char* end, long n)
+{
+    if (n <= 0 || p >= end)
+        return 0;
+    return scan->fwd(p, end, &n);
+}
+
+// ----------------------------------------------------------------------------
+// Find the nth '\n' in start..end, counting backward from end. Returns 0
+// if there are fewer than n.
+
+const char* findNthNewlineBack(const char* start, const char* end, long n)
+{
+    if (n <= 0 || end <= start)
+        return 0;
+    return scan->back(start, end, &n);
+}
+
+// ----------------------------------------------------------------------------
+// Find the last '\n' in start..p, or 0 if there is none.
+
+const char* findPrevNewline(const char* start, const char* p)
+{
+    return findNthNewlineBack(start, p, 1);
+}
+
+// ----------------------------------------------------------------------------
+// Find the end of the line at p in a zero-terminated string: the first
+// '\n' or 0 at or after p.
+
+const char* findLineEnd(const char* p)
+{
+    return scan->lineEnd(p);
+}
+
+// ----------------------------------------------------------------------------
+// Find the first position s in p..last where the bytes at s and s+gap
+// pass the pair test k. The bytes up to last+gap must be readable.
+
+const char* findPairFwd(const char* p, const char* last, const ScanPair* k)
+{
+    return p < last ? scan->pairFwd(p, last, k) : 0;
+}
+
+// ----------------------------------------------------------------------------
+// Find the last such position in p..last.
+
+const char* findPairBack(const char* p, const char* last, const ScanPair* k)
+{
+    return p < last ? scan->pairBack(p, last, k) : 0;
+}
@@ -0,0 +1,144 @@
+// ****************************************************************************
+// ecsearch.cc  Macro Screen Editor find pattern search
+//
+// Copyright (C) 2023 Scott Forbes
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// ****************************************************************************
+//
+// A find pattern is compiled once per find or replace command: its case
+// folding table, and a choice of how to look for it. Short patterns use
+// the vector pair kernels of ecscan.cc to find spots where the first and
+// last bytes match, and check just those; long ones use Boyer-Moore-
+// Horspool, which can skip nearly a pattern length at a time.
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "ec.h"
+
+enum { M_PAIR, M_HORSPOOL };    // search methods
+
+#define HORSPOOL_MIN 32         // shortest pattern to search by skipping
+
+// ----------------------------------------------------------------------------
+// Compile pattern str of len characters. The search ignores case unless
+// the pattern has an uppercase letter.
+
+SearchPattern::SearchPattern(const char* str, int len)
+{
+    this->len = len;
+    pat = new unsigned char[len + 1];
+    memcpy(pat, str, (size_t)len);
+    pat[len] = 0;
+
+    caseSens = FALSE;
+    for (int i = 0; i < len; i++)
+        if (isupper(pat[i]))
+            caseSens = TRUE;
+    for (int c = 0; c < 256; c++)
+        fold[c] = (unsigned char)(caseSens ? c : tolower(c));
+
+    method = len >= HORSPOOL_MIN ? M_HORSPOOL : M_PAIR;
+
+    if (len > 0)
+    {
+        // a letter's case bit is masked off when case is ignored
+        unsigned char c0 = pat[0], c1 = pat[len-1];
+        pair.gap = len - 1;
+        pair.firstMask = (!caseSens && isalpha(c0)) ? 0x20 : 0;
+        pair.first = c0 | pair.firstMask;
+        pair.lastMask = (!caseSens && isalpha(c1)) ? 0x20 : 0;
+        pair.last = c1 | pair.lastMask;
+    }
+
+    for (int c = 0; c < 256; c++)
+        shift[c] = shiftBack[c] = len;
+    for (int i = 0; i < len - 1; i++)
+        shift[pat[i]] = len - 1 - i;
+    for (int i = len - 1; i > 0; i--)
+        shiftBack[pat[i]] = i;
+}
+
+SearchPattern::~SearchPattern()
+{
+    delete[] pat;
+}
+
+// ----------------------------------------------------------------------------
+// Return TRUE if the pattern matches the text at s.
+
+bool SearchPattern::matchAt(const char* s) const
+{
+    if (caseSens)
+        return memcmp(s, pat, (size_t)len) == 0;
+    const unsigned char* t = (const unsigned char*)s;
+    for (int i = 0; i < len; i++)
+        if (fold[t[i]] != pat[i])
+            return FALSE;
+    return TRUE;
+}
+
+// ----------------------------------------------------------------------------
+// Find the first match that starts at or after from and ends at or before
+// end. Returns 0 if there is none.
+
+const char* SearchPattern::findFwd(const char* from, const char* end) const
+{
+    if (len <= 0 || end - from < len)
+        return 0;
+    const char* last = end - len + 1;       // just past the last start
+    if (method == M_HORSPOOL)
+    {
+        for (const char* s = from; s < last; )
+        {
+            unsigned char c = fold[(unsigned char)s[len-1]];
+            if (c == pat[len-1] && matchAt(s))
+                return s;
+            s += shift[c];
+        }
+        return 0;
+    }
+    for (const char* s = from;
+         (s = findPairFwd(s, last, &pair)) != 0; s++)
+        if (matchAt(s))
+            return s;
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Find the last match that starts at or after start and ends at or before
+// to. Returns 0 if there is none.
+
+const char* SearchPattern::findBack(const char* start, const char* to) const
+{
+    if (len <= 0 || to - start < len)
+        return 0;
+    if (method == M_HORSPOOL)
+    {
+        for (const char* s = to - len; s >= start; )
+        {
+            unsigned char c = fold[(unsigned char)*s];
+            if (c == pat[0] && matchAt(s))
+                return s;
+            if (s - start < shiftBack[c])
+                break;
+            s -= shiftBack[c];
+        }
+        return 0;
+    }
+    for (const char* last = to - len + 1;
+         (last = findPairBack(start, last, &pair)) != 0; )
+        if (matchAt(last))
+            return last;
+    return 0;
+}
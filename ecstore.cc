@@ -0,0 +1,810 @@
+// ****************************************************************************
+// ecstore.cc  Macro Screen Editor buffer storage engine
+//
+// Copyright (C) 2023 Scott Forbes
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// ****************************************************************************
+//
+// The text of a buffer is kept in one block, bstart..beot, with a zero at
+// *beot and the free space between beot and bend. Opening or closing space
+// in the middle of a big text would move all of it after there, so an edit
+// well before the end moves some of the free space in after the line being
+// edited instead: the gap, bgapLen bytes at bgap. Edits near it then move
+// just the text between them and the gap, and the gap follows them a line
+// at a time. It's only closed when something needs the text in one piece.
+//
+// Only one buffer has a gap at a time. It always starts a line, right after
+// a '\n', with a zero at *bgap, so code that walks the text a line at a
+// time steps over it at a line end (textAt() and lineAfter() in ec.h), and
+// code that does so a character at a time sees it as the end of the text.
+// No pointer into the text is left in it. The block is only resized when
+// the free space is used up.
+//
+// Blocks grow geometrically. Small blocks come from malloc() and are grown
+// with realloc(); large ones are mapped pages grown with mremap(), which
+// moves page table entries rather than copying the text. A large file may
+// be opened by mapping it copy-on-write over the front of a block of pages,
+// so that it can be shown before it's read in. The mapping isn't kept:
+// another program truncating the file would make its pages fault, and
+// rewriting it would change the text. So the file is read into pages of
+// the buffer's own, piece by piece while the editor is idle, and all of it
+// before the text is first changed, and each piece replaces the mapped
+// pages under it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "ec.h"
+
+#define GROW_NUM    3       // blocks grow by at least GROW_NUM/GROW_DEN
+#define GROW_DEN    2
+#define TRIM_SLACK  65536   // minimum free space worth trimming when idle
+#define GAP_OPEN    65536   // least text after an edit worth opening a gap for
+#define GAP_MIN     16384   // least size of a gap, when opened or grown,
+#define GAP_DEN     64      //   or the text over this, if more
+#define TEXT_PTRS   3       // pointers a buffer keeps into its text
+
+#ifdef MREMAP_MAYMOVE
+#define MAP_MIN     (1024*1024) // blocks this big or larger are mapped pages
+#endif
+
+StoreStats storeStats;          // storage engine counters
+bool    shrinkIdle;             // TRUE to trim buffer blocks when idle
+long    textVersion;            // bumped by every change to buffer text
+char*   bgap;                   // gap in a buffer's text, or 0
+long    bgapLen;                //   and its length
+static int gapBuff;             // buffer with the gap
+
+// ----------------------------------------------------------------------------
+// Adjust the current buffer's pointers after its block moved by offset.
+
+static void rebase(ptrdiff_t offset)
+{
+    bend += offset;
+    beot += offset;
+    bcursPos += offset;
+    btagPos += offset;
+    btopRowPos += offset;
+    if (bgap && gapBuff == b)
+        bgap += offset;
+}
+
+// ----------------------------------------------------------------------------
+// Return TRUE if the gap is in the current buffer's text.
+
+static bool gapHere()
+{
+    return bgap && gapBuff == b;
+}
+
+// ----------------------------------------------------------------------------
+// Get the addresses of buffer i's pointers into its text.
+
+static void textPointers(int i, char** ptrs[TEXT_PTRS])
+{
+    BuffRec* buf = &buffer[i];
+    ptrs[0] = i == b ? &bcursPos : &buf->cursPos;
+    ptrs[1] = i == b ? &btagPos : &buf->tagPos;
+    ptrs[2] = i == b ? &btopRowPos : &buf->topRowPos;
+}
+
+// ----------------------------------------------------------------------------
+// Move buffer i's pointers into its text from..to (not including to) by
+// offset, along with the text.
+
+static void shiftPointers(int i, const char* from, const char* to,
+                          ptrdiff_t offset)
+{
+    char** ptrs[TEXT_PTRS];
+    textPointers(i, ptrs);
+    for (int k = 0; k < TEXT_PTRS; k++)
+        if (*ptrs[k] >= from && *ptrs[k] < to)
+            *ptrs[k] += offset;
+}
+
+// ----------------------------------------------------------------------------
+// Get the offsets of the current buffer's pointers in its text, and put
+// them back at those offsets after an edit, as they would be if the text
+// after the edit had moved. Those past the end of the text go to its end.
+
+static void pointerOffsets(long offs[TEXT_PTRS])
+{
+    char** ptrs[TEXT_PTRS];
+    textPointers(b, ptrs);
+    for (int k = 0; k < TEXT_PTRS; k++)
+        offs[k] = textSpan(bstart, *ptrs[k]);
+}
+
+static void pointersAt(const long offs[TEXT_PTRS])
+{
+    char** ptrs[TEXT_PTRS];
+    textPointers(b, ptrs);
+    long len = textSpan(bstart, beot);
+    for (int k = 0; k < TEXT_PTRS; k++)
+        *ptrs[k] = (char*)textAt(bstart, offs[k] < len ? offs[k] : len);
+}
+
+// ----------------------------------------------------------------------------
+// Free the current buffer's block.
+
+static void releaseBlock()
+{
+    BuffRec* buf = &buffer[b];
+    textVersion++;
+    if (buf->blockKind == BK_HEAP)
+        free(bstart);
+    else
+        munmap(bstart, (size_t)buf->blockSize);
+    if (buf->mapped)
+    {
+        close(buf->mapped->fd);
+        free(buf->mapped);
+        buf->mapped = 0;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Resize the current buffer's block to newSize bytes, keeping the first
+// used bytes. A new block is allocated if there is none yet.
+
+static void resizeBlock(long used, long newSize)
+{
+    BuffRec* buf = &buffer[b];
+    char* newp;
+#ifdef MAP_MIN
+    if (buf->blockKind != BK_HEAP || newSize >= MAP_MIN)
+    {
+        size_t page = (size_t)getpagesize();
+        newSize = (long)(((size_t)newSize + page - 1) & ~(page - 1));
+        if (buf->blockKind == BK_ANON)
+        {
+            newp = (char*)mremap(bstart, (size_t)buf->blockSize,
+                                 (size_t)newSize, MREMAP_MAYMOVE);
+            storeStats.remaps++;
+        }
+        else
+        {
+            // crossing into mapped pages, or outgrowing a mapped file (whose
+            // pages can't be remapped as one): one last copy
+            newp = (char*)mmap(0, (size_t)newSize, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (newp != (char*)MAP_FAILED && bstart)
+            {
+                memcpy(newp, bstart, (size_t)used);
+                storeStats.bytesCopied += used;
+                releaseBlock();
+            }
+            if (newp != (char*)MAP_FAILED)
+                buf->blockKind = BK_ANON;
+        }
+        if (newp == (char*)MAP_FAILED)
+            throw new Error("out of memory");
+    }
+    else
+#endif
+    {
+        newp = (char*)realloc(bstart, (size_t)newSize);
+        if (!newp)
+            throw new Error("out of memory");
+        if (bstart && newp != bstart)
+            storeStats.bytesCopied += used;
+    }
+    storeStats.reallocs++;
+    textVersion++;
+
+    if (bstart)
+        // ptrdiff_t insures 64-bit pointer offsets are handled
+        rebase(newp - bstart);
+    else
+    {
+        bend = beot = bcursPos = btagPos = btopRowPos = newp;
+        *newp = 0;
+    }
+    bstart = newp;
+    bend = bstart + newSize - 1;
+    buf->blockSize = newSize;
+}
+
+// ----------------------------------------------------------------------------
+// Grow the current buffer's block, if need be, to hold n more bytes.
+
+static void makeRoom(long n)
+{
+    if (beot + n > bend)
+    {
+        long used = beot - bstart;
+        long newSize = buffer[b].blockSize / GROW_DEN * GROW_NUM;
+        if (newSize < used + n + ELBOW + 1)
+            newSize = used + n + ELBOW + 1;
+        resizeBlock(used + 1, newSize);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Return the size of a gap to open or grow to in the current buffer, beyond
+// the n bytes about to go into it.
+
+static long gapSize(long n)
+{
+    long used = beot - bstart;
+    return n + (used / GAP_DEN > GAP_MIN ? used / GAP_DEN : GAP_MIN);
+}
+
+// ----------------------------------------------------------------------------
+// Close the gap, moving the text after it down, in whichever buffer it's in.
+
+static void closeGap()
+{
+    int i = gapBuff;
+    char** eot = i == b ? &beot : &buffer[i].eot;
+    char* from = bgap + bgapLen;
+    memmove(bgap, from, (size_t)(*eot + 1 - from));
+    storeStats.bytesShifted += *eot - from;
+    shiftPointers(i, from, *eot + 1, -bgapLen);
+    *eot -= bgapLen;
+    bgap = 0;
+    bgapLen = 0;
+    textVersion++;
+}
+
+// ----------------------------------------------------------------------------
+// Open a gap in the current buffer at line start p, moving the text after
+// it up. Returns the (possibly moved) location of p.
+
+static char* openGap(char* p)
+{
+    if (bgap)
+        closeGap();
+    long len = gapSize(0);
+    ptrdiff_t offs = p - bstart;
+    makeRoom(len);
+    p = bstart + offs;
+    memmove(p + len, p, (size_t)(beot + 1 - p));
+    storeStats.bytesShifted += beot - p;
+    shiftPointers(b, p, beot + 1, len);
+    beot += len;
+    bgap = p;
+    bgapLen = len;
+    gapBuff = b;
+    *bgap = 0;
+    textVersion++;
+    return p;
+}
+
+// ----------------------------------------------------------------------------
+// Grow the current buffer's gap to hold more than n bytes, moving the text
+// after it up.
+
+static void growGap(long n)
+{
+    long extra = gapSize(n) - bgapLen;
+    makeRoom(extra);
+    char* from = bgap + bgapLen;
+    memmove(from + extra, from, (size_t)(beot + 1 - from));
+    storeStats.bytesShifted += beot - from;
+    shiftPointers(b, from, beot + 1, extra);
+    beot += extra;
+    bgapLen += extra;
+}
+
+// ----------------------------------------------------------------------------
+// Move the current buffer's gap to line start p: down, moving the text
+// p..bgap up past it, or up, moving the text after it until p down.
+
+static void moveGap(char* p)
+{
+    char* gapEnd = bgap + bgapLen;
+    if (p < bgap)
+    {
+        memmove(p + bgapLen, p, (size_t)(bgap - p));
+        storeStats.bytesShifted += bgap - p;
+        shiftPointers(b, p, bgap, bgapLen);
+        bgap = p;
+    }
+    else
+    {
+        memmove(bgap, gapEnd, (size_t)(p - gapEnd));
+        storeStats.bytesShifted += p - gapEnd;
+        shiftPointers(b, gapEnd, p, -bgapLen);
+        bgap += p - gapEnd;
+    }
+    *bgap = 0;
+    textVersion++;
+}
+
+// ----------------------------------------------------------------------------
+// Close the gap if it's in buffer i's text, for code that needs that text
+// in one piece.
+
+void bufFlat(int i)
+{
+    if (bgap && gapBuff == i)
+        closeGap();
+}
+
+// ----------------------------------------------------------------------------
+// Make sure position p of the current buffer is before its gap, moving the
+// gap on past the end of p's line if it isn't, or closing it if that's the
+// last line. Returns where p then is.
+
+char* bufGapPast(char* p)
+{
+    if (!gapHere() || p < bgap)
+        return p;
+    long len = bgapLen;
+    const char* eol = findLineEnd(p);
+    if (!*eol || eol + 1 == beot)
+        closeGap();
+    else
+        moveGap((char*)eol + 1);
+    return p - len;
+}
+
+// ----------------------------------------------------------------------------
+// Get the current buffer ready for an edit of the n characters at p: if
+// there's text enough after them, put the gap after the line holding the
+// first character after them, or else close it. The edited characters are
+// then together, and right before the gap or the end of the text. Returns
+// where p then is.
+
+char* bufEditAt(char* p, long n)
+{
+    long o = textSpan(bstart, p);
+    if (o + n >= textSpan(bstart, beot))
+    {
+        if (gapHere())
+            closeGap();
+        return bstart + o;
+    }
+    char* q = bufGapPast((char*)textAt(bstart, o + n));
+    const char* eol = findLineEnd(q);
+    char* next = (char*)eol + 1;
+    if (gapHere())
+    {
+        if (next != bgap)
+            moveGap(next);
+    }
+    else if (*eol && b < longCmdBuff && beot - next >= GAP_OPEN)
+        openGap(next);
+    return (char*)textAt(bstart, o);
+}
+
+// ----------------------------------------------------------------------------
+// Allocate an empty block for the current buffer.
+
+void bufNew()
+{
+    bstart = 0;
+    buffer[b].blockKind = BK_HEAP;
+    buffer[b].blockSize = 0;
+    resizeBlock(0, ELBOW+2);
+}
+
+// ----------------------------------------------------------------------------
+// Empty the current buffer's text, keeping its block.
+
+void bufClear()
+{
+    if (gapHere())
+    {
+        bgap = 0;
+        bgapLen = 0;
+    }
+    beot = bcursPos = btagPos = btopRowPos = bstart;
+    *beot = 0;
+    textVersion++;
+}
+
+// ----------------------------------------------------------------------------
+// Make the size bytes of open file fd the text of the current buffer, which
+// must be empty, by mapping it. The file is then copied in by bufCopyIn().
+// Returns FALSE if it can't be mapped.
+
+bool bufMapFile(int fd, long size)
+{
+#ifdef MAP_MIN
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size != size)
+        return FALSE;
+    MappedFile* m = (MappedFile*)malloc(sizeof(MappedFile));
+    if (!m)
+        return FALSE;
+    m->fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+    m->size = size;
+    m->time = st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec;
+    m->done = 0;
+    size_t page = (size_t)getpagesize();
+    long newSize = size + size/GROW_DEN + ELBOW + 1;
+    newSize = (long)(((size_t)newSize + page - 1) & ~(page - 1));
+    char* newp = (char*)mmap(0, (size_t)newSize, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (m->fd < 0 || newp == (char*)MAP_FAILED)
+    {
+        if (m->fd >= 0)
+            close(m->fd);
+        free(m);
+        return FALSE;
+    }
+    // the zero after the text comes from the rest of the file's last page,
+    // or the first anonymous page after it
+    if (mmap(newp, (size_t)size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED)
+    {
+        munmap(newp, (size_t)newSize);
+        close(m->fd);
+        free(m);
+        return FALSE;
+    }
+    if (bstart)
+        releaseBlock();
+    bstart = newp;
+    bend = bstart + newSize - 1;
+    beot = bstart + size;
+    bcursPos = btagPos = btopRowPos = bstart;
+    buffer[b].blockKind = BK_FILE;
+    buffer[b].blockSize = newSize;
+    buffer[b].mapped = m;
+    textVersion++;
+    return TRUE;
+#else
+    return FALSE;
+#endif
+}
+
+// ----------------------------------------------------------------------------
+// Copy about most more bytes of buffer i's mapped file into its own pages,
+// reading the file rather than touching the mapping. Returns the bytes left
+// to copy, 0 when it's all in and the file is let go, or -1 if the file
+// has changed since it was mapped, when the mapping can't be trusted.
+
+long bufCopyIn(int i, long most)
+{
+#ifdef MAP_MIN
+    BuffRec* buf = &buffer[i];
+    MappedFile* m = buf->mapped;
+    if (!m)
+        return 0;
+    struct stat st;
+    if (fstat(m->fd, &st) != 0 || st.st_size != m->size ||
+        st.st_mtim.tv_sec * 1000000000L + st.st_mtim.tv_nsec != m->time)
+        return -1;
+    char* start = (i == b ? bstart : buf->start);
+    size_t page = (size_t)getpagesize();
+    long len = (long)(((size_t)m->size + page - 1) & ~(page - 1));
+    while (most > 0 && m->done < len)
+    {
+        long n = len - m->done;
+        if (most < n)
+            n = (long)(((size_t)most + page - 1) & ~(page - 1));
+        char* piece = (char*)mmap(0, (size_t)n, PROT_READ | PROT_WRITE,
+                                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (piece == (char*)MAP_FAILED)
+            throw new Error("out of memory");
+        long want = m->size - m->done < n ? m->size - m->done : n;
+        long got = 0;
+        while (got < want)
+        {
+            ssize_t r = pread(m->fd, piece + got, (size_t)(want - got),
+                              m->done + got);
+            if (r < 0 && errno == EINTR)
+                continue;
+            if (r <= 0)
+                break;
+            got += r;
+        }
+        if (got < want)                 // cut short: the file has shrunk
+        {
+            munmap(piece, (size_t)n);
+            return -1;
+        }
+        // move the piece's pages over the mapped ones, in one step
+        if (mremap(piece, (size_t)n, (size_t)n, MREMAP_MAYMOVE | MREMAP_FIXED,
+                   start + m->done) == MAP_FAILED)
+        {
+            munmap(piece, (size_t)n);
+            throw new Error("out of memory");
+        }
+        m->done += n;
+        most -= n;
+        storeStats.bytesCopied += want;
+    }
+    if (m->done < len)
+        return len - m->done;
+    close(m->fd);
+    free(m);
+    buf->mapped = 0;
+#endif
+    return 0;
+}
+
+// ----------------------------------------------------------------------------
+// Let go of the current buffer's mapped file, if it's still being copied
+// in, leaving the buffer empty.
+
+void bufUnmapFile()
+{
+    if (!buffer[b].mapped)
+        return;
+    releaseBlock();
+    bufNew();
+}
+
+// ----------------------------------------------------------------------------
+// Open a hole of n characters at p in the current buffer, moving the text
+// after it up, to the gap if there is one. Returns the (possibly moved)
+// location of the hole.
+
+char* bufOpen(char* p, long n)
+{
+    p = bufEditAt(p, 0);
+    ptrdiff_t offs = p - bstart;
+    if (gapHere())
+    {
+        long ptrOffs[TEXT_PTRS];
+        pointerOffsets(ptrOffs);
+        if (n >= bgapLen)
+            growGap(n);
+        p = bstart + offs;
+        memmove(p + n, p, (size_t)(bgap - p));
+        storeStats.bytesShifted += bgap - p;
+        bgap += n;
+        bgapLen -= n;
+        *bgap = 0;
+        pointersAt(ptrOffs);
+        textVersion++;
+        return p;
+    }
+    makeRoom(n);                // if no more room in buffer block, grow it
+    p = bstart + offs;
+    memmove(p + n, p, (size_t)(beot + 1 - p));
+    storeStats.bytesShifted += beot - p;
+    beot += n;
+    textVersion++;
+    return p;
+}
+
+// ----------------------------------------------------------------------------
+// Close up n characters at p in the current buffer, moving the text after
+// them down, to the gap if there is one.
+
+void bufClose(char* p, long n)
+{
+    textVersion++;
+    p = bufEditAt(p, n);
+    if (gapHere())
+    {
+        long ptrOffs[TEXT_PTRS];
+        pointerOffsets(ptrOffs);
+        memmove(p, p + n, (size_t)(bgap - p - n));
+        storeStats.bytesShifted += bgap - p - n;
+        bgap -= n;
+        bgapLen += n;
+        *bgap = 0;
+        pointersAt(ptrOffs);
+        return;
+    }
+    if (beot >= p + n)
+    {
+        memmove(p, p + n, (size_t)(beot + 1 - p - n));
+        storeStats.bytesShifted += beot - p - n;
+        beot -= n;
+    }
+    else
+    {
+        beot = p;
+        *beot = 0;
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Give back most of the current buffer's free space, if it has a lot.
+// Called when idle, so that a burst of typing doesn't grow it right back.
+
+void bufTrim()
+{
+    long used = beot - bstart;
+    long slack = buffer[b].blockSize - used;
+    if (!bstart || slack < TRIM_SLACK || slack < 3*used ||
+        buffer[b].blockKind == BK_FILE)
+        return;
+    resizeBlock(used + 1, used + used/GROW_DEN + ELBOW + 1);
+    storeStats.trims++;
+}
+
+// ----------------------------------------------------------------------------
+// Return where position p of the current buffer goes when bufReplace()
+// replaces the count len-character spans at offs[] with replLen each.
+
+static char* replacedPos(char* p, const long* offs, long count, long len,
+                         long replLen)
+{
+    long o = p - bstart;
+    long lo = 0, hi = count;            // k = number of spans starting < o
+    while (lo < hi)
+    {
+        long mid = (lo + hi) / 2;
+        if (offs[mid] < o)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    long k = lo;
+    long d = replLen - len;
+    if (k > 0 && o < offs[k-1] + len)   // inside a span: keep within its
+    {                                   // replacement
+        long into = o - offs[k-1];
+        return bstart + offs[k-1] + (k-1)*d + (into < replLen ? into : replLen);
+    }
+    return bstart + o + k*d;
+}
+
+// ----------------------------------------------------------------------------
+// Replace the count spans of len characters at ascending, non-overlapping
+// offsets offs[] with the replLen characters at repl, which must not be in
+// the buffer. The text is moved once, in place: from the front if it
+// shrinks, and from the back if it grows.
+
+void bufReplace(const long* offs, long count, long len, const char* repl,
+                long replLen)
+{
+    if (count <= 0)
+        return;
+    bufFlat(b);
+    textVersion++;
+    long used = beot - bstart;
+    long d = replLen - len;
+    if (beot + count*d > bend)
+    {
+        long newSize = buffer[b].blockSize / GROW_DEN * GROW_NUM;
+        if (newSize < used + count*d + ELBOW + 1)
+            newSize = used + count*d + ELBOW + 1;
+        resizeBlock(used + 1, newSize);
+    }
+
+    char* cursPos = replacedPos(bcursPos, offs, count, len, replLen);
+    char* tagPos = replacedPos(btagPos, offs, count, len, replLen);
+    char* topRowPos = replacedPos(btopRowPos, offs, count, len, replLen);
+
+    if (d <= 0)
+    {
+        char* dst = bstart + offs[0];
+        long segStart = offs[0];
+        for (long k = 0; k < count; k++)
+        {
+            long n = offs[k] - segStart;
+            memmove(dst, bstart + segStart, (size_t)n);
+            dst += n;
+            memcpy(dst, repl, (size_t)replLen);
+            dst += replLen;
+            segStart = offs[k] + len;
+            storeStats.bytesShifted += n;
+        }
+        memmove(dst, bstart + segStart, (size_t)(used + 1 - segStart));
+        storeStats.bytesShifted += used - segStart;
+    }
+    else
+    {
+        char* dst = bstart + used + 1 + count*d;
+        long segEnd = used + 1;
+        for (long k = count - 1; k >= 0; k--)
+        {
+            long segStart = offs[k] + len;
+            long n = segEnd - segStart;
+            dst -= n;
+            memmove(dst, bstart + segStart, (size_t)n);
+            dst -= replLen;
+            memcpy(dst, repl, (size_t)replLen);
+            segEnd = offs[k];
+            storeStats.bytesShifted += n;
+        }
+    }
+    beot += count*d;
+    bcursPos = cursPos;
+    btagPos = tagPos;
+    btopRowPos = topRowPos;
+}
+
+// ----------------------------------------------------------------------------
+// Return where position p of the current buffer goes when bufSplice()
+// makes the count changes sp[].
+
+static char* splicedPos(char* p, const Splice* sp, long count)
+{
+    long o = p - bstart;
+    long d = 0;
+    for (long k = 0; k < count && sp[k].offs < o; k++)
+    {
+        if (o < sp[k].offs + sp[k].len)     // inside a span: keep within its
+        {                                   // new text
+            long into = o - sp[k].offs;
+            return bstart + sp[k].offs + d +
+                   (into < sp[k].textLen ? into : sp[k].textLen);
+        }
+        d += sp[k].textLen - sp[k].len;
+    }
+    return bstart + o + d;
+}
+
+// ----------------------------------------------------------------------------
+// Make the count changes sp[], at ascending, non-overlapping offsets, each
+// of which may grow or shrink the text by a different amount. The texts
+// must not be in the buffer. Each stretch of text between the spans is
+// moved once: those moving down in a pass from the front, then those
+// moving up in a pass from the back, so none is written over before it
+// has moved.
+
+void bufSplice(const Splice* sp, long count)
+{
+    if (count <= 0)
+        return;
+    bufFlat(b);
+    textVersion++;
+    long used = beot - bstart;
+    long grow = 0;
+    for (long k = 0; k < count; k++)
+        grow += sp[k].textLen - sp[k].len;
+    if (beot + grow > bend)
+    {
+        long newSize = buffer[b].blockSize / GROW_DEN * GROW_NUM;
+        if (newSize < used + grow + ELBOW + 1)
+            newSize = used + grow + ELBOW + 1;
+        resizeBlock(used + 1, newSize);
+    }
+
+    char* cursPos = splicedPos(bcursPos, sp, count);
+    char* tagPos = splicedPos(btagPos, sp, count);
+    char* topRowPos = splicedPos(btopRowPos, sp, count);
+
+    // stretch k runs from the end of span k-1 to the start of span k, or
+    // through the final zero, and moves by the growth of the spans before it
+    long d = 0;
+    for (long k = 1; k <= count; k++)
+    {
+        d += sp[k-1].textLen - sp[k-1].len;
+        if (d < 0)
+        {
+            long from = sp[k-1].offs + sp[k-1].len;
+            long n = (k < count ? sp[k].offs : used + 1) - from;
+            memmove(bstart + from + d, bstart + from, (size_t)n);
+            storeStats.bytesShifted += n;
+        }
+    }
+    d = grow;
+    for (long k = count; k >= 1; k--)
+    {
+        if (d > 0)
+        {
+            long from = sp[k-1].offs + sp[k-1].len;
+            long n = (k < count ? sp[k].offs : used + 1) - from;
+            memmove(bstart + from + d, bstart + from, (size_t)n);
+            storeStats.bytesShifted += n;
+        }
+        d -= sp[k-1].textLen - sp[k-1].len;
+    }
+    d = 0;
+    for (long k = 0; k < count; k++)
+    {
+        memcpy(bstart + sp[k].offs + d, sp[k].text, (size_t)sp[k].textLen);
+        d += sp[k].textLen - sp[k].len;
+    }
+    beot += grow;
+    bcursPos = cursPos;
+    btagPos = tagPos;
+    btopRowPos = topRowPos;
+}
@@ -0,0 +1,831 @@
+// ****************************************************************************
+// ecsyntax.cc  Macro Screen Editor syntax highlighting
+//
+// Copyright (C) 2023 Scott Forbes
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// ****************************************************************************
+//
+// Text is highlighted a token at a time as it's drawn, by a lexer for its
+// file type's language. Each token's kind picks its attributes from
+// tokenAttr[]. Languages are defined by lines like these, built in or in
+// .exrc, where a later definition wins for a file type:
+//
+//   syntax c .c .h         name, then file extensions or names; none
+//                          makes it the default
+//   tab 4                  tab spacing
+//   comment //             comment to the end of the line
+//   comment /* */          comment to a closing delimiter
+//   string " \             string to the same quote or the line end, with
+//                          an optional escape character
+//   longstring """ """     string to a closing delimiter
+//   keyword if else for    keywords
+//   highlight keyword bold attributes of a token kind, for all languages:
+//                          bold, underline, reverse, or none
+//
+// The delimiters and keywords of each language are compiled into a DFA
+// over bytes, with a start state for each lexer state: in code, or inside
+// one kind of comment or string. Outside of the tries of the delimiters
+// and keywords, a run of characters that can't start one is a token, as
+// is a run of word characters in code, and any other character is one by
+// itself. The lexer takes the longest token, with a DFA step of one table
+// lookup for each character. Only the lexer state
+// carries from one line to the next, as it does inside a /* */ comment, or
+// a string continued with an escaped newline.
+//
+// The tables of all the languages are kept in one block, which is cached
+// in ~/.ecsyntax along with a hash of the definitions it came from, and
+// read back instead of compiling them again while they're the same. A
+// cache that isn't the user's own, or whose tables don't all check out,
+// is ignored.
+//
+// Each buffer keeps the state at the start of each line, as far as it has
+// been drawn, so that drawing can start at any line without going back to
+// the top. An edit shifts the states after it to their new lines, and
+// marks them as unchecked. The next time one is needed, the lines from the
+// edit on are lexed again, and once a line past the edit comes out in the
+// same state as before, the rest are known to be right as they are.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "termp.h"
+#include "ec.h"
+
+int tokenAttr[TK_KINDS] =       // attributes of each token kind
+{
+    0,                          // TK_TEXT
+    AT_UNDERLINE,               // TK_KEYWORD
+    AT_BOLD,                    // TK_COMMENT
+    0                           // TK_STRING: plain, but keeps out comments
+};
+
+static const char* kindName[TK_KINDS] = { "text", "keyword", "comment",
+                                          "string" };
+
+static const char builtinSyntax[] =
+    "syntax c .c .h .cc .cpp .cxx .hh .hpp .m\n"
+    "tab 4\n"
+    "comment //\n"
+    "comment /* */\n"
+    "string \" \\\n"
+    "string ' \\\n"
+    "keyword auto bool break case catch char class const constexpr continue\n"
+    "keyword default delete do double else enum explicit extern false float\n"
+    "keyword for friend goto if inline int long mutable namespace new\n"
+    "keyword nullptr operator private protected public register return short\n"
+    "keyword signed sizeof static struct switch template this throw true try\n"
+    "keyword typedef typename union unsigned using virtual void volatile while\n"
+    "keyword #define #elif #else #endif #if #ifdef #ifndef #include #pragma\n"
+    "keyword #undef\n"
+    "syntax verilog .v .vh .sv .svh\n"
+    "tab 4\n"
+    "comment //\n"
+    "comment /* */\n"
+    "string \" \\\n"
+    "keyword always always_comb always_ff and assign begin case casex casez\n"
+    "keyword default else end endcase endfunction endgenerate endmodule\n"
+    "keyword endtask for function generate genvar if initial inout input\n"
+    "keyword integer localparam logic module negedge not or output parameter\n"
+    "keyword posedge reg task while wire\n"
+    "syntax text\n"
+    "comment //\n"
+    "comment /* */\n"
+    "string \" \\\n";
+
+#define SYNTAX_MAGIC    "ecsyn02"   // cache format version
+#define MAX_SYNTAXES    64          // languages
+#define MAX_DFA_STATES  LEX_ACCEPT  // DFA states of a language
+#define MAX_LEX_STATES  256         // lexer states of a language
+#define LEX_NONE        0xffff      // accept entry of a non-accepting state
+#define LEX_ROOM        1024        // lines of state to allow for at first
+
+typedef struct                  // head of the block of compiled tables
+{
+    char    magic[8];
+    unsigned long hash;         // of the definitions they were compiled from
+    long    size;               // of the whole block
+    int     attr[TK_KINDS];     // tokenAttr
+    int     count;              // languages
+    long    recs;               // offset of their SyntaxRecs
+} SyntaxHead;
+
+typedef struct                  // a compiled language
+{
+    char    name[16];
+    char    exts[240];
+    int     tabSize;
+    int     states;             // DFA states
+    int     lexStates;          // lexer states
+    long    trans;              // offsets of its tables in the block
+    long    accept;
+    long    start;
+} SyntaxRec;
+
+static char*    tables;         // compiled tables of all languages
+static Syntax   syntaxes[MAX_SYNTAXES];
+static int      nSyntaxes;
+
+// the language being compiled
+static SyntaxRec lang;
+static unsigned short* dTrans;  // its DFA transitions, 256 per state
+static unsigned short* dAccept; // what a token ending in each state is
+static char*    dNode;          // TRUE for the states in delimiter tries
+static int      dStates, dMax;  // states, and room for them
+static unsigned short dStart[MAX_LEX_STATES]; // start state of lexer states
+static unsigned short dRun[MAX_LEX_STATES];   // in a run of plain chars
+static unsigned short dEscaped[MAX_LEX_STATES]; // after an escaped char
+static int      lexStates;      // lexer states
+static int      wordState;      // in a word in code
+
+// the block being built
+static SyntaxRec recs[MAX_SYNTAXES];
+static int      nRecs;
+static long     tablesSize, tablesMax;
+
+// ----------------------------------------------------------------------------
+// Return TRUE if c may be part of a word.
+
+static inline bool isWordChar(unsigned char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_';
+}
+
+// ----------------------------------------------------------------------------
+// Return the kind and next lexer state of a token as an accept entry.
+
+static inline unsigned short acceptOf(int kind, int next)
+{
+    return (unsigned short)(kind << 8 | next);
+}
+
+// ----------------------------------------------------------------------------
+// Return the next token of the lexer state at p, its end in end, and
+// advance the state past it. p must not be at the text's terminating zero.
+
+int lexToken(const Syntax* syn, unsigned char* state, const char* p,
+             const char** end)
+{
+    const unsigned short* trans = syn->trans;
+    unsigned s = syn->start[*state];
+    unsigned last = s;
+    const char* lastEnd = p + 1;
+    for (;;)
+    {
+        unsigned e = trans[s << 8 | (unsigned char)*p++];
+        if (!e)
+            break;
+        s = e & ~LEX_ACCEPT;
+        if (e & LEX_ACCEPT)
+        {
+            last = s;
+            lastEnd = p;
+        }
+    }
+    *end = lastEnd;
+    unsigned a = syn->accept[last];
+    *state = a & 0xff;
+    return a >> 8;
+}
+
+// ----------------------------------------------------------------------------
+// Return the lexer state after the tokens starting in p..end, given the
+// state before them.
+
+int lexSpan(const Syntax* syn, const char* p, const char* end, int state)
+{
+    unsigned char s = state;
+    while (p < end && *p)
+        lexToken(syn, &s, p, &p);
+    return s;
+}
+
+// ----------------------------------------------------------------------------
+// Add a DFA state to the language being compiled, that takes no more
+// characters, and return it, or 0 if there are too many.
+
+static int newState(unsigned short accept)
+{
+    if (dStates >= MAX_DFA_STATES)
+        return 0;
+    if (dStates >= dMax)
+    {
+        dMax = dMax ? 2*dMax : 256;
+        dTrans = (unsigned short*)realloc(dTrans, (size_t)dMax * 256 *
+                                                  sizeof(*dTrans));
+        dAccept = (unsigned short*)realloc(dAccept, (size_t)dMax *
+                                                    sizeof(*dAccept));
+        dNode = (char*)realloc(dNode, (size_t)dMax);
+        if (!dTrans || !dAccept || !dNode)
+            throw new Error("out of memory");
+    }
+    memset(dTrans + dStates * 256, 0, 256 * sizeof(*dTrans));
+    dAccept[dStates] = accept;
+    dNode[dStates] = FALSE;
+    return dStates++;
+}
+
+// ----------------------------------------------------------------------------
+// Add a lexer state whose runs of plain characters are tokens of the given
+// kind, ending it with a newline for state nlNext, or staying in it if
+// that's -1.
+// Return it, or -1 if there are too many.
+
+static int newLexState(int kind, int nlNext)
+{
+    if (lexStates >= MAX_LEX_STATES || dStates + 4 > MAX_DFA_STATES)
+        return -1;
+    int ls = lexStates++;
+    if (nlNext < 0)
+        nlNext = ls;
+    int start = newState(acceptOf(kind, ls));   // only for a zero
+    int run = newState(acceptOf(kind, ls));
+    int nl = newState(acceptOf(kind, nlNext));
+    unsigned short* t = dTrans + start * 256;
+    for (int c = 1; c < 256; c++)
+        t[c] = dTrans[run * 256 + c] = run;
+    t['\n'] = nl;
+    dTrans[run * 256 + '\n'] = 0;
+    if (ls == LEX_START)
+    {
+        wordState = newState(acceptOf(TK_TEXT, LEX_START));
+        for (int c = 1; c < 256; c++)
+            if (isWordChar(c))
+            {
+                t[c] = dTrans[wordState * 256 + c] = wordState;
+                dTrans[run * 256 + c] = 0;
+            }
+    }
+    dStart[ls] = start;
+    dRun[ls] = run;
+    dEscaped[ls] = 0;
+    return ls;
+}
+
+// ----------------------------------------------------------------------------
+// Add the delimiter or keyword s of length len to the trie of lexer state
+// ls, as a token with the given accept entry. With escape, it's an escape
+// character, taking the character after it too. Return FALSE if there are
+// too many states.
+
+static bool addToken(int ls, const char* s, int len, unsigned short accept,
+                     bool escape = FALSE)
+{
+    int st = dStart[ls];
+    unsigned short fallback = dAccept[st];
+    bool word = ls == LEX_START;    // all word characters so far, in code
+    for (int i = 0; i < len; i++)
+    {
+        unsigned char c = s[i];
+        word = word && isWordChar(c);
+        int next = dTrans[st * 256 + c];
+        if (i == 0)
+            dTrans[dRun[ls] * 256 + c] = 0;     // it may start a token
+        if (!dNode[next])
+        {
+            // only the first character is a token by itself, or a word
+            next = newState(i == 0 ? fallback : word ?
+                            acceptOf(TK_TEXT, LEX_START) : LEX_NONE);
+            if (!next)
+                return FALSE;
+            dNode[next] = TRUE;
+            if (word)
+                memcpy(dTrans + next * 256, dTrans + wordState * 256,
+                       256 * sizeof(*dTrans));
+            dTrans[st * 256 + c] = next;
+        }
+        st = next;
+    }
+    dAccept[st] = accept;
+    if (escape)
+    {
+        if (!dEscaped[ls] && !(dEscaped[ls] = newState(accept)))
+            return FALSE;
+        for (int c = 1; c < 256; c++)
+            dTrans[st * 256 + c] = dEscaped[ls];
+    }
+    return TRUE;
+}
+
+// ----------------------------------------------------------------------------
+// Return the next space-separated word of a definition line at *p in len,
+// advancing *p past it, or 0 at the end of the line.
+
+static const char* nextWord(const char** p, int* len)
+{
+    const char* q = *p;
+    while (*q == ' ' || *q == '\t')
+        q++;
+    const char* w = q;
+    while (*q && *q != ' ' && *q != '\t' && *q != '\n')
+        q++;
+    *p = q;
+    *len = (int)(q - w);
+    return *len ? w : 0;
+}
+
+// ----------------------------------------------------------------------------
+// Return TRUE if word w of length len is the string s.
+
+static bool isWord(const char* w, int len, const char* s)
+{
+    return (int)strlen(s) == len && strncmp(w, s, len) == 0;
+}
+
+// ----------------------------------------------------------------------------
+// Add space n to the tables block, and return its offset.
+
+static long tablesAdd(long n)
+{
+    long offs = (tablesSize + 7) & ~7L;
+    if (offs + n > tablesMax)
+    {
+        tablesMax = 2*(offs + n);
+        tables = (char*)realloc(tables, (size_t)tablesMax);
+        if (!tables)
+            throw new Error("out of memory");
+    }
+    tablesSize = offs + n;
+    return offs;
+}
+
+// ----------------------------------------------------------------------------
+// Start compiling a language, after the "syntax" of its definition at p.
+
+static void beginLanguage(const char* p)
+{
+    memset(&lang, 0, sizeof(lang));
+    int len;
+    const char* w = nextWord(&p, &len);
+    if (w)
+        memcpy(lang.name, w, len < 15 ? len : 15);
+    char* ext = lang.exts;
+    char* extEnd = lang.exts + sizeof(lang.exts) - 2;
+    while ((w = nextWord(&p, &len)) != 0)
+        if (ext + len + 1 < extEnd)
+        {
+            *ext++ = ' ';
+            memcpy(ext, w, len);
+            ext += len;
+        }
+    if (ext > lang.exts)
+        *ext = ' ';
+    dStates = 0;
+    lexStates = 0;
+    newState(LEX_NONE);                 // 0: where a token can't go on
+    newLexState(TK_TEXT, LEX_START);    // in code
+}
+
+// ----------------------------------------------------------------------------
+// Finish compiling the current language: flag the accepting states in its
+// transitions, and add its tables to the block.
+
+static void endLanguage()
+{
+    if (!lang.name[0] || nRecs >= MAX_SYNTAXES)
+        return;
+    long n = (long)dStates * 256;
+    for (long i = 0; i < n; i++)
+        if (dTrans[i] && dAccept[dTrans[i]] != LEX_NONE)
+            dTrans[i] |= LEX_ACCEPT;
+    lang.states = dStates;
+    lang.lexStates = lexStates;
+    lang.trans = tablesAdd(n * sizeof(*dTrans));
+    memcpy(tables + lang.trans, dTrans, n * sizeof(*dTrans));
+    lang.accept = tablesAdd(dStates * sizeof(*dAccept));
+    memcpy(tables + lang.accept, dAccept, dStates * sizeof(*dAccept));
+    lang.start = tablesAdd(lexStates * sizeof(*dStart));
+    memcpy(tables + lang.start, dStart, lexStates * sizeof(*dStart));
+    recs[nRecs++] = lang;
+    lang.name[0] = 0;
+}
+
+// ----------------------------------------------------------------------------
+// Compile a line of a definition at p into the current language. Lines of
+// other kinds are ignored.
+
+static void compileLine(const char* p)
+{
+    int len, len2, len3;
+    const char* w = nextWord(&p, &len);
+    if (!w)
+        return;
+    if (isWord(w, len, "syntax"))
+    {
+        endLanguage();
+        beginLanguage(p);
+        return;
+    }
+    if (isWord(w, len, "highlight"))
+    {
+        const char* k = nextWord(&p, &len);
+        for (int kind = 0; k && kind < TK_KINDS; kind++)
+            if (isWord(k, len, kindName[kind]))
+            {
+                int attr = 0;
+                while ((w = nextWord(&p, &len)) != 0)
+                    attr |= isWord(w, len, "bold") ? AT_BOLD :
+                            isWord(w, len, "underline") ? AT_UNDERLINE :
+                            isWord(w, len, "reverse") ? AT_REVERSE : 0;
+                tokenAttr[kind] = attr;
+            }
+        return;
+    }
+    if (!lang.name[0])
+        return;
+    if (isWord(w, len, "tab"))
+        lang.tabSize = atoi(p);
+    else if (isWord(w, len, "keyword"))
+    {
+        while ((w = nextWord(&p, &len)) != 0)
+            addToken(LEX_START, w, len, acceptOf(TK_KEYWORD, LEX_START));
+    }
+    else if (isWord(w, len, "comment") || isWord(w, len, "longstring"))
+    {
+        int kind = *w == 'c' ? TK_COMMENT : TK_STRING;
+        const char* open = nextWord(&p, &len2);
+        const char* close = nextWord(&p, &len3);
+        if (!open || (!close && kind == TK_STRING))
+            return;
+        int ls = newLexState(kind, close ? -1 : LEX_START);
+        if (ls >= 0 && addToken(LEX_START, open, len2, acceptOf(kind, ls)) &&
+            close)
+            addToken(ls, close, len3, acceptOf(kind, LEX_START));
+    }
+    else if (isWord(w, len, "string"))
+    {
+        const char* quote = nextWord(&p, &len2);
+        const char* escape = nextWord(&p, &len3);
+        int ls = quote ? newLexState(TK_STRING, LEX_START) : -1;
+        if (ls >= 0 &&
+            addToken(LEX_START, quote, len2, acceptOf(TK_STRING, ls)) &&
+            addToken(ls, quote, len2, acceptOf(TK_STRING, LEX_START)) &&
+            escape)
+            addToken(ls, escape, 1, acceptOf(TK_STRING, ls), TRUE);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Compile the language definitions in the text defs into the tables block,
+// with its head filled in but for its hash.
+
+static void compileSyntax(const char* defs)
+{
+    tablesSize = 0;
+    tablesAdd(sizeof(SyntaxHead));
+    nRecs = 0;
+    lang.name[0] = 0;
+    for (const char* p = defs; *p; )
+    {
+        compileLine(p);
+        while (*p && *p != '\n')
+            p++;
+        if (*p)
+            p++;
+    }
+    endLanguage();
+    free(dTrans);
+    free(dAccept);
+    free(dNode);
+    dTrans = dAccept = 0;
+    dNode = 0;
+    dMax = 0;
+
+    long recsOffs = tablesAdd(nRecs * sizeof(SyntaxRec));
+    memcpy(tables + recsOffs, recs, nRecs * sizeof(SyntaxRec));
+    SyntaxHead* head = (SyntaxHead*)tables;
+    memset(head, 0, sizeof(*head));
+    strcpy(head->magic, SYNTAX_MAGIC);
+    head->size = tablesSize;
+    memcpy(head->attr, tokenAttr, sizeof(head->attr));
+    head->count = nRecs;
+    head->recs = recsOffs;
+}
+
+// ----------------------------------------------------------------------------
+// Return TRUE if the table of n shorts at offs lies within a block of size
+// bytes, after its head.
+
+static bool tableFits(long offs, long n, long size)
+{
+    return offs >= (long)sizeof(SyntaxHead) && offs % 2 == 0 &&
+           offs <= size && n <= (size - offs) / 2;
+}
+
+// ----------------------------------------------------------------------------
+// Return TRUE if the tables block read from a cache is sound: every table
+// lies within it, and every state in one is in range, so the lexer can't
+// be led outside them.
+
+static bool checkTables(char* block)
+{
+    SyntaxHead* head = (SyntaxHead*)block;
+    long size = head->size;
+    for (int k = 0; k < TK_KINDS; k++)
+        if (head->attr[k] & ~AT_ALL)
+            return FALSE;
+    if (head->count < 0 || head->count > MAX_SYNTAXES ||
+        head->recs < (long)sizeof(SyntaxHead) ||
+        head->recs % sizeof(long) != 0 || head->recs > size ||
+        head->count > (size - head->recs) / (long)sizeof(SyntaxRec))
+        return FALSE;
+    SyntaxRec* rec = (SyntaxRec*)(block + head->recs);
+    for (int i = 0; i < head->count; i++, rec++)
+    {
+        int states = rec->states;
+        int lexStates = rec->lexStates;
+        if (!memchr(rec->name, 0, sizeof(rec->name)) ||
+            !memchr(rec->exts, 0, sizeof(rec->exts)) ||
+            states < 1 || states > MAX_DFA_STATES ||
+            lexStates < 1 || lexStates > MAX_LEX_STATES ||
+            !tableFits(rec->trans, (long)states * 256, size) ||
+            !tableFits(rec->accept, states, size) ||
+            !tableFits(rec->start, lexStates, size))
+            return FALSE;
+        unsigned short* trans = (unsigned short*)(block + rec->trans);
+        unsigned short* accept = (unsigned short*)(block + rec->accept);
+        unsigned short* start = (unsigned short*)(block + rec->start);
+        for (int s = 0; s < states; s++)
+        {
+            unsigned a = accept[s];
+            if (a != LEX_NONE && ((a >> 8) >= TK_KINDS ||
+                                  (a & 0xff) >= (unsigned)lexStates))
+                return FALSE;
+        }
+        for (long t = 0; t < (long)states * 256; t++)
+        {
+            unsigned e = trans[t];
+            unsigned next = e & ~LEX_ACCEPT;
+            if (next >= (unsigned)states ||
+                ((e & LEX_ACCEPT) && accept[next] == LEX_NONE))
+                return FALSE;
+        }
+        for (int ls = 0; ls < lexStates; ls++)
+            if (start[ls] >= states || accept[start[ls]] == LEX_NONE)
+                return FALSE;
+    }
+    return TRUE;
+}
+
+// ----------------------------------------------------------------------------
+// Return the tables block cached in file path if it's the user's own, was
+// compiled from definitions with the given hash, and checks out, or else 0.
+
+static char* readCache(const char* path, unsigned long hash)
+{
+    int fd = open(path, O_RDONLY | O_NOFOLLOW);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    SyntaxHead head;
+    char* block = 0;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+        st.st_uid == getuid() && !(st.st_mode & (S_IWGRP | S_IWOTH)) &&
+        read(fd, &head, sizeof(head)) == (ssize_t)sizeof(head) &&
+        strncmp(head.magic, SYNTAX_MAGIC, sizeof(head.magic)) == 0 &&
+        head.hash == hash && head.size == st.st_size &&
+        (block = (char*)malloc((size_t)head.size)) != 0)
+    {
+        memcpy(block, &head, sizeof(head));
+        long rest = head.size - sizeof(head);
+        if (read(fd, block + sizeof(head), rest) != rest ||
+            !checkTables(block))
+        {
+            free(block);
+            block = 0;
+        }
+    }
+    close(fd);
+    return block;
+}
+
+// ----------------------------------------------------------------------------
+// Write the tables block to cache file path, quietly giving up on errors.
+
+static void writeCache(const char* path)
+{
+    char tmpPath[MAX_LINE+32];
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int)getpid());
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (fd < 0)
+        return;
+    bool ok = write(fd, tables, tablesSize) == tablesSize;
+    close(fd);
+    if (!ok || rename(tmpPath, path) != 0)
+        unlink(tmpPath);
+}
+
+// ----------------------------------------------------------------------------
+// Load the built-in language definitions and those in the text defs, if
+// any, from the cache if they haven't changed, or else compiled. There's no
+// cache without a home directory, and a batch run only reads it, as it may
+// be one of many at once.
+
+void loadSyntax(const char* defs)
+{
+    unsigned long hash = 14695981039346656037UL;    // FNV-1a
+    for (const char* p = builtinSyntax; *p; p++)
+        hash = (hash ^ (unsigned char)*p) * 1099511628211UL;
+    hash = (hash ^ '\n') * 1099511628211UL;
+    for (const char* p = defs; p && *p; p++)
+        hash = (hash ^ (unsigned char)*p) * 1099511628211UL;
+
+    char path[MAX_LINE+16];
+    const char* home = getenv("HOME");
+    snprintf(path, sizeof(path), "%s/.ecsyntax", home ? home : "");
+    free(tables);
+    tables = home ? readCache(path, hash) : 0;
+    if (tables)
+        memcpy(tokenAttr, ((SyntaxHead*)tables)->attr, sizeof(tokenAttr));
+    else
+    {
+        long len = strlen(builtinSyntax);
+        long defsLen = defs ? strlen(defs) : 0;
+        char* all = (char*)malloc((size_t)(len + defsLen + 2));
+        if (!all)
+            throw new Error("out of memory");
+        memcpy(all, builtinSyntax, len);
+        all[len] = '\n';
+        memcpy(all + len + 1, defs ? defs : "", defsLen + 1);
+        compileSyntax(all);
+        free(all);
+        ((SyntaxHead*)tables)->hash = hash;
+        if (home && !noTerminal)
+            writeCache(path);
+    }
+
+    SyntaxHead* head = (SyntaxHead*)tables;
+    SyntaxRec* rec = (SyntaxRec*)(tables + head->recs);
+    nSyntaxes = head->count;
+    for (int i = 0; i < nSyntaxes; i++, rec++)
+    {
+        Syntax* syn = &syntaxes[i];
+        syn->name = rec->name;
+        syn->exts = rec->exts;
+        syn->tabSize = rec->tabSize;
+        syn->trans = (unsigned short*)(tables + rec->trans);
+        syn->accept = (unsigned short*)(tables + rec->accept);
+        syn->start = (unsigned short*)(tables + rec->start);
+    }
+}
+
+// ----------------------------------------------------------------------------
+// Return the lexer for the file named fileName, by its extension or whole
+// name, or the default one if none is defined for it, or 0 if there's none.
+
+const Syntax* syntaxFor(const char* fileName)
+{
+    const char* ext = fileName ? strrchr(fileName, '.') : 0;
+    const Syntax* dflt = 0;
+    for (int i = nSyntaxes - 1; i >= 0; i--)
+    {
+        const char* exts = syntaxes[i].exts;
+        if (!*exts)
+        {
+            if (!dflt)
+                dflt = &syntaxes[i];
+            continue;
+        }
+        for (const char* p = exts; fileName && *p; )
+        {
+            int len;
+            const char* w = nextWord(&p, &len);
+            if (w && ((ext && isWord(w, len, ext)) || isWord(w, len, fileName)))
+                return &syntaxes[i];
+        }
+    }
+    return dflt;
+}
+
+// ----------------------------------------------------------------------------
+// Construct a cache knowing only the state at the start of the text.
+
+LexCache::LexCache()
+{
+    state = 0;
+    max = 0;
+    room(LEX_ROOM);
+    clear();
+}
+
+LexCache::~LexCache()
+{
+    free(state);
+}
+
+// ----------------------------------------------------------------------------
+// Make room for states of at least m lines.
+
+void LexCache::room(long m)
+{
+    if (m <= max)
+        return;
+    long newMax = 2*max > m ? 2*max : m;
+    unsigned char* newState = (unsigned char*)realloc(state, (size_t)newMax);
+    if (!newState)
+        throw new Error("out of memory");
+    state = newState;
+    max = newMax;
+}
+
+// ----------------------------------------------------------------------------
+// Forget the states of all lines but the first.
+
+void LexCache::clear()
+{
+    state[0] = LEX_START;
+    n = 1;
+    dirty = 1;
+    dirtyEnd = 0;
+}
+
+// ----------------------------------------------------------------------------
+// Forget the states of the lines after line, as the text after its start
+// was changed in ways not worth following.
+
+void LexCache::truncate(long line)
+{
+    if (line + 1 < n)
+        n = line + 1 > 1 ? line + 1 : 1;
+    if (dirty > n)
+        dirty = n;
+}
+
+// ----------------------------------------------------------------------------
+// Note that, after the start of line line, text holding removed newlines
+// was replaced with text holding added ones. The states of the lines after
+// it move with them, and are left to be checked.
+
+void LexCache::edited(long line, long removed, long added)
+{
+    long from = line + 1 + removed;     // first line after the edit, as was
+    if (from >= n)
+    {
+        truncate(line);
+        return;
+    }
+    long shift = added - removed;
+    room(n + shift);
+    memmove(state + line + 1 + added, state + from, (size_t)(n - from));
+    n += shift;
+    if (dirtyEnd >= from)
+        dirtyEnd += shift;
+    if (dirtyEnd < line + 1 + added)
+        dirtyEnd = line + 1 + added;
+    if (dirty > line + 1)
+        dirty = line + 1;
+}
+
+// ----------------------------------------------------------------------------
+// Return the lexer state at the start of line line of text, indexed by li,
+// lexing the lines before it with syn that haven't been checked since an
+// edit.
+
+int LexCache::stateOf(const Syntax* syn, LineIndex* li, const char* text,
+                      long line)
+{
+    if (line < dirty)
+        return state[line];
+    long k = dirty - 1;                 // last line known to be right
+    const char* p = textAt(text, li->startOf(text, k));
+    unsigned char s = state[k];
+    while (k < line)
+    {
+        const char* eol = findLineEnd(p);
+        if (!*eol)
+            break;                      // no such line
+        s = lexSpan(syn, p, eol + 1, s);
+        p = lineAfter(eol);
+        k++;
+        if (k < n && k >= dirtyEnd && state[k] == s)
+        {
+            dirty = n;                  // the rest are as they were
+            dirtyEnd = 0;
+            if (line < n)
+                return state[line];
+            k = n - 1;
+            p = textAt(text, li->startOf(text, k));
+            s = state[k];
+            continue;
+        }
+        room(k + 1);
+        state[k] = s;
+        if (n <= k)
+            n = k + 1;
+        dirty = k + 1;
+    }
+    return s;
+}
@@ -0,0 +1,444 @@
+// ****************************************************************************
+// ecundo.cc  Macro Screen Editor undo journal
+//
+// Copyright (C) 2023 Scott Forbes
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+// ****************************************************************************
+//
+// Each edit is told to the journal before it is made, as the offset, the
+// text it removes, and the length it inserts. Rather than logging every
+// edit, the edits of a step (a command, a run of typing, or a whole macro)
+// are composed into a sorted list of the spans of text the step changed,
+// so a run of keystrokes is one span, and a global replace is one span per
+// match. Only the removed text is copied, into an arena shared by all of
+// the spans; the inserted text is only copied out of the buffer when the
+// step is first undone. Undo and redo then splice every span of a step in
+// a single pass over the buffer, so their cost is the size of the edits
+// plus one move of the text, and the buffer is never copied whole.
+//
+// A step with a great many spans is split into joined segments, so that
+// an edit out of order doesn't have to shift a huge span list. When the
+// journal grows past undoMem the oldest steps are dropped.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ec.h"
+
+#define SEG_MAX     4096        // spans in a segment before edits out of
+                                //   order start a new one
+#define COMPACT_MIN 65536       // dead arena text worth compacting
+
+long    undoMem = 16*1024*1024; // most memory a buffer's journal may use
+
+// ----------------------------------------------------------------------------
+// Make an empty journal.
+
+UndoLog::UndoLog()
+{
+    spans = 0;
+    nSpans = maxSpans = 0;
+    segs = 0;
+    nSegs = maxSegs = nDone = 0;
+    arena = 0;
+    arenaLen = arenaMax = arenaLive = 0;
+    open = FALSE;
+    lost = FALSE;
+    kind = UK_OTHER;
+}
+
+UndoLog::~UndoLog()
+{
+    free(spans);
+    free(segs);
+    free(arena);
+}
+
+// ----------------------------------------------------------------------------
+// Forget all edits, as when a file is opened.
+
+void UndoLog::clear()
+{
+    nSpans = 0;
+    nSegs = nDone = 0;
+    arenaLen = arenaLive = 0;
+    open = FALSE;
+    lost = FALSE;
+}
+
+// ----------------------------------------------------------------------------
+// Make room for n more bytes at the end of the arena.
+
+void UndoLog::reserve(long n)
+{
+    if (arenaLen + n <= arenaMax)
+        return;
+    long newMax = arenaMax * 2;
+    if (newMax < arenaLen + n)
+        newMax = arenaLen + n + 1024;
+    char* newArena = (char*)realloc(arena, (size_t)newMax);
+    if (!newArena)
+        throw new Error("out of memory for undo");
+    arena = newArena;
+    arenaMax = newMax;
+}
+
+// ----------------------------------------------------------------------------
+// Count the arena text of span s as dead.
+
+void UndoLog::dropSpanText(const UndoSpan* s)
+{
+    arenaLive -= s->oldLen;
+    if (s->newAt >= 0)
+        arenaLive -= s->newLen;
+}
+
+// ----------------------------------------------------------------------------
+// Drop the undone segments: a new edit replaces them.
+
+void UndoLog::dropRedo()
+{
+    if (nDone == nSegs)
+        return;
+    long first = segs[nDone].first;
+    for (long i = first; i < nSpans; i++)
+        dropSpanText(&spans[i]);
+    nSpans = first;
+    nSegs = nDone;
+}
+
+// ----------------------------------------------------------------------------
+// Start a new segment, undone along with the one before it if join.
+
+void UndoLog::addSeg(bool join)
+{
+    if (nSegs == maxSegs)
+    {
+        int newMax = maxSegs ? 2*maxSegs : 64;
+        UndoSeg* newSegs = (UndoSeg*)realloc(segs, newMax * sizeof(UndoSeg));
+        if (!newSegs)
+            throw new Error("out of memory for undo");
+        segs = newSegs;
+        maxSegs = newMax;
+    }
+    segs[nSegs].first = nSpans;
+    segs[nSegs].nSpans = 0;
+    segs[nSegs].join = join;
+    nSegs++;
+    nDone = nSegs;
+    open = TRUE;
+}
+
+// ----------------------------------------------------------------------------
+// Start a new undo step before a command of the given kind, unless it
+// continues a run of typing or deleting.
+
+void UndoLog::step(int newKind)
+{
+    if (!open || newKind != kind || newKind == UK_OTHER)
+    {
+        open = FALSE;
+        lost = FALSE;
+    }
+    kind = newKind;
+}
+
+// ----------------------------------------------------------------------------
+// Note an edit about to be made to the buffer: remLen characters at offs,
+// which are at removed, are to be replaced with insLen new ones.
+
+void UndoLog::edit(long offs, const char* removed, long remLen, long insLen)
+{
+    if (lost || (remLen == 0 && insLen == 0))
+        return;
+    dropRedo();
+    if (!open)
+        addSeg(FALSE);
+
+    // find the spans the edit touches: [lo, last)
+    long end = offs + remLen;
+    UndoSpan* s = spans + segs[nSegs-1].first;
+    long n = segs[nSegs-1].nSpans;
+    long lo = 0, hi = n;
+    while (lo < hi)
+    {
+        long mid = (lo + hi) / 2;
+        if (s[mid].start + s[mid].newLen < offs)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    long last = lo;
+    while (last < n && s[last].start <= end)
+        last++;
+    if (last < n && n >= SEG_MAX)
+    {
+        addSeg(TRUE);
+        s = spans + nSpans;
+        n = lo = last = 0;
+    }
+
+    // the merged span covers from..to of the text before this edit; its old
+    // text is that of the spans it takes in, with removed text between them
+    long from = offs, to = end;
+    if (last > lo)
+    {
+        if (s[lo].start < from)
+            from = s[lo].start;
+        if (s[last-1].start + s[last-1].newLen > to)
+            to = s[last-1].start + s[last-1].newLen;
+    }
+    long oldLen = 0;
+    bool gaps = FALSE;
+    long pos = from;
+    for (long i = lo; i < last; i++)
+    {
+        if (s[i].start > pos)
+            gaps = TRUE;
+        oldLen += s[i].start - pos + s[i].oldLen;
+        pos = s[i].start + s[i].newLen;
+    }
+    oldLen += to - pos;
+
+    long oldAt;
+    if (last - lo == 1 && !gaps && (to == pos ||
+        s[lo].oldAt + s[lo].oldLen == arenaLen))
+    {                                   // reuse its text, adding any tail
+        oldAt = s[lo].oldAt;
+        reserve(to - pos);
+        memcpy(arena + arenaLen, removed + (pos - offs), (size_t)(to - pos));
+        arenaLen += to - pos;
+        arenaLive += to - pos;
+    }
+    else
+    {
+        reserve(oldLen);
+        oldAt = arenaLen;
+        char* dst = arena + arenaLen;
+        pos = from;
+        for (long i = lo; i < last; i++)
+        {
+            memcpy(dst, removed + (pos - offs), (size_t)(s[i].start - pos));
+            dst += s[i].start - pos;
+            memcpy(dst, arena + s[i].oldAt, (size_t)s[i].oldLen);
+            dst += s[i].oldLen;
+            dropSpanText(&s[i]);
+            pos = s[i].start + s[i].newLen;
+        }
+        memcpy(dst, removed + (pos - offs), (size_t)(to - pos));
+        arenaLen += oldLen;
+        arenaLive += oldLen;
+    }
+    long newLen = to - from - remLen + insLen;
+
+    // replace spans lo..last with the merged one, unless it came to nothing
+    long keep = (newLen || oldLen) ? 1 : 0;
+    long grow = keep - (last - lo);
+    if (nSpans + grow > maxSpans)
+    {
+        long newMax = maxSpans ? 2*maxSpans : 256;
+        long at = s - spans;
+        UndoSpan* newSpans = (UndoSpan*)realloc(spans,
+                                                newMax * sizeof(UndoSpan));
+        if (!newSpans)
+            throw new Error("out of memory for undo");
+        spans = newSpans;
+        maxSpans = newMax;
+        s = spans + at;
+    }
+    memmove(&s[last + grow], &s[last], (n - last) * sizeof(UndoSpan));
+    if (keep)
+    {
+        s[lo].start = from;
+        s[lo].newLen = newLen;
+        s[lo].oldLen = oldLen;
+        s[lo].oldAt = oldAt;
+        s[lo].newAt = -1;
+    }
+    else
+        arenaLive -= oldLen;
+    nSpans += grow;
+    n += grow;
+    segs[nSegs-1].nSpans = n;
+    for (long i = lo + keep; i < n; i++)
+        s[i].start += insLen - remLen;
+    evict();
+}
+
+// ----------------------------------------------------------------------------
+// Drop the oldest steps if the journal has outgrown undoMem, down to 3/4 of
+// it. If that takes the step in progress, the rest of its edits are
+// ignored.
+
+void UndoLog::evict()
+{
+    long cap = undoMem;
+    long size = arenaLive + nSpans * (long)sizeof(UndoSpan);
+    if (size > cap)
+    {
+        int k = 0;
+        long drop = 0;
+        while (k < nSegs && size - drop > cap / 4 * 3)
+        {
+            do                          // whole steps only
+            {
+                for (long i = 0; i < segs[k].nSpans; i++)
+                {
+                    UndoSpan* s = &spans[segs[k].first + i];
+                    drop += s->oldLen + (long)sizeof(UndoSpan);
+                    if (s->newAt >= 0)
+                        drop += s->newLen;
+                }
+                k++;
+            } while (k < nSegs && segs[k].join);
+        }
+        long first = k < nSegs ? segs[k].first : nSpans;
+        for (long i = 0; i < first; i++)
+            dropSpanText(&spans[i]);
+        memmove(spans, spans + first, (nSpans - first) * sizeof(UndoSpan));
+        nSpans -= first;
+        memmove(segs, segs + k, (nSegs - k) * sizeof(UndoSeg));
+        nSegs -= k;
+        for (int g = 0; g < nSegs; g++)
+            segs[g].first -= first;
+        nDone = nDone > k ? nDone - k : 0;
+        if (nSegs == 0 && open)
+        {
+            open = FALSE;
+            lost = TRUE;
+        }
+    }
+    if (arenaLen - arenaLive > COMPACT_MIN && arenaLen - arenaLive > arenaLive)
+        compact();
+}
+
+// ----------------------------------------------------------------------------
+// Copy the live text of the arena into a new one, dropping the dead text.
+
+void UndoLog::compact()
+{
+    char* newArena = (char*)malloc((size_t)arenaLive + 1024);
+    if (!newArena)
+        return;
+    long len = 0;
+    for (long i = 0; i < nSpans; i++)
+    {
+        UndoSpan* s = &spans[i];
+        memcpy(newArena + len, arena + s->oldAt, (size_t)s->oldLen);
+        s->oldAt = len;
+        len += s->oldLen;
+        if (s->newAt >= 0)
+        {
+            memcpy(newArena + len, arena + s->newAt, (size_t)s->newLen);
+            s->newAt = len;
+            len += s->newLen;
+        }
+    }
+    free(arena);
+    arena = newArena;
+    arenaLen = arenaLive = len;
+    arenaMax = arenaLive + 1024;
+}
+
+// ----------------------------------------------------------------------------
+// Splice segment g out of the current buffer if back, else into it.
+
+void UndoLog::splice(int g, bool back)
+{
+    UndoSpan* s = spans + segs[g].first;
+    long n = segs[g].nSpans;
+    if (n == 0)
+        return;
+    if (back)                           // keep the text after, for redo
+    {
+        long need = 0;
+        for (long i = 0; i < n; i++)
+            if (s[i].newAt < 0)
+                need += s[i].newLen;
+        reserve(need);
+        for (long i = 0; i < n; i++)
+            if (s[i].newAt < 0)
+            {
+                memcpy(arena + arenaLen, bstart + s[i].start,
+                       (size_t)s[i].newLen);
+                s[i].newAt = arenaLen;
+                arenaLen += s[i].newLen;
+                arenaLive += s[i].newLen;
+            }
+    }
+
+    Splice* sp = (Splice*)malloc(n * sizeof(Splice));
+    if (!sp)
+        throw new Error("out of memory");
+    long d = 0;                         // growth of the spans before, on redo
+    for (long i = 0; i < n; i++)
+    {
+        if (back)
+        {
+            sp[i].offs = s[i].start;
+            sp[i].len = s[i].newLen;
+            sp[i].text = arena + s[i].oldAt;
+            sp[i].textLen = s[i].oldLen;
+        }
+        else
+        {
+            sp[i].offs = s[i].start - d;
+            sp[i].len = s[i].oldLen;
+            sp[i].text = arena + s[i].newAt;
+            sp[i].textLen = s[i].newLen;
+            d += s[i].newLen - s[i].oldLen;
+        }
+    }
+    spliceText(sp, n);
+    free(sp);
+}
+
+// ----------------------------------------------------------------------------
+// Undo the last step done in the current buffer. Returns FALSE if there is
+// none.
+
+bool UndoLog::undo()
+{
+    open = FALSE;
+    if (nDone == 0)
+        return FALSE;
+    int first = nDone - 1;
+    while (first > 0 && segs[first].join)
+        first--;
+    for (int g = nDone - 1; g >= first; g--)
+        splice(g, TRUE);
+    if (segs[first].nSpans)
+        bcursPos = bstart + spans[segs[first].first].start;
+    nDone = first;
+    return TRUE;
+}
+
+// ----------------------------------------------------------------------------
+// Redo the last step undone. Returns FALSE if there is none.
+
+bool UndoLog::redo()
+{
+    open = FALSE;
+    if (nDone == nSegs)
+        return FALSE;
+    int g = nDone;
+    do
+    {
+        splice(g, FALSE);
+        if (g == nDone && segs[g].nSpans)   // later segments move it along
+            bcursPos = bstart + spans[segs[g].first].start;
+        g++;
+    } while (g < nSegs && segs[g].join);
+    nDone = g;
+    return TRUE;
+}
@@ -14,12 +14,50 @@
 // GNU General Public License for more details.
 // ****************************************************************************
 
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
 
 #include "termp.h"
+#include "ec.h"
 
 char            keyInited;
 
+// Input is read into keyBuf, as much as is available per read() call, and
+// taken from there a key at a time. waitKey() blocks in poll() on the
+// terminal and on a self-pipe that the SIGWINCH handler writes to, so a
+// resize is handled between keys rather than inside the signal.
+// Text the terminal brackets as a paste is collected into pasteText.
+
+#define KEYBUF_SIZE 4096
+#define MAX_TIMERS  4
+#define PASTE_WAIT  1000                // most ms between parts of a paste
+
+static const char pasteStart[] = "\033[200~";
+static const char pasteEnd[] = "\033[201~";
+const int       pasteMarkLen = 6;
+
+char*           pasteText;              // last bracketed paste
+long            pasteLen;
+static long     pasteSize;              // allocated size of pasteText
+
+static unsigned char keyBuf[KEYBUF_SIZE];
+static int      keyHead, keyTail;       // unread input is keyBuf[head..tail)
+static int      wakePipe[2] = { -1, -1 }; // written to by signal handler
+static void     (*resizeFunc)();        // called after a SIGWINCH
+
+typedef struct                          // one-shot timer
+{
+    void        (*func)();
+    struct timespec due;
+} Timer;
+
+static Timer    timers[MAX_TIMERS];
+
 // ----------------------------------------------------------------------------
 // Initialize terminal-dependent variables, based on TERM setting.
 
@@ -37,16 +75,15 @@ void initTerm(termOptStr* termSave)
     n_termio.c_iflag = ISTRIP;          // no parity, etc.
     n_termio.c_oflag = 0;               // no output postprocessing
     n_termio.c_lflag = 0;               // non-cannonical input
-    n_termio.c_cc[VMIN] = 1;            // getc: chars to read
-    n_termio.c_cc[VTIME] = 1;           // getc: timeout in .1 sec incr
+    n_termio.c_cc[VMIN] = 1;            // read: chars to read
+    n_termio.c_cc[VTIME] = 0;           // read: no timeout
 #ifdef TERMIOS
     tcsetattr(0, TCSANOW, &n_termio);       // set new term options
 #else
     ioctl(0, MY_TCSETAF, &n_termio);        // set new term options
 #endif
     termSave->flags = fcntl(0, F_GETFL, 0);
-    fcntl(0, F_SETFL, termSave->flags | O_NDELAY); // set stdin for no delay
-    keyInited = FALSE;                  // (returns -1 if no key)
+    keyInited = FALSE;
 }
 
 // ----------------------------------------------------------------------------
@@ -54,6 +91,8 @@ void initTerm(termOptStr* termSave)
 
 void restoreTerm(termOptStr* termSave)
 {
+    outStr("\033[?2004l");             // bracketed paste off
+    outFlush();
     fcntl(0, F_SETFL, termSave->flags);
 #ifdef TERMIOS
     tcsetattr(0, TCSANOW, &termSave->o_termio); // restore old term options
@@ -62,45 +101,314 @@ void restoreTerm(termOptStr* termSave)
 #endif
 }
 
+// ----------------------------------------------------------------------------
+// SIGWINCH handler: just wake up the event loop.
+
+static void resizeSignal(int sig)
+{
+    int saveErrno = errno;
+    char c = 0;
+    if (write(wakePipe[1], &c, 1) < 0)
+        ;                               // pipe full: a wakeup is pending
+    errno = saveErrno;
+}
+
+// ----------------------------------------------------------------------------
+// Call func from the event loop whenever the screen is resized.
+
+void watchResize(void (*func)())
+{
+    if (pipe(wakePipe) < 0)
+        return;
+    for (int i = 0; i < 2; i++)
+    {
+        fcntl(wakePipe[i], F_SETFL, fcntl(wakePipe[i], F_GETFL, 0) | O_NONBLOCK);
+        fcntl(wakePipe[i], F_SETFD, FD_CLOEXEC);
+    }
+    resizeFunc = func;
+
+    struct sigaction resizeSA;
+    resizeSA.sa_handler = resizeSignal;
+    sigemptyset(&resizeSA.sa_mask);
+    resizeSA.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &resizeSA, 0);
+}
+
+// ----------------------------------------------------------------------------
+// Arm a one-shot timer to call func after ms milliseconds, from the event
+// loop. A timer already set for func is moved to the new time.
+
+void addTimer(int ms, void (*func)())
+{
+    Timer* t = 0;
+    for (int i = 0; i < MAX_TIMERS; i++)
+        if (timers[i].func == func || (!t && !timers[i].func))
+            t = &timers[i];
+    if (!t)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &t->due);
+    t->due.tv_sec += ms / 1000;
+    t->due.tv_nsec += (ms % 1000) * 1000000L;
+    if (t->due.tv_nsec >= 1000000000L)
+    {
+        t->due.tv_sec++;
+        t->due.tv_nsec -= 1000000000L;
+    }
+    t->func = func;
+}
+
+// ----------------------------------------------------------------------------
+// Cancel the timer for func, if any.
+
+void cancelTimer(void (*func)())
+{
+    for (int i = 0; i < MAX_TIMERS; i++)
+        if (timers[i].func == func)
+            timers[i].func = 0;
+}
+
+// ----------------------------------------------------------------------------
+// Run any timers that are due. Returns ms until the next one, or -1 if none.
+
+static int runTimers()
+{
+    int wait = -1;
+    for (int i = 0; i < MAX_TIMERS; i++)
+    {
+        if (!timers[i].func)
+            continue;
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long ms = (timers[i].due.tv_sec - now.tv_sec) * 1000 +
+                  (timers[i].due.tv_nsec - now.tv_nsec) / 1000000;
+        if (ms <= 0)
+        {
+            void (*func)() = timers[i].func;
+            timers[i].func = 0;
+            func();
+            i = -1;                     // func may have changed the timers
+            wait = -1;
+        }
+        else if (wait < 0 || ms < wait)
+            wait = ms;
+    }
+    return wait;
+}
+
+// ----------------------------------------------------------------------------
+// Wait up to timeout ms (-1: forever) for input or a resize, and read all of
+// the input that is available. Returns FALSE if the wait timed out.
+
+static bool pollInput(int timeout)
+{
+    struct pollfd fds[2];
+    fds[0].fd = 0;
+    fds[0].events = POLLIN;
+    fds[1].fd = wakePipe[0];
+    fds[1].events = POLLIN;
+    int n = poll(fds, wakePipe[0] >= 0 ? 2 : 1, timeout);
+    if (n <= 0)
+        return FALSE;
+
+    if (wakePipe[0] >= 0 && (fds[1].revents & POLLIN))
+    {
+        char drain[16];
+        while (read(wakePipe[0], drain, sizeof(drain)) > 0)
+            ;
+        if (resizeFunc)
+            resizeFunc();
+    }
+    if ((fds[0].revents & (POLLIN | POLLHUP | POLLERR)) &&
+        keyTail - keyHead < KEYBUF_SIZE)
+    {
+        if (keyHead > 0)                // move unread input to the front
+        {
+            memmove(keyBuf, keyBuf + keyHead, (size_t)(keyTail - keyHead));
+            keyTail -= keyHead;
+            keyHead = 0;
+        }
+        int nIn = read(0, keyBuf + keyTail, KEYBUF_SIZE - keyTail);
+        if (nIn == 0 || (nIn < 0 && errno != EINTR && errno != EAGAIN))
+        {
+            outFlush();                 // terminal is gone
+            exit(1);
+        }
+        if (nIn > 0)
+            keyTail += nIn;
+    }
+    return TRUE;
+}
+
+// ----------------------------------------------------------------------------
+// Return the length of the part of mark at the head of the input buffer: all
+// of it, the part up to the end of input, or 0 if it isn't there.
+
+static int markAtHead(const char* mark)
+{
+    int n = 0;
+    while (n < pasteMarkLen && keyHead + n < keyTail &&
+           keyBuf[keyHead + n] == (unsigned char)mark[n])
+        n++;
+    return (n == pasteMarkLen || keyHead + n == keyTail) ? n : 0;
+}
+
+// ----------------------------------------------------------------------------
+// Collect the paste that starts at the head of the input buffer into
+// pasteText, with its line endings made '\n'.
+
+static void collectPaste()
+{
+    keyHead += pasteMarkLen;
+    pasteLen = 0;
+    long found = -1;
+    while (found < 0)
+    {
+        long n = keyTail - keyHead;
+        if (pasteLen + n > pasteSize)
+        {
+            long size = 2*pasteSize > pasteLen + n ? 2*pasteSize :
+                        pasteLen + n + KEYBUF_SIZE;
+            char* p = (char*)realloc(pasteText, (size_t)size);
+            if (!p)
+                break;
+            pasteText = p;
+            pasteSize = size;
+        }
+        memcpy(pasteText + pasteLen, keyBuf + keyHead, (size_t)n);
+        keyHead = keyTail;
+        long from = pasteLen > pasteMarkLen ? pasteLen - pasteMarkLen : 0;
+        pasteLen += n;
+        for (long i = from; i + pasteMarkLen <= pasteLen; i++)
+            if (memcmp(pasteText + i, pasteEnd, pasteMarkLen) == 0)
+            {
+                found = i;
+                break;
+            }
+        if (found < 0 && !pollInput(PASTE_WAIT))
+            break;                      // end mark lost: take what came
+    }
+
+    if (found >= 0)                     // return what followed the paste
+    {
+        long rest = pasteLen - found - pasteMarkLen;
+        memcpy(keyBuf, pasteText + found + pasteMarkLen, (size_t)rest);
+        keyHead = 0;
+        keyTail = rest;
+        pasteLen = found;
+    }
+
+    char* d = pasteText;
+    for (long i = 0; i < pasteLen; i++)
+    {
+        char c = pasteText[i];
+        if (c == '\r')
+        {
+            if (i + 1 < pasteLen && pasteText[i+1] == '\n')
+                continue;
+            c = '\n';
+        }
+        *d++ = c;
+    }
+    pasteLen = d - pasteText;
+}
+
+// ----------------------------------------------------------------------------
+// Take the next key from the input buffer, if any. A paste becomes one
+// PASTE_KEY if allowed, and otherwise just its characters.
+
+static void takeKey(signed char* key, bool pasteOK = FALSE)
+{
+    while (*key <= 0 && keyHead < keyTail)
+    {
+        if (keyBuf[keyHead] == 033 && keyTail - keyHead > 1)
+        {
+            int n = markAtHead(pasteStart);
+            if (n > 0 && n < pasteMarkLen && pollInput(PASTE_WAIT))
+                continue;               // wait for the rest of the mark
+            if (n == pasteMarkLen)
+            {
+                if (pasteOK)
+                {
+                    collectPaste();
+                    *key = PASTE_KEY;
+                    return;
+                }
+                keyHead += n;
+                continue;
+            }
+            if (markAtHead(pasteEnd) == pasteMarkLen)
+            {
+                keyHead += pasteMarkLen;
+                continue;
+            }
+        }
+        *key = keyBuf[keyHead++];
+    }
+}
+
 // ----------------------------------------------------------------------------
 // Check if a key is pressed, and get it if so.
 
 void checkKey(signed char* key)
 {
-    if (*key <= 0 && keyInited)
-        *key = getchar();
+    if (*key > 0 || !keyInited)
+        return;
+    if (keyHead == keyTail)
+        pollInput(0);
+    takeKey(key);
 }
 
 // ----------------------------------------------------------------------------
-// Wait for a key to be pressed if not already gotten.
+// Return TRUE if ESC has been typed, dropping the input up to and including
+// it. Other keys are left waiting, and an ESC that starts an escape
+// sequence doesn't count.
 
-void waitKey(signed char* key)
+bool escapeTyped()
 {
-    TERMIO  o_termio;
-#ifdef TERMIOS
-    tcgetattr(0, &o_termio);            // save current terminal options
-#else
-    ioctl(0, MY_TCGETA, &o_termio);     // save current terminal options
-#endif
-    TERMIO  n_termio;
-    n_termio = o_termio;                // get a copy of terminal options
-    n_termio.c_cc[VTIME] = 0;           // set no timeout
-#ifdef TERMIOS
-    tcsetattr(0, TCSANOW, &n_termio);   // set new term options
-#else
-    ioctl(0, MY_TCSETAF, &n_termio);    // set new term options
-#endif
-    int flags = fcntl(0, F_GETFL, 0);
-    fcntl(0, F_SETFL, flags & ~O_NDELAY);  // set stdin for delay
+    if (!keyInited)
+        return FALSE;
+    pollInput(0);
+    for (int i = keyHead; i < keyTail; i++)
+        if (keyBuf[i] == 033 && (i + 1 == keyTail ||
+                                 (keyBuf[i+1] != '[' && keyBuf[i+1] != 'O')))
+        {
+            keyHead = i + 1;
+            return TRUE;
+        }
+    return FALSE;
+}
 
-    while (*key <= 0)
-        *key = getchar();
-    keyInited = TRUE;
+// ----------------------------------------------------------------------------
+// Return TRUE if a key is waiting, without taking it.
 
-#ifdef TERMIOS
-    tcsetattr(0, TCSANOW, &o_termio);   // restore term options
-#else
-    ioctl(0, MY_TCSETAF, &o_termio);    // restore term options
-#endif
-    fcntl(0, F_SETFL, flags);
+bool keyReady()
+{
+    if (!keyInited)
+        return FALSE;
+    if (keyHead == keyTail)
+        pollInput(0);
+    return keyHead < keyTail;
+}
+
+// ----------------------------------------------------------------------------
+// Wait for a key to be pressed if not already gotten, running timers and
+// resize handling while waiting. If pasteOK, a bracketed paste is returned
+// as PASTE_KEY, with the text in pasteText.
+
+void waitKey(signed char* key, bool pasteOK)
+{
+    if (noTerminal)
+        throw new Error("no terminal to read a key from");
+    outFrame();                         // send the finished screen
+    takeKey(key, pasteOK);
+    while (*key <= 0 && *key != PASTE_KEY)
+    {
+        if (!pollInput(runTimers()) || keyHead == keyTail)
+        {
+            outFrame();                 // a timer or resize may have drawn
+            continue;
+        }
+        takeKey(key, pasteOK);
+    }
+    keyInited = TRUE;
 }
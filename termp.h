@@ -42,7 +42,7 @@ typedef struct termio TERMIO;
 #include <term.h>
 #include <fcntl.h>
 
-#define putChar(ch)         putchar(ch)
+#define putChar(ch)         outChar(ch)
 #ifdef SV3              // Unix 5.3 using terminfo:
     extern int tputc();     // fast putchar()
 #else                   // other Unixes using termcaps:
@@ -73,10 +73,15 @@ extern char tcapbuf[];          // buffer for extracted termcap strings
     extern char*    ME;         // end bold,etc. modes string pointer
     extern char*    AF;         // set ANSI foreground color
     extern char*    AB;         // set ANSI background color
+    extern char*    CS;         // set scroll region
+    extern char*    SF;         // scroll up a line
+    extern char*    SR;         // scroll down a line
+    extern char*    AL;         // insert a line
+    extern char*    DL;         // delete a line
     extern int CLlength;        // clear screen string length
     extern int CElength;        // clear to end-of-line string length
 extern "C" { int tputc(tputc_t ch); }   // fast putchar()
-inline void gotoxy(int col, int row) { tputs(tgoto(CM, col, row), 1, tputc); }
+void gotoxy(int col, int row);
 #define clearLine()         tputs(CE, 1, tputc)
 #define clearScreen()       tputs(CL, 1, tputc)
 #define boldMode()          tputs(MD, 1, tputc)
@@ -105,6 +110,22 @@ inline void gotoxy(int col, int row) { tputs(tgoto(CM, col, row), 1, tputc); }
 #define BLACK   7
 
 #define NO_KEY      -1      // used by checkKey(), waitKey()
+#define PASTE_KEY   -2      // waitKey(): a paste is in pasteText
+
+typedef struct          // terminal output counters
+{
+    long        bytes;          // bytes written
+    long        writes;         // write() calls
+    long        frames;         // screen updates completed
+    long        frameBytes;     // bytes in the last frame
+    long        frameWrites;    // write() calls in the last frame
+    long        sgrMerged;      // SGR sequences merged into the one before
+    long        movesCached;    // cursor motions sent from the cache
+    long        sgrDropped;     // SGR resets not sent, being reset already
+    long        movesDropped;   // cursor motions not sent, being there already
+} OutStats;
+
+extern OutStats outStats;
 
 struct termOptStr       // saved terminal settings
 {
@@ -113,13 +134,28 @@ struct termOptStr       // saved terminal settings
 };
 
 extern char     keyInited;
+extern char*    pasteText;          // last bracketed paste
+extern long     pasteLen;
 extern int screenHt, screenWd;      // screen dimensions
+extern bool     noTerminal;         // TRUE if running without a screen
 
 void iTermCaps (termOptStr* termSave);  // initialize full terminal emulation
+void iNullTerm ();                      // initialize for no terminal
 void initTerm (termOptStr* termSave);   // initialize for checkKey
 void restoreTerm (termOptStr* termSave); // conclude terminal emulation
 void checkKey (signed char* key);               // check key pressed: defd in key.c
-void waitKey (signed char* key);                // wait for key: defined in key.c
+void waitKey (signed char* key, bool pasteOK = FALSE); // wait for key
+bool keyReady ();                               // TRUE if a key is waiting
+bool escapeTyped ();                            // TRUE if ESC was typed
+void watchResize (void (*func)());              // call func on SIGWINCH
+void addTimer (int ms, void (*func)());         // call func after ms
+void cancelTimer (void (*func)());
 void getScreenSize();
+void outChar (int ch);                  // buffered terminal output
+void outStr (const char* s);
+void outFlush ();                       // write out buffered output
+void outFrame ();                       // flush and count a finished frame
+bool scrollRows (int top, int bot, int n); // scroll part of the screen
+void cursorAt (int* col, int* row);     // where gotoxy() last went
 
 #endif // termp_h_
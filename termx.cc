@@ -18,6 +18,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <errno.h>
 
 #include "termp.h"
 #include "ec.h"
@@ -36,6 +37,11 @@ char*           US;                     // underline mode string pointer
 char*           ME;                     // end bold,etc. modes string pointer
 char*           AF;                     // set ANSI foreground color
 char*           AB;                     // set ANSI background color
+char*           CS;                     // set scroll region
+char*           SF;                     // scroll up a line (at bottom)
+char*           SR;                     // scroll down a line (at top)
+char*           AL;                     // insert a line
+char*           DL;                     // delete a line
 int             CLlength;               // clear screen string length
 int             CElength;               // clear to end-of-line string length
 
@@ -50,9 +56,45 @@ char            myUnder[20];
 char            myNorm[20];
 char            myAF[20];
 char            myAB[20];
+char            myCsr[40];
+char            mySf[20];
+char            mySr[20];
+char            myIl[20];
+char            myDl[20];
 #endif
 
 int             screenHt, screenWd;     // screen dimensions
+bool            noTerminal;             // TRUE if output is dropped
+
+// Screen output is collected in outBuf and written with one write() per
+// frame. An SGR (attribute) sequence that directly follows another is merged
+// into it, and formatted cursor motions are kept in a small cache. What the
+// output has done to the terminal is followed, so that a reset of attributes
+// that are reset already, or a motion to where the cursor is, isn't sent.
+
+#define OUT_MAX     65536       // output buffer size
+#define OUT_SLACK   64          // room kept free for one escape sequence
+#define MOVE_CACHE  4096        // cursor-motion cache entries
+
+typedef struct
+{
+    short           row, col;
+    char            len;                // length of s, 0 if unused
+    char            s[11];
+} MoveStr;
+
+static char     outBuf[OUT_MAX];
+static int      outLen;
+static int      escStart = -1;          // start of escape sequence being sent
+static int      sgrStart = -1;          // last SGR sequence in outBuf
+static int      sgrEnd = -1;
+static int      moveStart = -1;         // last cursor motion in outBuf
+static int      moveEnd = -1;
+static bool     sgrReset;               // TRUE if attributes were last reset
+static bool     cursorKnown;            // TRUE if cursor is where gotoxy() put it
+static long     frameBytes, frameWrites; // counts at start of frame
+static MoveStr  moveCache[MOVE_CACHE];
+OutStats        outStats;
 
 // ----------------------------------------------------------------------------
 // Get (new) screen dimensions to screenHt, screenWd.
@@ -108,6 +150,11 @@ void iTermCaps(termOptStr* termSave)
     ME = tgetstr((char*)"me", &ptr);
     AF = tgetstr((char*)"setaf", &ptr);
     AB = tgetstr((char*)"setab", &ptr);
+    CS = tgetstr((char*)"cs", &ptr);
+    SF = tgetstr((char*)"sf", &ptr);
+    SR = tgetstr((char*)"sr", &ptr);
+    AL = tgetstr((char*)"al", &ptr);
+    DL = tgetstr((char*)"dl", &ptr);
     screenHt = tgetnum((char*)"li");
     screenWd = tgetnum((char*)"co");
 
@@ -131,6 +178,16 @@ void iTermCaps(termOptStr* termSave)
     strcpy(myNorm, exix_attribute_mode);
     strcpy(myAF, set_a_foreground);
     strcpy(myAB, set_a_background);
+    if (change_scroll_region)           // scrolling is optional
+        strcpy(myCsr, change_scroll_region);
+    if (scroll_forward)
+        strcpy(mySf, scroll_forward);
+    if (scroll_reverse)
+        strcpy(mySr, scroll_reverse);
+    if (insert_line)
+        strcpy(myIl, insert_line);
+    if (delete_line)
+        strcpy(myDl, delete_line);
     reset_shell_mode();                 // and restore term
 #endif
 
@@ -150,16 +207,165 @@ void iTermCaps(termOptStr* termSave)
     n_termio.c_iflag = ISTRIP;          // no parity, etc.
     n_termio.c_oflag = 0;               // no output postprocessing
     n_termio.c_lflag = 0;               // non-cannonical input
-    n_termio.c_cc[VMIN] = 1;            // getc: chars to read
-    n_termio.c_cc[VTIME] = 1;           // getc: timeout in .1 sec incr
+    n_termio.c_cc[VMIN] = 1;            // read: chars to read
+    n_termio.c_cc[VTIME] = 0;           // read: no timeout
 #ifdef TERMIOS
     tcsetattr(0, TCSANOW, &n_termio);   // set new term options
 #else
     ioctl(0, MY_TCSETAF, &n_termio);    // set new term options
 #endif
     termSave->flags = fcntl(0, F_GETFL, 0);
-    fcntl(0, F_SETFL, termSave->flags | O_NDELAY); // set stdin for no delay
-    keyInited = FALSE;                  // (returns -1 if no key)
+    keyInited = FALSE;
+    outStr("\033[?2004h");             // bracketed paste on
+}
+
+// ----------------------------------------------------------------------------
+// Set up a terminal that shows nothing, for running without a screen:
+// every capability is empty, the screen is 80x24, and output is dropped.
+
+void iNullTerm()
+{
+#ifdef TERMCAPS
+    CL = CM = CE = (char*)"";
+    MD = MR = US = ME = (char*)"";
+    AF = AB = (char*)"";
+    CS = SF = SR = AL = DL = 0;         // can't scroll
+    CLlength = CElength = 0;
+#endif
+    screenHt = 24;
+    screenWd = 80;
+    noTerminal = TRUE;
+    keyInited = FALSE;
+}
+
+// ----------------------------------------------------------------------------
+// Write out the buffered screen output.
+
+void outFlush()
+{
+    if (noTerminal)
+        outLen = 0;
+    const char* p = outBuf;
+    int n = outLen;
+    while (n > 0)
+    {
+        ssize_t nOut = write(1, p, n);
+        if (nOut < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        p += nOut;
+        n -= nOut;
+        outStats.writes++;
+    }
+    outStats.bytes += outLen;
+    outLen = 0;
+    escStart = sgrStart = sgrEnd = moveStart = moveEnd = -1;
+}
+
+// ----------------------------------------------------------------------------
+// Flush output at the end of a screen update, and count it as a frame.
+
+void outFrame()
+{
+    outFlush();
+    if (outStats.bytes == frameBytes)
+        return;
+    outStats.frames++;
+    outStats.frameBytes = outStats.bytes - frameBytes;
+    outStats.frameWrites = outStats.writes - frameWrites;
+    frameBytes = outStats.bytes;
+    frameWrites = outStats.writes;
+}
+
+// ----------------------------------------------------------------------------
+// An SGR sequence just ended at outLen: if it directly follows another,
+// merge the two. A reset ("0" or no parameters) replaces the one before, and
+// is dropped if the attributes are reset already.
+
+static void endSGR()
+{
+    int start = escStart;
+    escStart = -1;
+    char* params = outBuf + start + 2;
+    int n = outLen - start - 2;         // parameters and final 'm'
+    bool reset = n == 1 || (n == 2 && params[0] == '0');
+    if (reset && sgrReset)
+    {
+        outLen = start;
+        outStats.sgrDropped++;
+        return;
+    }
+    sgrReset = reset;
+    if (sgrStart < 0 || sgrEnd != start)
+    {
+        sgrStart = start;
+        sgrEnd = outLen;
+        return;
+    }
+
+    if (n == 1 || (params[0] == '0' && (params[1] == ';' || params[1] == 'm')))
+    {
+        memmove(outBuf + sgrStart, outBuf + start, n + 2);
+        outLen = sgrStart + n + 2;
+    }
+    else
+    {
+        if (sgrEnd - sgrStart == 3)     // "\e[m" becomes "\e[0;"
+            outBuf[sgrEnd++ - 1] = '0';
+        outBuf[sgrEnd - 1] = ';';
+        memmove(outBuf + sgrEnd, params, n);
+        outLen = sgrEnd + n;
+    }
+    sgrEnd = outLen;
+    outStats.sgrMerged++;
+}
+
+// ----------------------------------------------------------------------------
+// Send a character to the terminal, through the output buffer.
+
+void outChar(int ch)
+{
+    if (escStart < 0 && outLen >= OUT_MAX - OUT_SLACK)
+        outFlush();
+    outBuf[outLen++] = (char)ch;
+
+    if (escStart >= 0)
+    {
+        int n = outLen - escStart;
+        if (n == 2)
+        {
+            if (ch != '[')              // not a control sequence: may do
+            {                           // anything
+                escStart = -1;
+                cursorKnown = sgrReset = FALSE;
+            }
+        }
+        else if (ch == 'm')
+            endSGR();
+        else if (!((ch >= '0' && ch <= '9') || ch == ';') || n > OUT_SLACK/2)
+        {
+            escStart = -1;              // a control sequence other than SGR
+            cursorKnown = FALSE;
+            if (n > OUT_SLACK/2)
+                sgrReset = FALSE;
+        }
+    }
+    else if (ch == '\e')
+        escStart = outLen - 1;
+    else
+        cursorKnown = FALSE;            // drawn, or a control character
+}
+
+// ----------------------------------------------------------------------------
+// Send a string to the terminal.
+
+void outStr(const char* s)
+{
+    while (*s)
+        outChar(*s++);
 }
 
 // ----------------------------------------------------------------------------
@@ -167,7 +373,119 @@ void iTermCaps(termOptStr* termSave)
 
 int tputc(tputc_t ch)
 {
-    return putchar(ch);
+    outChar(ch);
+    return ch;
+}
+
+// ----------------------------------------------------------------------------
+// Move screen cursor to row,col, using the cached motion string if there
+// is one. A motion that directly follows another replaces it, and one to
+// where the cursor is already isn't sent.
+
+static int gotCol, gotRow;              // where gotoxy() last went
+
+void gotoxy(int col, int row)
+{
+    if (cursorKnown && col == gotCol && row == gotRow)
+    {
+        outStats.movesDropped++;
+        return;
+    }
+    gotCol = col;
+    gotRow = row;
+    if (moveEnd == outLen)
+        outLen = moveStart;
+    MoveStr* m = &moveCache[(row*SCRMAXWD + col) & (MOVE_CACHE-1)];
+    if (m->len && m->row == row && m->col == col)
+    {
+        moveStart = outLen;
+        for (int i = 0; i < m->len; i++)
+            outChar(m->s[i]);
+        moveEnd = outLen;
+        cursorKnown = TRUE;
+        outStats.movesCached++;
+        return;
+    }
+
+    long bytes = outStats.bytes;
+    int start = moveStart = outLen;
+#ifdef TERMCAPS
+    tputs(tgoto(CM, col, row), 1, tputc);
+#else
+    tputs(tparm(myCurAdr, row, col), 1, tputc);
+#endif
+    int n = outLen - start;
+    if (outStats.bytes == bytes && n > 0 && n <= (int)sizeof(m->s))
+    {
+        m->row = row;
+        m->col = col;
+        m->len = n;
+        memcpy(m->s, outBuf + start, n);
+    }
+    moveEnd = outStats.bytes == bytes ? outLen : -1;
+    cursorKnown = TRUE;
+}
+
+// ----------------------------------------------------------------------------
+// Get where gotoxy() last put the cursor, so that something drawn from a
+// timer can put it back.
+
+void cursorAt(int* col, int* row)
+{
+    *col = gotCol;
+    *row = gotRow;
+}
+
+// ----------------------------------------------------------------------------
+// Scroll screen rows top to bot up n rows (down if n < 0), leaving blank
+// rows. Uses a scroll region if the terminal has them, else deletes and
+// inserts lines. Returns FALSE if it can do neither.
+
+bool scrollRows(int top, int bot, int n)
+{
+#ifdef TERMCAPS
+    const char* cs = CS;
+    const char* sf = SF;
+    const char* sr = SR;
+    const char* al = AL;
+    const char* dl = DL;
+#else
+    const char* cs = myCsr[0] ? myCsr : 0;
+    const char* sf = mySf[0] ? mySf : 0;
+    const char* sr = mySr[0] ? mySr : 0;
+    const char* al = myIl[0] ? myIl : 0;
+    const char* dl = myDl[0] ? myDl : 0;
+#endif
+    int count = n > 0 ? n : -n;
+    if (cs && sf && sr)
+    {
+#ifdef TERMCAPS
+        tputs(tgoto(cs, bot, top), 1, tputc);
+#else
+        tputs(tparm((char*)cs, top, bot), 1, tputc);
+#endif
+        gotoxy(0, n > 0 ? bot : top);
+        for (int i = 0; i < count; i++)
+            tputs(n > 0 ? sf : sr, 1, tputc);
+#ifdef TERMCAPS
+        tputs(tgoto(cs, screenHt-1, 0), 1, tputc);
+#else
+        tputs(tparm((char*)cs, 0, screenHt-1), 1, tputc);
+#endif
+    }
+    else if (al && dl)
+    {
+        // the lines pushed below bot are pulled back up, and vice versa
+        gotoxy(0, n > 0 ? top : bot - count + 1);
+        for (int i = 0; i < count; i++)
+            tputs(dl, 1, tputc);
+        gotoxy(0, n > 0 ? bot - count + 1 : top);
+        for (int i = 0; i < count; i++)
+            tputs(al, 1, tputc);
+    }
+    else
+        return FALSE;
+    return TRUE;
 }
 
 #ifndef TERMCAPS    // terminfo-based screen routines:
@@ -220,14 +538,6 @@ void normalMode()
     tputs(myNorm, 1, tputc);
 }
 
-// ----------------------------------------------------------------------------
-// Move screen cursor to row,col.
-
-void gotoxy(int col, int row)
-{
-    tputs(tparm(myCurAdr, row, col), 1, tputc);
-}
-
 // ----------------------------------------------------------------------------
 // Set foreground color.
 